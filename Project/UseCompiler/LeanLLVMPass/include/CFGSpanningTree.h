@@ -0,0 +1,53 @@
+#ifndef LLP_CFG_SPANNING_TREE_H
+#define LLP_CFG_SPANNING_TREE_H
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+
+#include <utility>
+#include <vector>
+
+/*
+边计数的插桩位置
+
+给 CFG 加一个虚拟节点：虚拟节点到入口块一条边，每个没有后继的块（ret、unreachable 等）到虚拟节点一条边。
+这样每个节点都满足流守恒：流入次数之和 = 流出次数之和。
+在这张图上取一棵最大生成树，只给不在树上的边放计数器，树上的边都可以由守恒关系从叶子往里解出来。
+边的权重是 BlockFrequencyInfo 估计的执行频率，越热的边越可能在树上，不用插桩。
+块之间有多条边时（比如 switch 的几个 case 跳到同一个块）算一条边。
+
+间接跳转、invoke 的异常边这类拆不开的关键边权重最大，优先放进树里。
+*/
+
+struct CFGEdge {
+    // 为空表示虚拟节点
+    llvm::BasicBlock *Src;
+    llvm::BasicBlock *Dst;
+    uint64_t Weight;
+    bool InTree;
+};
+
+class CFGSpanningTree {
+public:
+    explicit CFGSpanningTree(llvm::Function &F);
+
+    // Edges[0] 是虚拟节点到入口块的边
+    std::vector<CFGEdge> Edges;
+    // 不在树上的边都能插计数器。有拆不开的关键边落在树外时为 false
+    bool Instrumentable;
+
+    // 求一条树上的边：Edges[Edge] = Σ Sign * Edges[Term]
+    struct Step {
+        unsigned Edge;
+        std::vector<std::pair<unsigned, int>> Terms;
+    };
+    // 按依赖顺序排好，每一步用到的边要么不在树上，要么前面已经求出来了
+    std::vector<Step> solve() const;
+    // 每个块的流入边，按函数里块的顺序
+    std::vector<std::vector<unsigned>> inEdges() const;
+
+private:
+    llvm::Function &F;
+};
+
+#endif
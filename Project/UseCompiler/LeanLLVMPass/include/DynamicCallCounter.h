@@ -1,9 +1,37 @@
 #ifndef LLP_INSTRUMENT_BASIC_H
 #define LLP_INSTRUMENT_BASIC_H
 
+#include <cstdint>
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 
+// -dcc-output 写出的二进制剖析文件，本机字节序：DCCProfileHeader 后面跟 NumFuncs 个 DCCProfileRecord，
+// 再跟 NumBlocks 个 DCCProfileBlockRecord（只有 -dcc-blocks 时才有）
+// GUID 是 Function::getGUID(F.getGlobalIdentifier())，用同一个模块可以查回函数名
+const uint32_t DCCProfileMagic = 0x50434344; // "DCCP"
+const uint32_t DCCProfileVersion = 2;
+
+struct DCCProfileHeader {
+  uint32_t Magic;
+  uint32_t Version;
+  uint64_t NumFuncs;
+  // 采样率，1 表示没有采样。次数已经乘过了
+  uint64_t SampleRate;
+  uint64_t NumBlocks;
+};
+
+struct DCCProfileRecord {
+  uint64_t GUID;
+  uint64_t Count;
+};
+
+// Block 是块在插桩前的函数里的序号。块次数不采样
+struct DCCProfileBlockRecord {
+  uint64_t GUID;
+  uint64_t Block;
+  uint64_t Count;
+};
+
 // 接口
 struct DynamicCallCounter : public llvm::PassInfoMixin<DynamicCallCounter> {
   llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
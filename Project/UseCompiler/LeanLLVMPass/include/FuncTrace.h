@@ -0,0 +1,37 @@
+#ifndef LLP_FUNC_TRACE_H
+#define LLP_FUNC_TRACE_H
+
+#include <cstdint>
+
+/*
+InjectFuncCall -ifc-buffered 写出的二进制跟踪文件，本机字节序。
+文件开头一个 FuncTraceHeader，后面是一串 16 字节的 FuncTraceRecord：
+- 普通记录：函数 FuncId 被调用，有 NumArgs 个参数，Timestamp 是 steady_clock 的纳秒数。
+- NumArgs == FuncTraceNameTag 时是名字记录：FuncId 的函数名紧跟在后面，Timestamp 是名字的字节数，
+  补 0 到 8 字节对齐。名字记录总在这个 FuncId 的普通记录之前。
+各线程的记录按块交错写入，同一线程内按时间顺序，解码时按 Timestamp 排序。
+*/
+const uint32_t FuncTraceMagic = 0x54434649; // "IFCT"
+const uint32_t FuncTraceVersion = 1;
+const uint32_t FuncTraceNameTag = UINT32_MAX;
+
+struct FuncTraceHeader {
+  uint32_t Magic;
+  uint32_t Version;
+};
+
+struct FuncTraceRecord {
+  uint32_t FuncId;
+  uint32_t NumArgs;
+  uint64_t Timestamp;
+};
+
+// 运行时的接口，插桩代码调用
+extern "C" {
+// 登记一个模块的 N 个函数名，返回这个模块的第一个 FuncId
+uint32_t __ift_register(const char **Names, uint32_t N);
+// 函数入口
+void __ift_enter(uint32_t FuncId, uint32_t NumArgs);
+}
+
+#endif
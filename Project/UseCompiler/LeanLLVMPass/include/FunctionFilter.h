@@ -0,0 +1,58 @@
+#ifndef LLP_FUNCTION_FILTER_H
+#define LLP_FUNCTION_FILTER_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Regex.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+插桩 pass 共用的函数过滤
+
+每个 pass 用自己的前缀定义一组选项，多个插件一起加载时不会重名。以前缀 dcc 为例：
+- -dcc-allow=<regex>：只插桩名字匹配的函数，可以给多个，逗号隔开
+- -dcc-deny=<regex>：不插桩名字匹配的函数，优先于 allow
+  正则要匹配整个函数名，-dcc-deny=foo 只去掉 foo，不去掉 foobar；要按子串匹配写成 .*foo.*
+- -dcc-filter-file=<file>：每行一个函数名，加进 allow；! 开头的加进 deny；# 开头的是注释
+- -dcc-skip-hot=<profile>：DynamicCallCounter -dcc-output 写的剖析文件。调用次数不少于 -dcc-hot-calls、
+  指令数不超过 -dcc-hot-max-insts 的函数不插桩，这些又热又小的函数插桩开销占大头
+没有 allow 时默认都插桩。
+*/
+
+struct FunctionFilterOptions {
+    explicit FunctionFilterOptions(llvm::StringRef Prefix);
+
+private:
+    // 选项名要比选项活得久，放在选项前面初始化
+    std::string AllowName, DenyName, FileName, HotProfileName, HotCallsName, HotInstsName;
+
+public:
+    llvm::cl::list<std::string> Allow;
+    llvm::cl::list<std::string> Deny;
+    llvm::cl::opt<std::string> File;
+    llvm::cl::opt<std::string> HotProfile;
+    llvm::cl::opt<uint64_t> HotCalls;
+    llvm::cl::opt<unsigned> HotMaxInsts;
+};
+
+class FunctionFilter {
+public:
+    // 读名字文件和剖析文件，读不了直接报错退出
+    explicit FunctionFilter(const FunctionFilterOptions &Opts);
+
+    bool shouldInstrument(const llvm::Function &F) const;
+
+private:
+    const FunctionFilterOptions &Opts;
+    std::vector<std::unique_ptr<llvm::Regex>> AllowRegex, DenyRegex;
+    llvm::StringSet<> AllowNames, DenyNames;
+    // GUID --> 调用次数
+    llvm::DenseMap<uint64_t, uint64_t> Calls;
+};
+
+#endif
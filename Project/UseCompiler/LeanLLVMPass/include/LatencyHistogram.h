@@ -0,0 +1,13 @@
+#ifndef LLP_LATENCY_HISTOGRAM_H
+#define LLP_LATENCY_HISTOGRAM_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Pass.h"
+
+// 接口
+struct LatencyHistogram : public llvm::PassInfoMixin<LatencyHistogram> {
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+  bool runOnModule(llvm::Module &M);
+};
+
+#endif
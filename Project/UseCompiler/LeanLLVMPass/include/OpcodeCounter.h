@@ -1,19 +1,51 @@
 #ifndef LLP_OPCODECOUNTER_H
 #define LLP_OPCODECOUNTER_H
 
-#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <array>
+#include <cstdint>
+
+// 指令按类型分的大类。没有结果的指令（store、br 等）看第一个操作数
+enum OpcodeTypeClass : unsigned { OTC_Int, OTC_FP, OTC_Vector, OTC_Pointer, OTC_Other, OTC_NumClasses };
+
+// 按 Instruction::getOpcode() 下标的计数，统计时不用算字符串的哈希，打印时才换成名字。
+// 静态计数用 uint64_t，按块频率加权的估计执行次数用 double
+template <typename CountT> struct BasicOpcodeHistogram {
+  static const unsigned NumOpcodes = llvm::Instruction::OtherOpsEnd;
+  std::array<std::array<CountT, OTC_NumClasses>, NumOpcodes> Counts{};
+
+  void add(const llvm::Instruction &I, CountT Weight = 1);
+  // 这个 opcode 所有大类加起来
+  CountT count(unsigned Opcode) const;
+  BasicOpcodeHistogram &operator+=(const BasicOpcodeHistogram &Other);
+};
+
+using OpcodeHistogram = BasicOpcodeHistogram<uint64_t>;
+using WeightedOpcodeHistogram = BasicOpcodeHistogram<double>;
+
+// 静态计数打印成整数，加权的估计次数保留两位小数
+llvm::format_object<int, unsigned long> formatOpcodeCount(uint64_t Count, int Width);
+llvm::format_object<int, double> formatOpcodeCount(double Count, int Width);
+
+// 打印成 OpcodeCounter 的表格，-opcode-counter-by-type 时按类型分列，见 OpcodeHistogram.cpp
+template <typename CountT>
+void printOpcodeCounterResult(llvm::raw_ostream &OutS, const BasicOpcodeHistogram<CountT> &OpcodeMap);
+
 // 接口
-using ResultOpcodeCounter = llvm::StringMap<unsigned>;
+using ResultOpcodeCounter = OpcodeHistogram;
 
 struct OpcodeCounter : public llvm::AnalysisInfoMixin<OpcodeCounter> {
   using Result = ResultOpcodeCounter;
   Result run(llvm::Function &F, llvm::FunctionAnalysisManager &AM);
-  OpcodeCounter::Result generateOpcodeMap(llvm::Function &F);
+  // 只读函数，不依赖分析管理器，可以在多个线程里同时调用
+  static OpcodeCounter::Result generateOpcodeMap(const llvm::Function &F);
 
   // 官方接口
   // https://llvm.org/docs/WritingAnLLVMNewPMPass.html#required-passes
@@ -25,10 +57,28 @@ private:
 
 };
 
-// 接口用于打印 pass
+// 每个块的指令按块的执行次数加权，估计实际执行的指令构成。
+// 函数带 !prof 时用 profile 的执行次数，否则用 BFI 估计的相对频率（入口块为 1）
+struct WeightedOpcodeMix {
+  WeightedOpcodeHistogram Histogram;
+  bool FromProfile = false;
+};
+
+struct WeightedOpcodeCounter : public llvm::AnalysisInfoMixin<WeightedOpcodeCounter> {
+  using Result = WeightedOpcodeMix;
+  Result run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM);
+  static Result generateWeightedMix(const llvm::Function &F, const llvm::BlockFrequencyInfo &BFI);
+
+  static bool isRequired() { return true; }
+private:
+  static llvm::AnalysisKey Key;
+  friend struct llvm::AnalysisInfoMixin<WeightedOpcodeCounter>;
+};
+
+// 接口用于打印 pass，Weighted 时打印 WeightedOpcodeCounter 的结果
 class OpcodeCounterPrinter : public llvm::PassInfoMixin<OpcodeCounterPrinter> {
 public:
-  explicit OpcodeCounterPrinter(llvm::raw_ostream &OutS) : OS(OutS) {}
+  explicit OpcodeCounterPrinter(llvm::raw_ostream &OutS, bool Weighted = false) : OS(OutS), Weighted(Weighted) {}
   llvm::PreservedAnalyses run(llvm::Function &Func,
                                      llvm::FunctionAnalysisManager &FAM);
   // 官方接口   
@@ -37,6 +87,21 @@ public:
 
 private:
   llvm::raw_ostream &OS;
+  bool Weighted;
+};
+
+// 整个模块一次统计：各个函数并行统计再汇总，打印模块的总表，
+// 还可以用 -opcode-counter-json、-opcode-counter-csv 写出每个函数和模块总计
+class OpcodeCounterModulePrinter : public llvm::PassInfoMixin<OpcodeCounterModulePrinter> {
+public:
+  explicit OpcodeCounterModulePrinter(llvm::raw_ostream &OutS, bool Weighted = false)
+      : OS(OutS), Weighted(Weighted) {}
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &MAM);
+  static bool isRequired() { return true; }
+
+private:
+  llvm::raw_ostream &OS;
+  bool Weighted;
 };
 
 
@@ -0,0 +1,68 @@
+#ifndef LLP_OPCODE_COUNTER_CACHE_H
+#define LLP_OPCODE_COUNTER_CACHE_H
+
+#include "OpcodeCounter.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Function.h"
+
+#include <cstdint>
+#include <mutex>
+
+/*
+OpcodeCounter 加权统计的磁盘缓存，print<opcode-counter-module-weighted> 加 -opcode-counter-cache=<file> 时使用
+
+键是函数的结构哈希：块和指令的顺序、opcode、类型、操作数（函数内的值用序号，常量用值，全局用名字）、
+比较的谓词、调用点的 cold/noreturn、!prof 元数据和模块的 target triple，也就是影响 opcode 计数和
+BPI/BFI 结果的东西，和函数名、值的名字无关。哈希用 xxHash64，不同进程、不同机器上结果一样。
+
+计算哈希要走一遍函数的所有指令，和静态计数的开销差不多，所以只缓存加权的结果，省下的是 DT、LoopInfo、BPI、BFI。
+文件里只留本次用到的条目，旧函数的结果不会越积越多，所以一个模块用一个缓存文件。
+opcode 的编号随 LLVM 版本变，文件头记了 LLVM 主版本和 opcode 个数，对不上时整个文件不用。
+*/
+
+const uint32_t OCCacheMagic = 0x4343434f; // "OCCC"
+const uint32_t OCCacheVersion = 1;
+
+struct OCCacheHeader {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t LLVMMajor;
+    uint32_t NumOpcodes;
+    uint32_t NumClasses;
+    uint32_t Reserved;
+    uint64_t NumEntries;
+};
+
+// 后面跟 NumOpcodes * NumClasses 个 double，顺序和 WeightedOpcodeHistogram::Counts 一样
+struct OCCacheEntry {
+    uint64_t Hash;
+    uint64_t FromProfile;
+};
+
+uint64_t hashFunctionStructure(const llvm::Function &F);
+
+class OpcodeCounterCache {
+public:
+    // 文件不存在、格式或版本不对时从空缓存开始
+    explicit OpcodeCounterCache(llvm::StringRef Path);
+
+    // 多个线程可以同时调用
+    bool lookup(uint64_t Hash, WeightedOpcodeMix &Mix);
+    void insert(uint64_t Hash, const WeightedOpcodeMix &Mix);
+
+    // 先写临时文件再改名，多个进程同时写同一个文件时不会留下写了一半的文件
+    bool save();
+
+    unsigned hits() const { return Hits; }
+    unsigned misses() const { return Misses; }
+
+private:
+    std::string Path;
+    llvm::DenseMap<uint64_t, WeightedOpcodeMix> Loaded;
+    // 本次用到的条目，save 时只写这些
+    llvm::DenseMap<uint64_t, WeightedOpcodeMix> Used;
+    std::mutex Lock;
+    unsigned Hits = 0, Misses = 0;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define LLP_STATICCALLCOUNTER_H
 
 #include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/AbstractCallSite.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
@@ -24,6 +25,12 @@ private:
     friend struct llvm::AnalysisInfoMixin<StaticCallCounter>;
 };
 
+// 按函数名汇总的结果。static 工具合并多个模块时用，模块释放以后 Function 指针就不能用了。
+// 合并多个模块时内部链接的函数用 getGlobalIdentifier()（源文件名:函数名）做键
+using NamedStaticCC = llvm::MapVector<std::string, unsigned, llvm::StringMap<unsigned>>;
+// 美化输出
+void printStaticCCResult(llvm::raw_ostream &OutS, const NamedStaticCC &DirectCalls);
+
 // 打印的接口
 class StaticCallCounterPrinter : public llvm::PassInfoMixin<StaticCallCounterPrinter> {
 public:
@@ -0,0 +1,47 @@
+#ifndef LLP_VALUE_PROFILE_H
+#define LLP_VALUE_PROFILE_H
+
+#include "ValueProfileData.h"
+#include <vector>
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Pass.h"
+
+/*
+值剖析
+
+ValueProfiler（value-prof）在这些位置记录运行时的值：
+- 整数除法、取余的除数
+- switch 的条件
+- 间接调用的目标
+每个位置在运行时库里保留出现最多的 VPTopK 个值，退出时写成二进制文件，格式见 ValueProfileData.h。
+
+ValueSpecializer（value-spec）读这个文件，对某个值占绝大多数的位置加一条快速路径：
+- 除法：d == C ? x / C : x / d，常数除法后面会被 instcombine 换成乘法和移位
+- switch：先比较最常见的值，命中直接跳到对应的分支，不走跳转表
+- 间接调用：fp == @F ? F(...) : fp(...)，直接调用可以内联
+位置用 (函数 GUID, 函数里的序号) 标识，两个 pass 都用 collectValueSites 枚举，所以要在同一份未插桩的 IR 上运行。
+*/
+
+// 一个要剖析的位置：I 执行前 Operand 的值
+struct ValueSite {
+  llvm::Instruction *I;
+  VPKind Kind;
+  llvm::Value *Operand;
+};
+
+// 按函数里的顺序枚举所有位置，操作数是常量的不算
+std::vector<ValueSite> collectValueSites(llvm::Function &F);
+
+// 接口
+struct ValueProfiler : public llvm::PassInfoMixin<ValueProfiler> {
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+  bool runOnModule(llvm::Module &M);
+};
+
+struct ValueSpecializer : public llvm::PassInfoMixin<ValueSpecializer> {
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+  bool runOnModule(llvm::Module &M);
+};
+
+#endif
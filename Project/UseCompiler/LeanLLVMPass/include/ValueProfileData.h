@@ -0,0 +1,65 @@
+#ifndef LLP_VALUE_PROFILE_DATA_H
+#define LLP_VALUE_PROFILE_DATA_H
+
+#include <cstdint>
+
+/*
+ValueProfiler 写出的二进制剖析文件，本机字节序：VPProfileHeader 后面跟 NumRecords 个 VPProfileRecord。
+同一个位置可能有多条记录（多个文件合在一起时），读的时候按 (FuncGUID, Index) 合并。
+间接调用的目标写的是函数的 GUID，Function::getGUID(F.getGlobalIdentifier())，地址每次运行不一样。
+运行时库不依赖 LLVM，只用这个头文件。
+*/
+
+const uint32_t VPProfileMagic = 0x46525056; // "VPRF"
+const uint32_t VPProfileVersion = 1;
+const unsigned VPTopK = 4;
+
+enum VPKind : uint32_t { VPDivisor = 0, VPSwitchCond = 1, VPCallTarget = 2 };
+
+struct VPEntry {
+  uint64_t Value;
+  uint64_t Count;
+};
+
+struct VPProfileHeader {
+  uint32_t Magic;
+  uint32_t Version;
+  uint64_t NumRecords;
+};
+
+// Total 是这个位置执行的次数，Entries 的 Count 是下界
+struct VPProfileRecord {
+  uint64_t FuncGUID;
+  uint32_t Index;
+  uint32_t Kind;
+  uint64_t Total;
+  VPEntry Entries[VPTopK];
+};
+
+// 运行时里每个位置的计数，插桩时生成的全局变量和它的布局一样
+struct VPSite {
+  uint64_t FuncGUID;
+  uint32_t Index;
+  uint32_t Kind;
+  uint64_t Total;
+  VPEntry Entries[VPTopK];
+  VPSite *Next;
+  uint32_t Registered;
+  uint32_t Lock;
+};
+
+// 间接调用目标的地址到 GUID
+struct VPFunc {
+  const void *Addr;
+  uint64_t GUID;
+};
+
+// 运行时的接口，插桩代码调用
+extern "C" {
+void __vp_record(VPSite *Site, uint64_t Value);
+void __vp_register_funcs(const VPFunc *Funcs, uint64_t N);
+// 把目前所有位置写到 VP_PROFILE
+void __vp_dump();
+}
+
+#endif
@@ -0,0 +1,173 @@
+/*
+边计数的最大生成树，见 CFGSpanningTree.h。DynamicCallCounter 插桩时和读结果时都用它，同一份 IR 得到的树总是一样的。
+*/
+
+#include "CFGSpanningTree.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+
+#include <algorithm>
+#include <numeric>
+
+using namespace llvm;
+
+// 不拆边就能插计数器，或者拆得开
+static bool canInstrument(BasicBlock *Src, BasicBlock *Dst) {
+    if (!Src || !Dst || Src->getUniqueSuccessor() == Dst || Dst->getUniquePredecessor() == Src) {
+        return true;
+    }
+    Instruction *Term = Src->getTerminator();
+    return (isa<BranchInst>(Term) || isa<SwitchInst>(Term)) && !Dst->isEHPad();
+}
+
+// 块在函数里的序号
+static DenseMap<const BasicBlock *, unsigned> indexBlocks(Function &F) {
+    DenseMap<const BasicBlock *, unsigned> Index;
+    unsigned N = 0;
+    for (BasicBlock &BB : F) {
+        Index[&BB] = N++;
+    }
+    return Index;
+}
+
+// 并查集
+static unsigned findRoot(std::vector<unsigned> &Parent, unsigned X) {
+    while (Parent[X] != X) {
+        X = Parent[X] = Parent[Parent[X]];
+    }
+    return X;
+}
+
+CFGSpanningTree::CFGSpanningTree(Function &F) : Instrumentable(true), F(F) {
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    BranchProbabilityInfo BPI(F, LI);
+    BlockFrequencyInfo BFI(F, BPI, LI);
+
+    DenseMap<const BasicBlock *, unsigned> Index = indexBlocks(F);
+    unsigned Virtual = Index.size();
+
+    // 入口边权重最大，总是在树上，它的次数就是函数的调用次数
+    Edges.push_back({nullptr, &F.getEntryBlock(), UINT64_MAX, false});
+    for (BasicBlock &BB : F) {
+        uint64_t Freq = BFI.getBlockFreq(&BB).getFrequency();
+        SmallSetVector<BasicBlock *, 4> Succs(succ_begin(&BB), succ_end(&BB));
+        if (Succs.empty()) {
+            Edges.push_back({&BB, nullptr, Freq, false});
+        }
+        for (BasicBlock *Succ : Succs) {
+            uint64_t Weight = canInstrument(&BB, Succ) ? BPI.getEdgeProbability(&BB, Succ).scale(Freq) : UINT64_MAX;
+            Edges.push_back({&BB, Succ, Weight, false});
+        }
+    }
+
+    // Kruskal，权重相同时按边的顺序，插桩和读结果时结果一样
+    std::vector<unsigned> Order(Edges.size());
+    std::iota(Order.begin(), Order.end(), 0);
+    std::stable_sort(Order.begin(), Order.end(), [&](unsigned A, unsigned B) {
+        return Edges[A].Weight > Edges[B].Weight;
+    });
+    std::vector<unsigned> Parent(Virtual + 1);
+    std::iota(Parent.begin(), Parent.end(), 0);
+    for (unsigned E : Order) {
+        unsigned A = findRoot(Parent, Edges[E].Src ? Index[Edges[E].Src] : Virtual);
+        unsigned B = findRoot(Parent, Edges[E].Dst ? Index[Edges[E].Dst] : Virtual);
+        if (A != B) {
+            Parent[A] = B;
+            Edges[E].InTree = true;
+        } else if (!canInstrument(Edges[E].Src, Edges[E].Dst)) {
+            Instrumentable = false;
+        }
+    }
+}
+
+std::vector<std::vector<unsigned>> CFGSpanningTree::inEdges() const {
+    DenseMap<const BasicBlock *, unsigned> Index = indexBlocks(F);
+    std::vector<std::vector<unsigned>> In(Index.size());
+    for (unsigned E = 0; E < Edges.size(); E++) {
+        if (Edges[E].Dst) {
+            In[Index[Edges[E].Dst]].push_back(E);
+        }
+    }
+    return In;
+}
+
+std::vector<CFGSpanningTree::Step> CFGSpanningTree::solve() const {
+    DenseMap<const BasicBlock *, unsigned> Index = indexBlocks(F);
+    unsigned Virtual = Index.size();
+    auto NodeOf = [&](BasicBlock *BB) { return BB ? Index[BB] : Virtual; };
+
+    // 每个节点的流入、流出边和还没求出来的树边数
+    std::vector<std::vector<unsigned>> In(Virtual + 1), Out(Virtual + 1);
+    std::vector<unsigned> Unknown(Virtual + 1, 0);
+    std::vector<bool> Known(Edges.size());
+    for (unsigned E = 0; E < Edges.size(); E++) {
+        unsigned S = NodeOf(Edges[E].Src), D = NodeOf(Edges[E].Dst);
+        Out[S].push_back(E);
+        In[D].push_back(E);
+        Known[E] = !Edges[E].InTree;
+        if (Edges[E].InTree) {
+            Unknown[S]++;
+            Unknown[D]++;
+        }
+    }
+
+    // 从叶子往里剥：只剩一条未知树边的节点，用守恒关系求出这条边
+    std::vector<Step> Steps;
+    std::vector<unsigned> Work;
+    for (unsigned V = 0; V <= Virtual; V++) {
+        if (Unknown[V] == 1) {
+            Work.push_back(V);
+        }
+    }
+    while (!Work.empty()) {
+        unsigned V = Work.back();
+        Work.pop_back();
+        if (Unknown[V] != 1) {
+            continue;
+        }
+        unsigned U = 0;
+        bool UIn = false;
+        for (unsigned E : In[V]) {
+            if (!Known[E]) {
+                U = E;
+                UIn = true;
+            }
+        }
+        for (unsigned E : Out[V]) {
+            if (!Known[E]) {
+                U = E;
+                UIn = false;
+            }
+        }
+
+        // 流入之和 = 流出之和。自环两边都有，抵消掉
+        Step S;
+        S.Edge = U;
+        for (unsigned E : In[V]) {
+            if (E != U && Edges[E].Src != Edges[E].Dst) {
+                S.Terms.push_back({E, UIn ? -1 : 1});
+            }
+        }
+        for (unsigned E : Out[V]) {
+            if (E != U && Edges[E].Src != Edges[E].Dst) {
+                S.Terms.push_back({E, UIn ? 1 : -1});
+            }
+        }
+        Steps.push_back(std::move(S));
+
+        Known[U] = true;
+        unsigned Other = UIn ? NodeOf(Edges[U].Src) : NodeOf(Edges[U].Dst);
+        Unknown[V]--;
+        if (--Unknown[Other] == 1) {
+            Work.push_back(Other);
+        }
+    }
+    return Steps;
+}
@@ -19,22 +19,316 @@ store i32 %2, i32* %CounterFor_F
 
 这个 pass 将只计算输入模块中定义了的函数调用进行统计。只是声明了的不做统计。
 
+多线程程序里上面的 load/add/store 会丢计数，而且所有计数器挨在一起，不同线程改不同计数器也会抢同一条缓存行。
+-dcc-counters 可以换成 64 位的计数器：
+- tls：每个线程第一次进入被统计的函数时 aligned_alloc 一块按缓存行对齐的计数器，挂到全局链表上，之后只改自己这块，
+  不用原子操作。线程退出后这块内存不释放，计数还在。
+- sharded：-dcc-shards 个按缓存行对齐的分片，按线程局部变量的地址散列选分片，用 atomicrmw add。入口不用加分支。
+两种模式都在 printf_wrapper 里先把各块加起来再打印。
+
+全量计数太慢时可以只统计一部分：
+- -dcc-sample=N：每个线程一个倒数计数器，每 N 次函数调用才真正更新一次计数，一次加 N，报告里是估计值。
+  倒数本身用 select 更新，只有更新计数器时才跳转。
+- -dcc-min-insts=K：只统计至少 K 条指令的函数，小函数调用频繁但开销小，不插桩。
+- -dcc-allow、-dcc-deny、-dcc-filter-file、-dcc-skip-hot：按名字或者上一次的剖析结果挑函数，见 FunctionFilter.h。
+
+-dcc-blocks 时还统计每个基本块的执行次数。不是每个块都放计数器：在 CFG 上取一棵最大生成树（见 CFGSpanningTree.h），
+只给树外的边放 64 位计数器，退出时按流守恒把树上的边解出来，块的次数是流入边之和。
+边计数器每次加 1，不受 -dcc-sample 影响。程序在函数中间 exit 时，那条路径上的块次数不准。
+
+函数很多时退出时逐个 printf 很慢，文本也没法把多次运行的结果加起来。给了 -dcc-output 时改成退出时把
+函数 GUID 和次数一次 fwrite 成二进制文件（格式见 DynamicCallCounter.h），用 tools 里的 dynamic-profile 读、合并。
+
 使用方法：
 opt -load-pass-plugin <BUILD_DIR>/lib/libDynamicCallCounter.so --passes="dynamic-cc" <bitcode-file> -o instrumentend.bin
+opt -load <BUILD_DIR>/lib/libDynamicCallCounter.so -load-pass-plugin <BUILD_DIR>/lib/libDynamicCallCounter.so --passes="dynamic-cc" -dcc-counters=tls <bitcode-file> -o instrumentend.bin
 lli instrumented.bin
 
 */
 
 #include "DynamicCallCounter.h"
+#include "CFGSpanningTree.h"
+#include "FunctionFilter.h"
+#include "llvm/IR/ModuleSlotTracker.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace llvm;
 
 #define DEBUG_TYPE "dynamic-cc"
 
+enum class CounterMode { Plain, TLS, Sharded };
+
+// Pass 的选项声明
+static cl::opt<CounterMode> CounterKind {
+    "dcc-counters",
+    cl::desc("计数器的形式"),
+    cl::values(
+        clEnumValN(CounterMode::Plain, "plain", "每个函数一个 i32 全局变量，多线程时不准（默认）"),
+        clEnumValN(CounterMode::TLS, "tls", "每个线程一块 64 位计数器，退出时合并"),
+        clEnumValN(CounterMode::Sharded, "sharded", "按线程散列到对齐缓存行的分片，原子加，退出时合并")),
+    cl::init(CounterMode::Plain)
+};
+static cl::opt<unsigned> NumShards {
+    "dcc-shards",
+    cl::desc("sharded 模式的分片数，向上取 2 的幂"),
+    cl::value_desc("n"), cl::init(64)
+};
+static cl::opt<unsigned> SampleRate {
+    "dcc-sample",
+    cl::desc("每个线程每 <n> 次调用计一次，报告里的次数是估计值"),
+    cl::value_desc("n"), cl::init(1)
+};
+static cl::opt<unsigned> MinInsts {
+    "dcc-min-insts",
+    cl::desc("只统计至少 <n> 条指令的函数"),
+    cl::value_desc("n"), cl::init(0)
+};
+static FunctionFilterOptions FilterOpts("dcc");
+static cl::opt<bool> CountBlocks {
+    "dcc-blocks",
+    cl::desc("同时统计每个基本块的执行次数，计数器按生成树放在边上"),
+    cl::init(false)
+};
+static cl::opt<std::string> OutputFile {
+    "dcc-output",
+    cl::desc("退出时把计数按二进制写到这个文件，不打印。运行时环境变量 DCC_PROFILE 可以换文件名"),
+    cl::value_desc("filename"), cl::init("")
+};
+
+// 入口块里 alloca 之后的位置，在这里拆块 alloca 还留在入口块
+static Instruction *afterAllocas(Function &F) {
+    BasicBlock::iterator IP = F.getEntryBlock().getFirstInsertionPt();
+    while (isa<AllocaInst>(IP))
+        ++IP;
+    return &*IP;
+}
+
+// 采样：线程局部的倒数减到 0 时重置并返回更新计数器的位置，其余时候什么也不做
+static Instruction *insertSampleCheck(Function &F, GlobalVariable *Countdown) {
+    Instruction *At = afterAllocas(F);
+    IRBuilder<> B(At);
+    Value *Left = B.CreateSub(B.CreateLoad(B.getInt32Ty(), Countdown), B.getInt32(1));
+    Value *Hit = B.CreateICmpEQ(Left, B.getInt32(0));
+    B.CreateStore(B.CreateSelect(Hit, B.getInt32(SampleRate), Left), Countdown);
+    return SplitBlockAndInsertIfThen(Hit, At, false,
+                                     MDBuilder(F.getContext()).createBranchWeights(1, SampleRate - 1));
+}
+
+namespace {
+// tls 和 sharded 模式的计数器。每行 Row 个 i64，行的大小是缓存行的整数倍
+struct ThreadedCounters {
+    Module &M;
+    CounterMode Mode;
+    unsigned NumCounters;
+    uint64_t Row;
+    unsigned Shards = 1;
+    IntegerType *I64;
+    PointerType *I64Ptr;
+    // 合并结果，打印时读这里
+    GlobalVariable *Totals = nullptr;
+    // sharded：[Shards x [Row x i64]]，ShardKey 只用它的线程局部地址
+    GlobalVariable *ShardArray = nullptr;
+    GlobalVariable *ShardKey = nullptr;
+    // tls：当前线程的计数器和所有线程的块组成的链表
+    GlobalVariable *Block = nullptr;
+    GlobalVariable *Threads = nullptr;
+    Function *Register = nullptr;
+
+    ThreadedCounters(Module &M, CounterMode Mode, unsigned NumCounters);
+    // 在 At 之前给第 Idx 个计数器加 Step
+    void instrument(Instruction *At, unsigned Idx, uint64_t Step);
+    // 把所有线程的计数加到 Totals，返回做这件事的函数
+    Function *createMerge();
+    Constant *total(unsigned Idx);
+
+    private:
+    static const unsigned CacheLine = 64;
+    static const unsigned HeaderWords = CacheLine / 8;
+    Function *createRegister();
+    Function *createAddRow();
+};
+} // end namespace
+
+ThreadedCounters::ThreadedCounters(Module &M, CounterMode Mode, unsigned NumCounters)
+    : M(M), Mode(Mode), NumCounters(NumCounters), Row(alignTo(NumCounters, HeaderWords)) {
+    auto &CTX = M.getContext();
+    I64 = Type::getInt64Ty(CTX);
+    I64Ptr = I64->getPointerTo();
+    ArrayType *RowTy = ArrayType::get(I64, Row);
+    Totals = new GlobalVariable(M, RowTy, false, GlobalValue::InternalLinkage,
+                                ConstantAggregateZero::get(RowTy), "DCC.Totals");
+
+    if (Mode == CounterMode::Sharded) {
+        Shards = PowerOf2Ceil(std::max(1u, NumShards.getValue()));
+        ArrayType *ShardsTy = ArrayType::get(RowTy, Shards);
+        ShardArray = new GlobalVariable(M, ShardsTy, false, GlobalValue::InternalLinkage,
+                                        ConstantAggregateZero::get(ShardsTy), "DCC.Shards");
+        ShardArray->setAlignment(Align(CacheLine));
+        ShardKey = new GlobalVariable(M, Type::getInt8Ty(CTX), false, GlobalValue::InternalLinkage,
+                                      ConstantInt::get(Type::getInt8Ty(CTX), 0), "DCC.ShardKey", nullptr,
+                                      GlobalValue::InitialExecTLSModel);
+        return;
+    }
+
+    Block = new GlobalVariable(M, I64Ptr, false, GlobalValue::InternalLinkage,
+                               ConstantPointerNull::get(I64Ptr), "DCC.Block", nullptr,
+                               GlobalValue::InitialExecTLSModel);
+    Threads = new GlobalVariable(M, I64Ptr, false, GlobalValue::InternalLinkage,
+                                 ConstantPointerNull::get(I64Ptr), "DCC.Threads");
+    Register = createRegister();
+}
+
+Constant *ThreadedCounters::total(unsigned Idx) {
+    Constant *Indices[] = {ConstantInt::get(I64, 0), ConstantInt::get(I64, Idx)};
+    return ConstantExpr::getInBoundsGetElementPtr(Totals->getValueType(), Totals, Indices);
+}
+
+// 线程的第一次计数走这里：分配一块 [头 | Row 个计数器]，头的第一个字是链表的 next，
+// 用 cmpxchg 挂到 DCC.Threads 上，返回计数器的起始地址
+Function *ThreadedCounters::createRegister() {
+    auto &CTX = M.getContext();
+    Type *I8Ptr = Type::getInt8PtrTy(CTX);
+    FunctionCallee AlignedAlloc = M.getOrInsertFunction("aligned_alloc", I8Ptr, I64, I64);
+    Function *F = Function::Create(FunctionType::get(I64Ptr, false), GlobalValue::InternalLinkage,
+                                   "DCC.registerThread", M);
+    F->addFnAttr(Attribute::NoInline);
+    F->addFnAttr(Attribute::Cold);
+    BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+    BasicBlock *Loop = BasicBlock::Create(CTX, "push", F);
+    BasicBlock *Done = BasicBlock::Create(CTX, "done", F);
+
+    IRBuilder<> B(Entry);
+    uint64_t Bytes = (HeaderWords + Row) * 8;
+    Value *Mem = B.CreateCall(AlignedAlloc, {B.getInt64(CacheLine), B.getInt64(Bytes)});
+    B.CreateMemSet(Mem, B.getInt8(0), Bytes, MaybeAlign(CacheLine));
+    Value *Head = B.CreateBitCast(Mem, I64Ptr);
+    Value *Counters = B.CreateInBoundsGEP(I64, Head, B.getInt64(HeaderWords));
+    B.CreateStore(Counters, Block);
+    LoadInst *First = B.CreateAlignedLoad(I64Ptr, Threads, MaybeAlign(8));
+    First->setAtomic(AtomicOrdering::Monotonic);
+    B.CreateBr(Loop);
+
+    B.SetInsertPoint(Loop);
+    PHINode *Old = B.CreatePHI(I64Ptr, 2);
+    Old->addIncoming(First, Entry);
+    B.CreateStore(Old, B.CreateBitCast(Head, I64Ptr->getPointerTo()));
+    Value *Pair = B.CreateAtomicCmpXchg(Threads, Old, Head, MaybeAlign(8), AtomicOrdering::Release,
+                                        AtomicOrdering::Monotonic);
+    Old->addIncoming(B.CreateExtractValue(Pair, 0), Loop);
+    B.CreateCondBr(B.CreateExtractValue(Pair, 1), Done, Loop);
+
+    B.SetInsertPoint(Done);
+    B.CreateRet(Counters);
+    return F;
+}
+
+void ThreadedCounters::instrument(Instruction *At, unsigned Idx, uint64_t Step) {
+    IRBuilder<> B(At);
+
+    if (Mode == CounterMode::Sharded) {
+        // 线程局部变量的地址每个线程不同，乘黄金比例取高位当分片号
+        Value *Shard = B.getInt64(0);
+        if (Shards > 1) {
+            Value *Key = B.CreatePtrToInt(ShardKey, I64);
+            Value *Hash = B.CreateMul(Key, B.getInt64(0x9E3779B97F4A7C15ULL));
+            Shard = B.CreateLShr(Hash, 64 - Log2_32(Shards));
+        }
+        Value *Ptr = B.CreateInBoundsGEP(ShardArray->getValueType(), ShardArray,
+                                         {B.getInt64(0), Shard, B.getInt64(Idx)});
+        B.CreateAtomicRMW(AtomicRMWInst::Add, Ptr, B.getInt64(Step), MaybeAlign(8),
+                          AtomicOrdering::Monotonic);
+        return;
+    }
+
+    // tls：这个线程还没有计数器时先注册
+    LoadInst *Counters = B.CreateLoad(I64Ptr, Block);
+    BasicBlock *Head = B.GetInsertBlock();
+    Instruction *Then = SplitBlockAndInsertIfThen(
+        B.CreateIsNull(Counters), At, false,
+        MDBuilder(M.getContext()).createBranchWeights(1, 1 << 20));
+    IRBuilder<> TB(Then);
+    Value *NewCounters = TB.CreateCall(Register);
+
+    B.SetInsertPoint(At);
+    PHINode *Phi = B.CreatePHI(I64Ptr, 2);
+    Phi->addIncoming(Counters, Head);
+    Phi->addIncoming(NewCounters, Then->getParent());
+    Value *Ptr = B.CreateInBoundsGEP(I64, Phi, B.getInt64(Idx));
+    Value *Inc = B.CreateAdd(B.getInt64(Step), B.CreateLoad(I64, Ptr));
+    B.CreateStore(Inc, Ptr);
+}
+
+// DCC.addRow(i64* Row)：Totals[i] += Row[i]
+Function *ThreadedCounters::createAddRow() {
+    auto &CTX = M.getContext();
+    Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {I64Ptr}, false),
+                                   GlobalValue::InternalLinkage, "DCC.addRow", M);
+    BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+    BasicBlock *Loop = BasicBlock::Create(CTX, "loop", F);
+    BasicBlock *Done = BasicBlock::Create(CTX, "done", F);
+
+    IRBuilder<> B(Entry);
+    B.CreateBr(Loop);
+    B.SetInsertPoint(Loop);
+    PHINode *I = B.CreatePHI(I64, 2);
+    I->addIncoming(B.getInt64(0), Entry);
+    Value *Src = B.CreateInBoundsGEP(I64, F->getArg(0), I);
+    Value *Dst = B.CreateInBoundsGEP(Totals->getValueType(), Totals, {B.getInt64(0), I});
+    B.CreateStore(B.CreateAdd(B.CreateLoad(I64, Dst), B.CreateLoad(I64, Src)), Dst);
+    Value *Next = B.CreateAdd(I, B.getInt64(1));
+    I->addIncoming(Next, Loop);
+    B.CreateCondBr(B.CreateICmpULT(Next, B.getInt64(NumCounters)), Loop, Done);
+    B.SetInsertPoint(Done);
+    B.CreateRetVoid();
+    return F;
+}
+
+Function *ThreadedCounters::createMerge() {
+    auto &CTX = M.getContext();
+    Function *AddRow = createAddRow();
+    Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                   GlobalValue::InternalLinkage, "DCC.merge", M);
+    BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+    BasicBlock *Loop = BasicBlock::Create(CTX, "loop", F);
+    BasicBlock *Done = BasicBlock::Create(CTX, "done", F);
+    IRBuilder<> B(Entry);
+
+    if (Mode == CounterMode::Sharded) {
+        // 逐个分片加
+        B.CreateBr(Loop);
+        B.SetInsertPoint(Loop);
+        PHINode *S = B.CreatePHI(I64, 2);
+        S->addIncoming(B.getInt64(0), Entry);
+        B.CreateCall(AddRow, {B.CreateInBoundsGEP(ShardArray->getValueType(), ShardArray,
+                                                  {B.getInt64(0), S, B.getInt64(0)})});
+        Value *Next = B.CreateAdd(S, B.getInt64(1));
+        S->addIncoming(Next, Loop);
+        B.CreateCondBr(B.CreateICmpULT(Next, B.getInt64(Shards)), Loop, Done);
+    } else {
+        // 沿着链表逐个线程加
+        LoadInst *First = B.CreateAlignedLoad(I64Ptr, Threads, MaybeAlign(8));
+        First->setAtomic(AtomicOrdering::Acquire);
+        B.CreateCondBr(B.CreateIsNull(First), Done, Loop);
+        B.SetInsertPoint(Loop);
+        PHINode *Head = B.CreatePHI(I64Ptr, 2);
+        Head->addIncoming(First, Entry);
+        B.CreateCall(AddRow, {B.CreateInBoundsGEP(I64, Head, B.getInt64(HeaderWords))});
+        Value *Next = B.CreateLoad(I64Ptr, B.CreateBitCast(Head, I64Ptr->getPointerTo()));
+        Head->addIncoming(Next, Loop);
+        B.CreateCondBr(B.CreateIsNull(Next), Done, Loop);
+    }
+    B.SetInsertPoint(Done);
+    B.CreateRetVoid();
+    return F;
+}
+
 Constant *CreateGlobalCounter(Module &M, StringRef GlobalVarName) {
     auto &CTX = M.getContext();
     // 这是将一个声明插入 M
@@ -49,6 +343,146 @@ Constant *CreateGlobalCounter(Module &M, StringRef GlobalVarName) {
     return NewGolbalVar;
 }
 
+namespace {
+// -dcc-blocks 时一个函数的边计数器。求解顺序、流入边和块名都要在插桩之前算好，插桩拆边以后块就变了
+struct BlockCounters {
+    Function *F;
+    std::vector<CFGEdge> Edges;
+    std::vector<CFGSpanningTree::Step> Steps;
+    std::vector<std::vector<unsigned>> In;
+    std::vector<std::string> Names;
+    // 这个函数的边在所有边计数器里的起始下标
+    unsigned Base;
+};
+} // end namespace
+
+// 边计数器的地址，参数是所有边里的下标
+using EdgeSlotFn = function_ref<Constant *(unsigned)>;
+
+// 树外的边放计数器的位置：源块只有这一个后继就放在源块末尾，目标块只有这一个前驱就放在目标块开头，否则拆边
+static Instruction *edgeInsertionPoint(const CFGEdge &E) {
+    assert(E.Src && "入口边总在树上");
+    if (!E.Dst || E.Src->getUniqueSuccessor() == E.Dst) {
+        return E.Src->getTerminator();
+    }
+    if (E.Dst->getUniquePredecessor() == E.Src) {
+        return &*E.Dst->getFirstInsertionPt();
+    }
+    Instruction *Term = E.Src->getTerminator();
+    unsigned SuccNum = 0;
+    while (Term->getSuccessor(SuccNum) != E.Dst) {
+        SuccNum++;
+    }
+    BasicBlock *Split = SplitCriticalEdge(Term, SuccNum, CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+    assert(Split && "CFGSpanningTree 保证树外的边拆得开");
+    return Split->getTerminator();
+}
+
+// 退出时按求解顺序算出树上的边
+static void emitSolve(IRBuilder<> &B, ArrayRef<BlockCounters> Blocks, EdgeSlotFn Slot) {
+    for (const BlockCounters &BC : Blocks) {
+        for (const CFGSpanningTree::Step &S : BC.Steps) {
+            Value *Sum = B.getInt64(0);
+            for (auto &Term : S.Terms) {
+                Value *V = B.CreateLoad(B.getInt64Ty(), Slot(BC.Base + Term.first));
+                Sum = Term.second > 0 ? B.CreateAdd(Sum, V) : B.CreateSub(Sum, V);
+            }
+            B.CreateStore(Sum, Slot(BC.Base + S.Edge));
+        }
+    }
+}
+
+// 块的次数是流入边之和，入口块算上虚拟节点进来的那条边
+static Value *emitBlockCount(IRBuilder<> &B, const BlockCounters &BC, unsigned Block, EdgeSlotFn Slot) {
+    Value *Sum = B.getInt64(0);
+    for (unsigned E : BC.In[Block]) {
+        Sum = B.CreateAdd(Sum, B.CreateLoad(B.getInt64Ty(), Slot(BC.Base + E)));
+    }
+    return Sum;
+}
+
+// 退出时写二进制剖析文件的 DCC.dump。整个文件是一个全局变量，头和 GUID 编译时就填好，退出时只填次数
+static Function *createDump(Module &M, ArrayRef<Function *> Counted, StringMap<Constant *> &Counters,
+                            Type *CounterTy, ThreadedCounters *Threaded, ArrayRef<BlockCounters> Blocks,
+                            EdgeSlotFn EdgeSlot) {
+    auto &CTX = M.getContext();
+    IntegerType *I32 = Type::getInt32Ty(CTX);
+    IntegerType *I64 = Type::getInt64Ty(CTX);
+    Type *I8Ptr = Type::getInt8PtrTy(CTX);
+
+    StructType *RecordTy = StructType::get(CTX, {I64, I64});
+    ArrayType *RecordsTy = ArrayType::get(RecordTy, Counted.size());
+    std::vector<Constant *> Records;
+    for (Function *F : Counted) {
+        Records.push_back(ConstantStruct::get(
+            RecordTy, {ConstantInt::get(I64, Function::getGUID(F->getGlobalIdentifier())),
+                       ConstantInt::get(I64, 0)}));
+    }
+    StructType *BlockRecordTy = StructType::get(CTX, {I64, I64, I64});
+    std::vector<Constant *> BlockRecords;
+    for (const BlockCounters &BC : Blocks) {
+        for (unsigned i = 0; i < BC.In.size(); i++) {
+            BlockRecords.push_back(ConstantStruct::get(
+                BlockRecordTy, {ConstantInt::get(I64, Function::getGUID(BC.F->getGlobalIdentifier())),
+                                ConstantInt::get(I64, i), ConstantInt::get(I64, 0)}));
+        }
+    }
+    ArrayType *BlockRecordsTy = ArrayType::get(BlockRecordTy, BlockRecords.size());
+    StructType *ImageTy = StructType::get(CTX, {I32, I32, I64, I64, I64, RecordsTy, BlockRecordsTy});
+    Constant *Init = ConstantStruct::get(
+        ImageTy, {ConstantInt::get(I32, DCCProfileMagic), ConstantInt::get(I32, DCCProfileVersion),
+                  ConstantInt::get(I64, Counted.size()), ConstantInt::get(I64, SampleRate),
+                  ConstantInt::get(I64, BlockRecords.size()), ConstantArray::get(RecordsTy, Records),
+                  ConstantArray::get(BlockRecordsTy, BlockRecords)});
+    auto *Image = new GlobalVariable(M, ImageTy, false, GlobalValue::InternalLinkage, Init, "DCC.Image");
+
+    FunctionCallee Getenv = M.getOrInsertFunction("getenv", I8Ptr, I8Ptr);
+    FunctionCallee Fopen = M.getOrInsertFunction("fopen", I8Ptr, I8Ptr, I8Ptr);
+    FunctionCallee Fwrite = M.getOrInsertFunction("fwrite", I64, I8Ptr, I64, I64, I8Ptr);
+    FunctionCallee Fclose = M.getOrInsertFunction("fclose", I32, I8Ptr);
+
+    Function *Dump = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                      GlobalValue::InternalLinkage, "DCC.dump", M);
+    BasicBlock *Entry = BasicBlock::Create(CTX, "entry", Dump);
+    BasicBlock *Write = BasicBlock::Create(CTX, "write", Dump);
+    BasicBlock *Done = BasicBlock::Create(CTX, "done", Dump);
+    IRBuilder<> B(Entry);
+
+    if (Threaded) {
+        B.CreateCall(Threaded->createMerge());
+    }
+    for (unsigned i = 0; i < Counted.size(); i++) {
+        Value *Count = B.CreateLoad(CounterTy, Counters[Counted[i]->getName()]);
+        Value *Slot = B.CreateInBoundsGEP(ImageTy, Image, {B.getInt32(0), B.getInt32(5), B.getInt64(i), B.getInt32(1)});
+        B.CreateStore(B.CreateZExt(Count, I64), Slot);
+    }
+    emitSolve(B, Blocks, EdgeSlot);
+    uint64_t BlockIdx = 0;
+    for (const BlockCounters &BC : Blocks) {
+        for (unsigned i = 0; i < BC.In.size(); i++, BlockIdx++) {
+            Value *Slot = B.CreateInBoundsGEP(ImageTy, Image,
+                                              {B.getInt32(0), B.getInt32(6), B.getInt64(BlockIdx), B.getInt32(2)});
+            B.CreateStore(emitBlockCount(B, BC, i, EdgeSlot), Slot);
+        }
+    }
+
+    // 环境变量优先，多次运行可以各写各的文件
+    Value *Env = B.CreateCall(Getenv, {B.CreateGlobalStringPtr("DCC_PROFILE")});
+    Value *Path = B.CreateSelect(B.CreateIsNull(Env), B.CreateGlobalStringPtr(OutputFile), Env);
+    Value *File = B.CreateCall(Fopen, {Path, B.CreateGlobalStringPtr("wb")});
+    B.CreateCondBr(B.CreateIsNull(File), Done, Write);
+
+    B.SetInsertPoint(Write);
+    uint64_t Size = M.getDataLayout().getTypeAllocSize(ImageTy);
+    B.CreateCall(Fwrite, {B.CreatePointerCast(Image, I8Ptr), B.getInt64(Size), B.getInt64(1), File});
+    B.CreateCall(Fclose, {File});
+    B.CreateBr(Done);
+
+    B.SetInsertPoint(Done);
+    B.CreateRetVoid();
+    return Dump;
+}
+
 // DynamicCallCounter 的实现
 bool DynamicCallCounter::runOnModule(Module &M) {
     bool Instrumented = false;
@@ -60,29 +494,120 @@ bool DynamicCallCounter::runOnModule(Module &M) {
 
     auto &CTX = M.getContext();
 
-    // 第一步，遍历模块中的每个函数，注入调用计数器
+    // 先挑出要统计的函数，函数如果是声明不用管，小于 -dcc-min-insts 的和过滤掉的也不管。后面注入的辅助函数不会混进来
+    FunctionFilter Filter(FilterOpts);
+    std::vector<Function *> Counted;
     for (auto &F : M) {
-        // 函数如果是声明不用管
-        if (F.isDeclaration()) {
-            continue;
+        if (!F.isDeclaration() && F.getInstructionCount() >= MinInsts && Filter.shouldInstrument(F)) {
+            Counted.push_back(&F);
         }
+    }
 
-        // 获取 IR builder。设置插入指针为函数开头
-        IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
+    // -dcc-blocks：插桩前先建好每个函数的生成树。有拆不开的边落在树外的函数不统计块
+    std::vector<BlockCounters> Blocks;
+    unsigned NumEdges = 0;
+    if (CountBlocks) {
+        ModuleSlotTracker MST(&M);
+        for (Function *F : Counted) {
+            CFGSpanningTree Tree(*F);
+            if (!Tree.Instrumentable) {
+                LLVM_DEBUG(dbgs() << "Skipping block counts for " << F->getName() << "\n");
+                continue;
+            }
+            BlockCounters BC{F, Tree.Edges, Tree.solve(), Tree.inEdges(), {}, NumEdges};
+            MST.incorporateFunction(*F);
+            for (BasicBlock &BB : *F) {
+                std::string Name;
+                raw_string_ostream OS(Name);
+                OS << F->getName() << ":";
+                BB.printAsOperand(OS, false, MST);
+                BC.Names.push_back(OS.str());
+            }
+            NumEdges += BC.Edges.size();
+            Blocks.push_back(std::move(BC));
+        }
+    }
+
+    // tls 和 sharded 模式的计数器按下标排，函数在前，边在后
+    std::unique_ptr<ThreadedCounters> Threaded;
+    if (CounterKind != CounterMode::Plain && !Counted.empty()) {
+        Threaded.reset(new ThreadedCounters(M, CounterKind, Counted.size() + NumEdges));
+    }
+    Type *CounterTy = Threaded ? Type::getInt64Ty(CTX) : Type::getInt32Ty(CTX);
+
+    // plain 模式的边计数器是一个数组。边的次数可能超过 32 位，用 64 位
+    GlobalVariable *EdgeArray = nullptr;
+    if (!Threaded && NumEdges) {
+        ArrayType *EdgeArrayTy = ArrayType::get(Type::getInt64Ty(CTX), NumEdges);
+        EdgeArray = new GlobalVariable(M, EdgeArrayTy, false, GlobalValue::InternalLinkage,
+                                       ConstantAggregateZero::get(EdgeArrayTy), "DCC.Edges");
+    }
+    auto EdgeSlot = [&](unsigned Idx) -> Constant * {
+        if (Threaded) {
+            return Threaded->total(Counted.size() + Idx);
+        }
+        return ConstantExpr::getInBoundsGetElementPtr(
+            EdgeArray->getValueType(), EdgeArray,
+            ArrayRef<Constant *>{ConstantInt::get(Type::getInt64Ty(CTX), 0), ConstantInt::get(Type::getInt64Ty(CTX), Idx)});
+    };
+
+    // 给树外的边放计数器。要在函数入口插桩之前做，采样检查会改入口块
+    for (BlockCounters &BC : Blocks) {
+        for (unsigned E = 0; E < BC.Edges.size(); E++) {
+            if (BC.Edges[E].InTree) {
+                continue;
+            }
+            Instruction *At = edgeInsertionPoint(BC.Edges[E]);
+            if (Threaded) {
+                Threaded->instrument(At, Counted.size() + BC.Base + E, 1);
+            } else {
+                IRBuilder<> B(At);
+                Constant *Slot = EdgeSlot(BC.Base + E);
+                B.CreateStore(B.CreateAdd(B.CreateLoad(B.getInt64Ty(), Slot), B.getInt64(1)), Slot);
+            }
+        }
+    }
+    unsigned NumCounted = 0;
+
+    // 采样时每个线程从 N 开始倒数
+    GlobalVariable *Countdown = nullptr;
+    uint64_t Step = 1;
+    if (SampleRate > 1) {
+        Countdown = new GlobalVariable(M, Type::getInt32Ty(CTX), false, GlobalValue::InternalLinkage,
+                                       ConstantInt::get(Type::getInt32Ty(CTX), SampleRate),
+                                       "DCC.Countdown", nullptr, GlobalValue::InitialExecTLSModel);
+        Step = SampleRate;
+    }
 
-        // 创建一个全局变量，用来计算函数调用次数
-        std::string CounterName = "CounterFor_" + std::string(F.getName());
-        Constant *Var = CreateGlobalCounter(M, CounterName);
-        CallCounterMap[F.getName()] = Var;
+    // 第一步，遍历要统计的函数，注入调用计数器
+    for (Function *FP : Counted) {
+        Function &F = *FP;
+
+        // 获取 IR builder。设置插入指针为函数开头，采样时是命中采样的分支里
+        IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
+        Instruction *At = Countdown ? insertSampleCheck(F, Countdown)
+                                    : Threaded ? afterAllocas(F) : &*Builder.GetInsertPoint();
+        Builder.SetInsertPoint(At);
 
         // 创建一个全局变量，用来记录函数名
         auto FuncName = Builder.CreateGlobalStringPtr(F.getName());
         FuncNameMap[F.getName()] = FuncName;
 
-        // 在函数开头插入调用计数器的增加指令
-        LoadInst *load2 = Builder.CreateLoad(IntegerType::getInt32Ty(CTX), Var);
-        Value *Inc2 = Builder.CreateAdd(Builder.getInt32(1), load2);
-        Builder.CreateStore(Inc2, Var);
+        if (Threaded) {
+            // 打印时读合并以后的结果
+            CallCounterMap[F.getName()] = Threaded->total(NumCounted);
+            Threaded->instrument(At, NumCounted++, Step);
+        } else {
+            // 创建一个全局变量，用来计算函数调用次数
+            std::string CounterName = "CounterFor_" + std::string(F.getName());
+            Constant *Var = CreateGlobalCounter(M, CounterName);
+            CallCounterMap[F.getName()] = Var;
+
+            // 在函数开头插入调用计数器的增加指令
+            LoadInst *load2 = Builder.CreateLoad(IntegerType::getInt32Ty(CTX), Var);
+            Value *Inc2 = Builder.CreateAdd(Builder.getInt32(Step), load2);
+            Builder.CreateStore(Inc2, Var);
+        }
 
         // 下面只在 -debug 模式显示
         LLVM_DEBUG(dbgs() << "Instrumenting " << F.getName() << "\n");
@@ -96,6 +621,12 @@ bool DynamicCallCounter::runOnModule(Module &M) {
         return Instrumented;
     }
 
+    // 写二进制文件的话不用 printf
+    if (!OutputFile.empty()) {
+        appendToGlobalDtors(M, createDump(M, Counted, CallCounterMap, CounterTy, Threaded.get(), Blocks, EdgeSlot), /*Priority=*/0);
+        return true;
+    }
+
     // 第二步，注入 printf 声明
     /*
     创建或获取 printf 的声明的 IR 模块
@@ -123,9 +654,19 @@ bool DynamicCallCounter::runOnModule(Module &M) {
     out += "====================================================\n";
     out += "动态分析结果：\n";
     out += "====================================================\n";
+    if (SampleRate > 1) {
+        out += "每个线程每 " + std::to_string(SampleRate) + " 次调用采样一次，次数是估计值\n";
+    }
     out += "函数名                      #N 调用次数\n";
     out += "----------------------------------------------------\n";
 
+    std::string BlockOut = "";
+    BlockOut += "====================================================\n";
+    BlockOut += "基本块执行次数：\n";
+    BlockOut += "====================================================\n";
+    BlockOut += "函数名:基本块                   #N 执行次数\n";
+    BlockOut += "----------------------------------------------------\n";
+
     llvm::Constant *ResultHeaderStr = llvm::ConstantDataArray::getString(CTX, out.c_str());
 
     Constant *ResultHeaderStrVar = M.getOrInsertGlobal("ResultHeaderStrIR", ResultHeaderStr->getType());
@@ -156,12 +697,30 @@ bool DynamicCallCounter::runOnModule(Module &M) {
 
     Builder.CreateCall(Printf, {ResultHeaderStrPtr});
 
+    // 各线程、各分片的计数先加起来
+    if (Threaded) {
+        Builder.CreateCall(Threaded->createMerge());
+    }
+
     LoadInst *LoadCounter;
     for (auto &item : CallCounterMap) {
-        LoadCounter = Builder.CreateLoad(IntegerType::getInt32Ty(CTX), item.second);
+        LoadCounter = Builder.CreateLoad(CounterTy, item.second);
         Builder.CreateCall(Printf, {ResultFormatStrPtr, FuncNameMap[item.first()], LoadCounter});
     }
 
+    // 解出树上的边，再打印每个块
+    if (!Blocks.empty()) {
+        emitSolve(Builder, Blocks, EdgeSlot);
+        Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(BlockOut)});
+        llvm::Value *BlockFormatStrPtr = Builder.CreateGlobalStringPtr("%-30s %-10lu\n");
+        for (const BlockCounters &BC : Blocks) {
+            for (unsigned i = 0; i < BC.In.size(); i++) {
+                Builder.CreateCall(Printf, {BlockFormatStrPtr, Builder.CreateGlobalStringPtr(BC.Names[i]),
+                                            emitBlockCount(Builder, BC, i, EdgeSlot)});
+            }
+        }
+    }
+
     // 最后，插入返回指令
     Builder.CreateRetVoid();
 
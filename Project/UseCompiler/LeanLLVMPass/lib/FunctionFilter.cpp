@@ -0,0 +1,127 @@
+/*
+插桩 pass 共用的函数过滤，见 FunctionFilter.h。
+*/
+
+#include "FunctionFilter.h"
+#include "DynamicCallCounter.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <cstring>
+
+using namespace llvm;
+
+FunctionFilterOptions::FunctionFilterOptions(StringRef Prefix)
+    : AllowName((Prefix + "-allow").str()), DenyName((Prefix + "-deny").str()),
+      FileName((Prefix + "-filter-file").str()), HotProfileName((Prefix + "-skip-hot").str()),
+      HotCallsName((Prefix + "-hot-calls").str()), HotInstsName((Prefix + "-hot-max-insts").str()),
+      Allow(StringRef(AllowName), cl::desc("只插桩名字匹配这些正则的函数"), cl::value_desc("regex"),
+            cl::CommaSeparated),
+      Deny(StringRef(DenyName), cl::desc("不插桩名字匹配这些正则的函数，优先于 allow"), cl::value_desc("regex"),
+           cl::CommaSeparated),
+      File(StringRef(FileName), cl::desc("函数名列表，每行一个，! 开头表示不插桩"), cl::value_desc("filename"),
+           cl::init("")),
+      HotProfile(StringRef(HotProfileName), cl::desc("DynamicCallCounter 的剖析文件，跳过又热又小的函数"),
+                 cl::value_desc("filename"), cl::init("")),
+      HotCalls(StringRef(HotCallsName), cl::desc("调用次数不少于这个数算热"), cl::value_desc("N"),
+               cl::init(100000)),
+      HotMaxInsts(StringRef(HotInstsName), cl::desc("指令数不超过这个数算小"), cl::value_desc("K"),
+                  cl::init(20)) {}
+
+// 读 DynamicCallCounter 的剖析文件，只要函数记录
+static void readCalls(StringRef Path, DenseMap<uint64_t, uint64_t> &Calls) {
+    auto Buf = MemoryBuffer::getFile(Path);
+    if (!Buf) {
+        report_fatal_error(Twine("打不开 ") + Path + ": " + Buf.getError().message());
+    }
+    StringRef Data = (*Buf)->getBuffer();
+    DCCProfileHeader Header;
+    if (Data.size() < sizeof(Header)) {
+        report_fatal_error(Twine(Path) + ": 文件太短");
+    }
+    memcpy(&Header, Data.data(), sizeof(Header));
+    if (Header.Magic != DCCProfileMagic || Header.Version != DCCProfileVersion ||
+        (Data.size() - sizeof(Header)) / sizeof(DCCProfileRecord) < Header.NumFuncs) {
+        report_fatal_error(Twine(Path) + ": 不是 DynamicCallCounter 的剖析文件，或者版本不对");
+    }
+    const char *P = Data.data() + sizeof(Header);
+    for (uint64_t i = 0; i < Header.NumFuncs; i++, P += sizeof(DCCProfileRecord)) {
+        DCCProfileRecord Record;
+        memcpy(&Record, P, sizeof(Record));
+        Calls[Record.GUID] += Record.Count;
+    }
+}
+
+// 整个名字都要匹配，Regex::match 本身是找子串
+static void addRegex(std::vector<std::unique_ptr<Regex>> &List, StringRef Pattern) {
+    auto R = std::make_unique<Regex>(("^(" + Pattern + ")$").str());
+    std::string Error;
+    if (!R->isValid(Error)) {
+        report_fatal_error(Twine("正则表达式 ") + Pattern + " 不对：" + Error);
+    }
+    List.push_back(std::move(R));
+}
+
+FunctionFilter::FunctionFilter(const FunctionFilterOptions &Opts) : Opts(Opts) {
+    for (const std::string &Pattern : Opts.Allow) {
+        addRegex(AllowRegex, Pattern);
+    }
+    for (const std::string &Pattern : Opts.Deny) {
+        addRegex(DenyRegex, Pattern);
+    }
+
+    if (!Opts.File.empty()) {
+        auto Buf = MemoryBuffer::getFile(Opts.File);
+        if (!Buf) {
+            report_fatal_error(Twine("打不开 ") + Opts.File + ": " + Buf.getError().message());
+        }
+        SmallVector<StringRef, 64> Lines;
+        (*Buf)->getBuffer().split(Lines, '\n', -1, false);
+        for (StringRef Line : Lines) {
+            Line = Line.trim();
+            if (Line.empty() || Line.startswith("#")) {
+                continue;
+            }
+            if (Line.consume_front("!")) {
+                DenyNames.insert(Line.trim());
+            } else {
+                AllowNames.insert(Line);
+            }
+        }
+    }
+
+    if (!Opts.HotProfile.empty()) {
+        readCalls(Opts.HotProfile, Calls);
+    }
+}
+
+bool FunctionFilter::shouldInstrument(const Function &F) const {
+    StringRef Name = F.getName();
+    if (DenyNames.count(Name)) {
+        return false;
+    }
+    for (auto &R : DenyRegex) {
+        if (R->match(Name)) {
+            return false;
+        }
+    }
+
+    if (!AllowNames.empty() || !AllowRegex.empty()) {
+        bool Allowed = AllowNames.count(Name);
+        for (auto &R : AllowRegex) {
+            Allowed = Allowed || R->match(Name);
+        }
+        if (!Allowed) {
+            return false;
+        }
+    }
+
+    if (!Calls.empty()) {
+        auto It = Calls.find(Function::getGUID(F.getGlobalIdentifier()));
+        if (It != Calls.end() && It->second >= Opts.HotCalls && F.getInstructionCount() <= Opts.HotMaxInsts) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -1,22 +1,97 @@
 /*
 在每个函数的开头都插入一段代码，添加的代码将在运行时调用。
 
+默认插入的是 printf，每次调用都同步格式化输出，只适合小程序。加上 -ifc-buffered 时改成调用 runtime 里的
+__ift_enter(函数编号, 参数个数)，运行时把定长的二进制记录写进每个线程的环形缓冲区，由后台线程写到文件，
+再用 tools 里的 ift-decode 还原成和 printf 一样的文本。函数名表由模块构造函数交给 __ift_register。
+
+只插桩一部分函数时用 -ifc-allow、-ifc-deny、-ifc-filter-file、-ifc-skip-hot，见 FunctionFilter.h。
+
 使用方式：
 $ opt -load-pass-plugin <BUILD_DIR>/lib/libInjectFunctCall.so -passes=-"inject-func-call" <bitcode-file>
+$ opt -load <BUILD_DIR>/lib/libInjectFuncCall.so -load-pass-plugin <BUILD_DIR>/lib/libInjectFuncCall.so -passes="inject-func-call" -ifc-buffered <bitcode-file> -o instrumented.bin
+$ lli -load <BUILD_DIR>/lib/libFuncTraceRuntime.so instrumented.bin
+$ <BUILD_DIR>/bin/ift-decode ift.trace
 
 */
 
 #include "InjectFuncCall.h"
+#include "FunctionFilter.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace llvm;
 
 #define DEBUG_TYPE "inject-func-call"
 
+static cl::opt<bool> BufferedTrace {
+    "ifc-buffered",
+    cl::desc("调用 FuncTraceRuntime 记录二进制跟踪，不直接 printf"),
+    cl::init(false)
+};
+static FunctionFilterOptions FilterOpts("ifc");
+
+// -ifc-buffered：每个函数开头调用 __ift_enter(IFT.Base + 编号, 参数个数)
+static bool injectBufferedTrace(Module &M, const FunctionFilter &Filter) {
+    auto &CTX = M.getContext();
+    Type *I32 = Type::getInt32Ty(CTX);
+    PointerType *I8Ptr = Type::getInt8PtrTy(CTX);
+
+    std::vector<Function *> Traced;
+    for (auto &F : M) {
+        if (!F.isDeclaration() && Filter.shouldInstrument(F)) {
+            Traced.push_back(&F);
+        }
+    }
+    if (Traced.empty()) {
+        return false;
+    }
+
+    FunctionCallee Register = M.getOrInsertFunction("__ift_register", I32, PointerType::getUnqual(I8Ptr), I32);
+    FunctionCallee Enter = M.getOrInsertFunction("__ift_enter", Type::getVoidTy(CTX), I32, I32);
+
+    // 函数名表，编号是在表里的下标
+    std::vector<Constant *> NameList;
+    for (Function *F : Traced) {
+        NameList.push_back(IRBuilder<>(CTX).CreateGlobalStringPtr(F->getName(), "", 0, &M));
+    }
+    ArrayType *NamesTy = ArrayType::get(I8Ptr, Traced.size());
+    GlobalVariable *Names = new GlobalVariable(M, NamesTy, true, GlobalValue::PrivateLinkage,
+                                               ConstantArray::get(NamesTy, NameList), "IFT.Names");
+    // 多个模块各自登记，运行时给每个模块分一段编号
+    GlobalVariable *Base = new GlobalVariable(M, I32, false, GlobalValue::InternalLinkage,
+                                              ConstantInt::get(I32, 0), "IFT.Base");
+
+    Function *Init = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                      GlobalValue::InternalLinkage, "IFT.init", M);
+    IRBuilder<> InitBuilder(BasicBlock::Create(CTX, "entry", Init));
+    Value *NamesPtr = InitBuilder.CreateConstInBoundsGEP2_64(NamesTy, Names, 0, 0);
+    InitBuilder.CreateStore(InitBuilder.CreateCall(Register, {NamesPtr, InitBuilder.getInt32(Traced.size())}), Base);
+    InitBuilder.CreateRetVoid();
+    appendToGlobalCtors(M, Init, /*Priority=*/0);
+
+    for (unsigned Idx = 0; Idx < Traced.size(); Idx++) {
+        Function &F = *Traced[Idx];
+        IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
+        Value *Id = Builder.CreateAdd(Builder.CreateLoad(I32, Base), Builder.getInt32(Idx));
+        Builder.CreateCall(Enter, {Id, Builder.getInt32(F.arg_size())});
+
+        // 下面是 -debug 的实现
+        LLVM_DEBUG(dbgs() << "函数名：" << F.getName() << "\n");
+    }
+    return true;
+}
+
 // InjectFuncCall 的实现
 bool InjectFuncCall::runOnModule(Module &M) {
+    FunctionFilter Filter(FilterOpts);
+    if (BufferedTrace) {
+        return injectBufferedTrace(M, Filter);
+    }
+
     bool InsertedAtLeastOnePrintf = false;
     auto &CTX = M.getContext();
     PointerType *PrintfArgTy = PointerType::getUnqual(Type::getInt8Ty(CTX));
@@ -46,7 +121,7 @@ bool InjectFuncCall::runOnModule(Module &M) {
 
     // 第三步，遍历每个函数，插入 printf 调用
     for (auto &F : M) {
-        if (F.isDeclaration()) {
+        if (F.isDeclaration() || !Filter.shouldInstrument(F)) {
             continue;
         }
         // 获得 IR Builder。设置函数头部插入指针的位置
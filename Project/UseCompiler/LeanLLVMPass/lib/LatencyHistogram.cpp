@@ -0,0 +1,352 @@
+/*
+
+统计运行时每个函数一次调用花的时间。DynamicCallCounter 只知道调用了多少次，找尾延迟要看耗时的分布。
+
+在函数入口读一次时钟，存在 SSA 值里，每个 ret 前再读一次，差值记到这个函数的直方图里。
+直方图按 2 的幂分桶：第 b 个桶放 [2^b, 2^(b+1)) 的耗时，64 个桶覆盖整个 i64。
+所有函数的桶放在一个全局数组 LH.Hist 里，每个函数占整数条缓存行，用 atomicrmw add 更新，另外用 atomicrmw umax
+记录最大值。多线程下不用锁，也不会丢数据。递归时每一层各自计时，时间是包含被调函数在内的。
+
+模块退出时 LH.report 打印每个函数的调用次数、p50、p99 和最大值。百分位数取所在桶的上界，再和最大值取小，
+所以是不超过 2 倍的上估计。
+
+-lh-clock 选时钟：
+- cycles：llvm.readcyclecounter，x86 上是 rdtsc，单位是时钟周期，开销最小（默认）。
+- ns：clock_gettime(CLOCK_MONOTONIC)，单位是纳秒，只支持 Linux 的 timespec 布局。
+
+只统计正常返回。异常从 resume 或者被调函数里抛出去的、调用 exit 没有返回的都不计。
+有 musttail 调用的函数 ret 前面不能插指令，跳过。
+
+使用方法：
+opt -load <BUILD_DIR>/lib/libLatencyHistogram.so -load-pass-plugin <BUILD_DIR>/lib/libLatencyHistogram.so --passes="latency-hist" -lh-clock=ns <bitcode-file> -o instrumented.bin
+lli instrumented.bin
+
+*/
+
+#include "LatencyHistogram.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "latency-hist"
+
+enum class ClockKind { Cycles, Nanoseconds };
+
+static cl::opt<ClockKind> Clock {
+    "lh-clock",
+    cl::desc("计时用的时钟"),
+    cl::values(
+        clEnumValN(ClockKind::Cycles, "cycles", "llvm.readcyclecounter，单位是时钟周期（默认）"),
+        clEnumValN(ClockKind::Nanoseconds, "ns", "clock_gettime(CLOCK_MONOTONIC)，单位是纳秒")),
+    cl::init(ClockKind::Cycles)
+};
+
+// 每个函数 64 个桶，正好 8 条缓存行
+static const unsigned NumBuckets = 64;
+// Linux 的 CLOCK_MONOTONIC
+static const unsigned ClockMonotonic = 1;
+
+namespace {
+// 读时钟。ns 模式每个函数在入口块分配一个 timespec，入口和出口共用
+class ClockReader {
+public:
+    ClockReader(Module &M, Function &F) : M(M) {
+        if (Clock == ClockKind::Nanoseconds) {
+            LLVMContext &CTX = M.getContext();
+            Type *I64 = Type::getInt64Ty(CTX);
+            TimespecTy = StructType::get(CTX, {I64, I64});
+            IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+            Timespec = B.CreateAlloca(TimespecTy, nullptr, "lh.ts");
+            GetTime = M.getOrInsertFunction("clock_gettime", Type::getInt32Ty(CTX), Type::getInt32Ty(CTX),
+                                            PointerType::getUnqual(TimespecTy));
+        }
+    }
+
+    Value *read(IRBuilder<> &B) {
+        if (Clock == ClockKind::Cycles) {
+            return B.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::readcyclecounter));
+        }
+        B.CreateCall(GetTime, {B.getInt32(ClockMonotonic), Timespec});
+        Value *Sec = B.CreateLoad(B.getInt64Ty(), B.CreateStructGEP(TimespecTy, Timespec, 0));
+        Value *NSec = B.CreateLoad(B.getInt64Ty(), B.CreateStructGEP(TimespecTy, Timespec, 1));
+        return B.CreateAdd(B.CreateMul(Sec, B.getInt64(1000000000)), NSec);
+    }
+
+private:
+    Module &M;
+    StructType *TimespecTy = nullptr;
+    AllocaInst *Timespec = nullptr;
+    FunctionCallee GetTime;
+};
+} // end namespace
+
+static bool hasMustTailCall(Function &F) {
+    for (BasicBlock &BB : F) {
+        if (BB.getTerminatingMustTailCall()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+生成一个在运行时求百分位数的函数，等价于：
+```c++
+    uint64_t LH_percentile(uint64_t *Hist, uint64_t Total, uint64_t Pct) {
+        uint64_t Need = (Total * Pct + 99) / 100, Sum = 0;
+        for (uint64_t b = 0; b < 64; b++) {
+            Sum += Hist[b];
+            if (Sum >= Need) return b == 63 ? UINT64_MAX : (2ull << b) - 1;
+        }
+        return UINT64_MAX;
+    }
+```
+*/
+static Function *createPercentile(Module &M) {
+    LLVMContext &CTX = M.getContext();
+    Type *I64 = Type::getInt64Ty(CTX);
+    FunctionType *FTy = FunctionType::get(I64, {PointerType::getUnqual(I64), I64, I64}, false);
+    Function *F = Function::Create(FTy, GlobalValue::InternalLinkage, "LH.percentile", M);
+    Value *Hist = F->getArg(0), *Total = F->getArg(1), *Pct = F->getArg(2);
+
+    BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+    BasicBlock *Loop = BasicBlock::Create(CTX, "loop", F);
+    BasicBlock *Next = BasicBlock::Create(CTX, "next", F);
+    BasicBlock *Found = BasicBlock::Create(CTX, "found", F);
+    BasicBlock *Done = BasicBlock::Create(CTX, "done", F);
+
+    IRBuilder<> B(Entry);
+    Value *Need = B.CreateUDiv(B.CreateAdd(B.CreateMul(Total, Pct), B.getInt64(99)), B.getInt64(100));
+    B.CreateBr(Loop);
+
+    B.SetInsertPoint(Loop);
+    PHINode *Idx = B.CreatePHI(I64, 2, "b");
+    PHINode *Sum = B.CreatePHI(I64, 2, "sum");
+    Value *NewSum = B.CreateAdd(Sum, B.CreateLoad(I64, B.CreateInBoundsGEP(I64, Hist, Idx)));
+    B.CreateCondBr(B.CreateICmpUGE(NewSum, Need), Found, Next);
+
+    B.SetInsertPoint(Next);
+    Value *NextIdx = B.CreateAdd(Idx, B.getInt64(1));
+    B.CreateCondBr(B.CreateICmpULT(NextIdx, B.getInt64(NumBuckets)), Loop, Done);
+    Idx->addIncoming(B.getInt64(0), Entry);
+    Idx->addIncoming(NextIdx, Next);
+    Sum->addIncoming(B.getInt64(0), Entry);
+    Sum->addIncoming(NewSum, Next);
+
+    // 桶的上界，最后一个桶左移会溢出
+    B.SetInsertPoint(Found);
+    Value *Upper = B.CreateSub(B.CreateShl(B.getInt64(2), Idx), B.getInt64(1));
+    B.CreateRet(B.CreateSelect(B.CreateICmpEQ(Idx, B.getInt64(NumBuckets - 1)), B.getInt64(UINT64_MAX), Upper));
+
+    B.SetInsertPoint(Done);
+    B.CreateRet(B.getInt64(UINT64_MAX));
+    return F;
+}
+
+/*
+生成退出时打印结果的函数，等价于：
+```c++
+    void LH_report() {
+        printf(Header);
+        for (unsigned i = 0; i < N; i++) {
+            uint64_t Total = 0;
+            for (unsigned b = 0; b < 64; b++) Total += Hist[i][b];
+            if (Total == 0) continue;
+            printf(Format, Names[i], Total, min(percentile(Hist[i], Total, 50), Max[i]),
+                   min(percentile(Hist[i], Total, 99), Max[i]), Max[i]);
+        }
+    }
+```
+*/
+static Function *createReport(Module &M, GlobalVariable *Hist, GlobalVariable *Max, GlobalVariable *Names,
+                              unsigned NumFuncs) {
+    LLVMContext &CTX = M.getContext();
+    Type *I64 = Type::getInt64Ty(CTX);
+    Type *I8Ptr = Type::getInt8PtrTy(CTX);
+    FunctionCallee Printf = M.getOrInsertFunction(
+        "printf", FunctionType::get(Type::getInt32Ty(CTX), {I8Ptr}, true));
+    Function *Percentile = createPercentile(M);
+
+    Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                   GlobalValue::InternalLinkage, "LH.report", M);
+    BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+    BasicBlock *Func = BasicBlock::Create(CTX, "func", F);
+    BasicBlock *Sum = BasicBlock::Create(CTX, "sum", F);
+    BasicBlock *Print = BasicBlock::Create(CTX, "print", F);
+    BasicBlock *Next = BasicBlock::Create(CTX, "next", F);
+    BasicBlock *Done = BasicBlock::Create(CTX, "done", F);
+
+    std::string Header = "";
+    Header += "====================================================\n";
+    Header += "函数延迟分布（单位：";
+    Header += Clock == ClockKind::Cycles ? "时钟周期" : "纳秒";
+    Header += "，百分位数是所在 2 的幂区间的上界）：\n";
+    Header += "====================================================\n";
+    Header += "函数名               调用次数   p50        p99        max\n";
+    Header += "----------------------------------------------------\n";
+
+    IRBuilder<> B(Entry);
+    B.CreateCall(Printf, {B.CreateGlobalStringPtr(Header)});
+    Value *Format = B.CreateGlobalStringPtr("%-20s %-10lu %-10lu %-10lu %-10lu\n");
+    B.CreateBr(Func);
+
+    // 外层循环：第 I 个函数
+    B.SetInsertPoint(Func);
+    PHINode *I = B.CreatePHI(I64, 2, "i");
+    Value *Row = B.CreateInBoundsGEP(Hist->getValueType(), Hist, {B.getInt64(0), I, B.getInt64(0)});
+    B.CreateBr(Sum);
+
+    // 内层循环：把 64 个桶加起来
+    B.SetInsertPoint(Sum);
+    PHINode *Bucket = B.CreatePHI(I64, 2, "b");
+    PHINode *Total = B.CreatePHI(I64, 2, "total");
+    Value *NewTotal = B.CreateAdd(Total, B.CreateLoad(I64, B.CreateInBoundsGEP(I64, Row, Bucket)));
+    Value *NextBucket = B.CreateAdd(Bucket, B.getInt64(1));
+    Bucket->addIncoming(B.getInt64(0), Func);
+    Bucket->addIncoming(NextBucket, Sum);
+    Total->addIncoming(B.getInt64(0), Func);
+    Total->addIncoming(NewTotal, Sum);
+    Value *SumDone = B.CreateICmpEQ(NextBucket, B.getInt64(NumBuckets));
+    B.CreateCondBr(SumDone, Print, Sum);
+
+    // 没调用过的函数不打印
+    B.SetInsertPoint(Print);
+    BasicBlock *Report = BasicBlock::Create(CTX, "report", F, Next);
+    B.CreateCondBr(B.CreateICmpEQ(NewTotal, B.getInt64(0)), Next, Report);
+
+    B.SetInsertPoint(Report);
+    Value *MaxVal = B.CreateLoad(I64, B.CreateInBoundsGEP(Max->getValueType(), Max, {B.getInt64(0), I}));
+    auto Clamp = [&](unsigned Pct) {
+        Value *P = B.CreateCall(Percentile, {Row, NewTotal, B.getInt64(Pct)});
+        return B.CreateSelect(B.CreateICmpULT(P, MaxVal), P, MaxVal);
+    };
+    Value *P50 = Clamp(50);
+    Value *P99 = Clamp(99);
+    Value *Name = B.CreateLoad(I8Ptr, B.CreateInBoundsGEP(Names->getValueType(), Names, {B.getInt64(0), I}));
+    B.CreateCall(Printf, {Format, Name, NewTotal, P50, P99, MaxVal});
+    B.CreateBr(Next);
+
+    B.SetInsertPoint(Next);
+    Value *NextI = B.CreateAdd(I, B.getInt64(1));
+    I->addIncoming(B.getInt64(0), Entry);
+    I->addIncoming(NextI, Next);
+    B.CreateCondBr(B.CreateICmpULT(NextI, B.getInt64(NumFuncs)), Func, Done);
+
+    B.SetInsertPoint(Done);
+    B.CreateRetVoid();
+    return F;
+}
+
+// LatencyHistogram 的实现
+bool LatencyHistogram::runOnModule(Module &M) {
+    auto &CTX = M.getContext();
+    Type *I64 = Type::getInt64Ty(CTX);
+
+    // 先挑出要统计的函数，后面生成的辅助函数不会混进来
+    std::vector<Function *> Timed;
+    for (Function &F : M) {
+        if (F.isDeclaration()) {
+            continue;
+        }
+        if (hasMustTailCall(F)) {
+            LLVM_DEBUG(dbgs() << "Skipping " << F.getName() << ": musttail\n");
+            continue;
+        }
+        Timed.push_back(&F);
+    }
+    if (Timed.empty()) {
+        return false;
+    }
+
+    // 直方图、最大值和函数名表
+    ArrayType *RowTy = ArrayType::get(I64, NumBuckets);
+    ArrayType *HistTy = ArrayType::get(RowTy, Timed.size());
+    GlobalVariable *Hist = new GlobalVariable(M, HistTy, false, GlobalValue::InternalLinkage,
+                                              ConstantAggregateZero::get(HistTy), "LH.Hist");
+    Hist->setAlignment(Align(64));
+    ArrayType *MaxTy = ArrayType::get(I64, Timed.size());
+    GlobalVariable *Max = new GlobalVariable(M, MaxTy, false, GlobalValue::InternalLinkage,
+                                             ConstantAggregateZero::get(MaxTy), "LH.Max");
+    Max->setAlignment(Align(64));
+
+    std::vector<Constant *> NameList;
+    for (Function *F : Timed) {
+        NameList.push_back(IRBuilder<>(CTX).CreateGlobalStringPtr(F->getName(), "", 0, &M));
+    }
+    ArrayType *NamesTy = ArrayType::get(Type::getInt8PtrTy(CTX), Timed.size());
+    GlobalVariable *Names = new GlobalVariable(M, NamesTy, true, GlobalValue::PrivateLinkage,
+                                               ConstantArray::get(NamesTy, NameList), "LH.Names");
+
+    for (unsigned Idx = 0; Idx < Timed.size(); Idx++) {
+        Function &F = *Timed[Idx];
+        ClockReader Reader(M, F);
+
+        // 入口计时放在 alloca 后面
+        BasicBlock::iterator IP = F.getEntryBlock().getFirstInsertionPt();
+        while (isa<AllocaInst>(IP)) {
+            ++IP;
+        }
+        IRBuilder<> Builder(&*IP);
+        Value *Start = Reader.read(Builder);
+
+        std::vector<ReturnInst *> Returns;
+        for (BasicBlock &BB : F) {
+            if (auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator())) {
+                Returns.push_back(Ret);
+            }
+        }
+
+        // 每个 ret 前面：桶号是 63 - ctlz(耗时 | 1)
+        for (ReturnInst *Ret : Returns) {
+            Builder.SetInsertPoint(Ret);
+            Value *Elapsed = Builder.CreateSub(Reader.read(Builder), Start);
+            Value *Lz = Builder.CreateBinaryIntrinsic(Intrinsic::ctlz, Builder.CreateOr(Elapsed, 1),
+                                                      Builder.getTrue());
+            Value *Bucket = Builder.CreateSub(Builder.getInt64(NumBuckets - 1), Lz);
+            Value *Slot = Builder.CreateInBoundsGEP(HistTy, Hist, {Builder.getInt64(0), Builder.getInt64(Idx), Bucket});
+            Builder.CreateAtomicRMW(AtomicRMWInst::Add, Slot, Builder.getInt64(1), MaybeAlign(8),
+                                    AtomicOrdering::Monotonic);
+            Value *MaxSlot = Builder.CreateInBoundsGEP(MaxTy, Max, {Builder.getInt64(0), Builder.getInt64(Idx)});
+            Builder.CreateAtomicRMW(AtomicRMWInst::UMax, MaxSlot, Elapsed, MaybeAlign(8), AtomicOrdering::Monotonic);
+        }
+
+        // 下面只在 -debug 模式显示
+        LLVM_DEBUG(dbgs() << "Timing " << F.getName() << " (" << Returns.size() << " returns)\n");
+    }
+
+    // 模块结束时打印
+    appendToGlobalDtors(M, createReport(M, Hist, Max, Names, Timed.size()), /*Priority=*/0);
+    return true;
+}
+
+PreservedAnalyses LatencyHistogram::run(llvm::Module &M, llvm::ModuleAnalysisManager &) {
+    bool Changed = runOnModule(M);
+    return (Changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all());
+}
+
+// 注册
+llvm::PassPluginLibraryInfo getLatencyHistogramPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "latency-hist", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) {
+                PB.registerPipelineParsingCallback(
+                    [](StringRef Name, ModulePassManager &MPM,
+                       ArrayRef<PassBuilder::PipelineElement>) {
+                        if (Name == "latency-hist") {
+                            MPM.addPass(LatencyHistogram());
+                            return true;
+                        }
+                        return false;
+                    });
+            }}; // end return
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return getLatencyHistogramPluginInfo();
+}
@@ -5,35 +5,83 @@ LLVM IR opcode 使用次数，打印结果
 使用方法
 opt -load-pass-plugin libOpcodeCounter.dylib -passes="print<opcode-counter>" -disable-output <input-llvm-file>
 
+按类型（整数、浮点、向量、指针、其他）分列打印
+opt -load libOpcodeCounter.dylib -load-pass-plugin libOpcodeCounter.dylib -passes="print<opcode-counter>" -opcode-counter-by-type -disable-output <input-llvm-file>
+
+整个模块一起统计，函数之间并行，打印模块总表，同时写出 JSON 和 CSV（- 表示标准输出）
+opt -load libOpcodeCounter.dylib -load-pass-plugin libOpcodeCounter.dylib -passes="print<opcode-counter-module>" -opcode-counter-json=mix.json -opcode-counter-csv=mix.csv -disable-output <input-llvm-file>
+
+按块的执行次数加权，估计实际执行的指令构成。函数带 !prof 时用 profile 的次数，否则用 BFI 估计的频率（入口块为 1）
+opt -load-pass-plugin libOpcodeCounter.dylib -passes="print<opcode-counter-weighted>" -disable-output <input-llvm-file>
+opt -load libOpcodeCounter.dylib -load-pass-plugin libOpcodeCounter.dylib -passes="print<opcode-counter-module-weighted>" -opcode-counter-json=mix.json -disable-output <input-llvm-file>
+
+加权的模块统计按函数的结构哈希缓存到磁盘，下次构建时没改过的函数不用重新算 BFI，见 OpcodeCounterCache.h
+opt -load libOpcodeCounter.dylib -load-pass-plugin libOpcodeCounter.dylib -passes="print<opcode-counter-module-weighted>" -opcode-counter-cache=mix.cache -disable-output <input-llvm-file>
+
 自动通过优化管道
 opt -load-pass-plugin libOpcodeCounter.dylib --passes='default<O1>' -disable-output <input-llvm-file>
 
 */
 
 #include "OpcodeCounter.h"
+#include "OpcodeCounterCache.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 using namespace llvm;
 
-// 美化分析结果
-static void printOpcodeCounterResult(llvm::raw_ostream &, const ResultOpcodeCounter &OC);
+static cl::opt<unsigned> Threads {
+    "opcode-counter-threads",
+    cl::desc("print<opcode-counter-module> 统计用的线程数，0 表示和 CPU 核数一样"),
+    cl::init(0)
+};
+
+static cl::opt<std::string> JSONOutput {
+    "opcode-counter-json",
+    cl::desc("print<opcode-counter-module> 的结果写成 JSON，- 表示标准输出"),
+    cl::value_desc("filename"),
+    cl::init("")
+};
+
+static cl::opt<std::string> CSVOutput {
+    "opcode-counter-csv",
+    cl::desc("print<opcode-counter-module> 的结果写成 CSV，- 表示标准输出"),
+    cl::value_desc("filename"),
+    cl::init("")
+};
+
+static cl::opt<std::string> CachePath {
+    "opcode-counter-cache",
+    cl::desc("print<opcode-counter-module-weighted> 的缓存文件，没改过的函数直接用上次的结果"),
+    cl::value_desc("filename"),
+    cl::init("")
+};
+
+// JSON 和 CSV 里按类型分的列名
+static const char *ClassNames[OTC_NumClasses] = {"int", "fp", "vector", "pointer", "other"};
+
+static int64_t jsonCount(uint64_t Count) {
+    return (int64_t)Count;
+}
+
+static double jsonCount(double Count) {
+    return Count;
+}
 
 // OpcodeCounter 的实现
 llvm::AnalysisKey OpcodeCounter::Key;
 
-OpcodeCounter::Result OpcodeCounter::generateOpcodeMap(llvm::Function &Func) {
+OpcodeCounter::Result OpcodeCounter::generateOpcodeMap(const llvm::Function &Func) {
     OpcodeCounter::Result OpcodeMap;
     for (auto &BB : Func) {
         for (auto &Inst : BB) {
-            StringRef Name = Inst.getOpcodeName();
-            if (OpcodeMap.find(Name) == OpcodeMap.end()) {
-                OpcodeMap[Name] = 1;
-            } else {
-                OpcodeMap[Name]++;
-            }
+            OpcodeMap.add(Inst);
         }
     } // end for
 
@@ -44,7 +92,61 @@ OpcodeCounter::Result OpcodeCounter::run(llvm::Function &Func, llvm::FunctionAna
     return generateOpcodeMap(Func);
 }
 
+// WeightedOpcodeCounter 的实现
+llvm::AnalysisKey WeightedOpcodeCounter::Key;
+
+// 每个块的权重，按块在函数里的顺序放
+static std::vector<double> blockWeights(const Function &Func, const BlockFrequencyInfo &BFI) {
+    std::vector<double> Weights;
+    bool FromProfile = Func.hasProfileData();
+    double EntryFreq = BFI.getEntryFreq();
+    for (auto &BB : Func) {
+        Optional<uint64_t> ProfileCount = BFI.getBlockProfileCount(&BB);
+        if (FromProfile && ProfileCount) {
+            Weights.push_back(*ProfileCount);
+        } else {
+            Weights.push_back(BFI.getBlockFreq(&BB).getFrequency() / EntryFreq);
+        }
+    }
+    return Weights;
+}
+
+// 只读指令，不碰 BFI，可以在线程里用
+static WeightedOpcodeMix addWeighted(const Function &Func, const std::vector<double> &Weights) {
+    WeightedOpcodeMix Mix;
+    Mix.FromProfile = Func.hasProfileData();
+    size_t Idx = 0;
+    for (auto &BB : Func) {
+        double Weight = Weights[Idx++];
+        for (auto &Inst : BB) {
+            Mix.Histogram.add(Inst, Weight);
+        }
+    }
+    return Mix;
+}
+
+WeightedOpcodeCounter::Result WeightedOpcodeCounter::generateWeightedMix(const llvm::Function &Func,
+                                                                         const BlockFrequencyInfo &BFI) {
+    return addWeighted(Func, blockWeights(Func, BFI));
+}
+
+WeightedOpcodeCounter::Result WeightedOpcodeCounter::run(llvm::Function &Func, llvm::FunctionAnalysisManager &FAM) {
+    return generateWeightedMix(Func, FAM.getResult<BlockFrequencyAnalysis>(Func));
+}
+
+static const char *weightSource(bool FromProfile) {
+    return FromProfile ? "profile" : "bfi";
+}
+
 PreservedAnalyses OpcodeCounterPrinter::run(llvm::Function &Func, llvm::FunctionAnalysisManager &FAM) {
+    if (Weighted) {
+        auto &Mix = FAM.getResult<WeightedOpcodeCounter>(Func);
+        OS << "打印分析 OpcodeCounter pass 函数 " << Func.getName() << " 的加权结果（权重来自 "
+           << weightSource(Mix.FromProfile) << "）\n";
+        printOpcodeCounterResult(OS, Mix.Histogram);
+        return PreservedAnalyses::all();
+    }
+
     auto &OpcodeMap = FAM.getResult<OpcodeCounter>(Func);
     
     OS << "打印分析 OpcodeCounter pass 函数 " << Func.getName() << " 的结果\n";
@@ -52,6 +154,204 @@ PreservedAnalyses OpcodeCounterPrinter::run(llvm::Function &Func, llvm::Function
     return PreservedAnalyses::all();
 }
 
+// 一个直方图写成 {"add": {"count": 3, "int": 3, ...}, ...}，只写出现过的 opcode
+template <typename CountT>
+static void writeHistogramJSON(json::OStream &J, const BasicOpcodeHistogram<CountT> &Histogram) {
+    for (unsigned Op = 0; Op < BasicOpcodeHistogram<CountT>::NumOpcodes; Op++) {
+        CountT Count = Histogram.count(Op);
+        if (Count == 0) {
+            continue;
+        }
+        J.attributeObject(Instruction::getOpcodeName(Op), [&] {
+            J.attribute("count", jsonCount(Count));
+            for (unsigned C = 0; C < OTC_NumClasses; C++) {
+                J.attribute(ClassNames[C], jsonCount(Histogram.Counts[Op][C]));
+            }
+        });
+    }
+}
+
+// Weights 为空表示静态计数，否则是每个函数的权重来源
+template <typename CountT>
+static void writeJSON(raw_ostream &Out, const Module &M, const std::vector<Function *> &Funcs,
+                      const std::vector<BasicOpcodeHistogram<CountT>> &PerFunc,
+                      const BasicOpcodeHistogram<CountT> &Total, const std::vector<bool> &Weights) {
+    json::OStream J(Out, 2);
+    J.object([&] {
+        J.attribute("module", M.getModuleIdentifier());
+        J.attribute("weighted", !Weights.empty());
+        J.attributeObject("total", [&] { writeHistogramJSON(J, Total); });
+        J.attributeArray("functions", [&] {
+            for (size_t i = 0; i < Funcs.size(); i++) {
+                J.object([&] {
+                    J.attribute("name", Funcs[i]->getName());
+                    if (!Weights.empty()) {
+                        J.attribute("weights", weightSource(Weights[i]));
+                    }
+                    J.attributeObject("opcodes", [&] { writeHistogramJSON(J, PerFunc[i]); });
+                });
+            }
+        });
+    });
+    Out << "\n";
+}
+
+// 函数名加引号，里面的引号写两遍
+template <typename CountT>
+static void writeCSVRows(raw_ostream &Out, StringRef Name, const BasicOpcodeHistogram<CountT> &Histogram) {
+    for (unsigned Op = 0; Op < BasicOpcodeHistogram<CountT>::NumOpcodes; Op++) {
+        CountT Count = Histogram.count(Op);
+        if (Count == 0) {
+            continue;
+        }
+        Out << '"';
+        for (char Ch : Name) {
+            if (Ch == '"') {
+                Out << '"';
+            }
+            Out << Ch;
+        }
+        Out << "\"," << Instruction::getOpcodeName(Op) << "," << formatOpcodeCount(Count, 0);
+        for (CountT C : Histogram.Counts[Op]) {
+            Out << "," << formatOpcodeCount(C, 0);
+        }
+        Out << "\n";
+    }
+}
+
+// 一个 opcode 一行，模块总计的函数名是 *
+template <typename CountT>
+static void writeCSV(raw_ostream &Out, const std::vector<Function *> &Funcs,
+                     const std::vector<BasicOpcodeHistogram<CountT>> &PerFunc,
+                     const BasicOpcodeHistogram<CountT> &Total) {
+    Out << "function,opcode,count";
+    for (const char *Class : ClassNames) {
+        Out << "," << Class;
+    }
+    Out << "\n";
+    writeCSVRows(Out, "*", Total);
+    for (size_t i = 0; i < Funcs.size(); i++) {
+        writeCSVRows(Out, Funcs[i]->getName(), PerFunc[i]);
+    }
+}
+
+// Path 是 - 时写到标准输出
+static void writeOutput(StringRef Path, function_ref<void(raw_ostream &)> Write) {
+    if (Path == "-") {
+        Write(outs());
+        return;
+    }
+    std::error_code EC;
+    raw_fd_ostream Out(Path, EC, sys::fs::OF_None);
+    if (EC) {
+        errs() << "写不了 " << Path << ": " << EC.message() << "\n";
+        return;
+    }
+    Write(Out);
+}
+
+// 统计只读 IR，结果按下标放，不用加锁。每个任务隔几个取一个函数，大小函数分得比较匀
+// BPI、BFI 这类分析不能放进来：它们在 LLVMContext 的 ValueHandle 表里登记块，表没有锁
+static void forEachFunctionParallel(size_t NumFuncs, function_ref<void(size_t)> Body) {
+    ThreadPool Pool(hardware_concurrency(Threads));
+    size_t NumTasks = std::min<size_t>(NumFuncs, Pool.getThreadCount());
+    for (size_t Task = 0; Task < NumTasks; Task++) {
+        Pool.async([&, Task] {
+            for (size_t i = Task; i < NumFuncs; i += NumTasks) {
+                Body(i);
+            }
+        });
+    }
+    Pool.wait();
+}
+
+// 按函数在模块里的顺序汇总，输出和线程数无关
+template <typename CountT>
+static void reportModule(raw_ostream &OS, const Module &M, const std::vector<Function *> &Funcs,
+                         const std::vector<BasicOpcodeHistogram<CountT>> &PerFunc,
+                         const std::vector<bool> &Weights) {
+    BasicOpcodeHistogram<CountT> Total;
+    for (auto &Histogram : PerFunc) {
+        Total += Histogram;
+    }
+
+    OS << "打印分析 OpcodeCounter pass 模块 " << M.getModuleIdentifier() << " 的"
+       << (Weights.empty() ? "结果" : "加权结果") << "，共 " << Funcs.size() << " 个函数";
+    if (!Weights.empty()) {
+        OS << "，" << std::count(Weights.begin(), Weights.end(), true) << " 个带 profile";
+    }
+    OS << "\n";
+    printOpcodeCounterResult(OS, Total);
+    if (!JSONOutput.empty()) {
+        writeOutput(JSONOutput, [&](raw_ostream &Out) { writeJSON(Out, M, Funcs, PerFunc, Total, Weights); });
+    }
+    if (!CSVOutput.empty()) {
+        writeOutput(CSVOutput, [&](raw_ostream &Out) { writeCSV(Out, Funcs, PerFunc, Total); });
+    }
+}
+
+PreservedAnalyses OpcodeCounterModulePrinter::run(Module &M, ModuleAnalysisManager &MAM) {
+    std::vector<Function *> Funcs;
+    for (auto &Func : M) {
+        if (!Func.isDeclaration()) {
+            Funcs.push_back(&Func);
+        }
+    }
+
+    if (Weighted) {
+        // 没有 profile 的函数权重是每次调用的相对频率，和带 profile 的函数加在一起只能看个大概
+        std::unique_ptr<OpcodeCounterCache> Cache;
+        if (!CachePath.empty()) {
+            Cache = std::make_unique<OpcodeCounterCache>(CachePath);
+        }
+        std::vector<WeightedOpcodeMix> Mixes(Funcs.size());
+        std::vector<uint64_t> Hashes(Funcs.size());
+        // 不用 vector<bool>，它的元素不能在不同线程里同时写
+        std::vector<char> Hit(Funcs.size(), false);
+        if (Cache) {
+            forEachFunctionParallel(Funcs.size(), [&](size_t i) {
+                Hashes[i] = hashFunctionStructure(*Funcs[i]);
+                Hit[i] = Cache->lookup(Hashes[i], Mixes[i]);
+            });
+        }
+        // 没命中的函数在这个线程里按顺序从分析管理器取 BFI，块的权重抄到普通数组里
+        auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        std::vector<std::vector<double>> BlockWeights(Funcs.size());
+        for (size_t i = 0; i < Funcs.size(); i++) {
+            if (!Hit[i]) {
+                BlockWeights[i] = blockWeights(*Funcs[i], FAM.getResult<BlockFrequencyAnalysis>(*Funcs[i]));
+            }
+        }
+        forEachFunctionParallel(Funcs.size(), [&](size_t i) {
+            if (Hit[i]) {
+                return;
+            }
+            Mixes[i] = addWeighted(*Funcs[i], BlockWeights[i]);
+            if (Cache) {
+                Cache->insert(Hashes[i], Mixes[i]);
+            }
+        });
+        if (Cache) {
+            Cache->save();
+            OS << "OpcodeCounter 缓存 " << CachePath << "：复用 " << Cache->hits() << " 个函数，重新计算 "
+               << Cache->misses() << " 个\n";
+        }
+        std::vector<WeightedOpcodeHistogram> PerFunc;
+        std::vector<bool> Weights;
+        for (auto &Mix : Mixes) {
+            PerFunc.push_back(Mix.Histogram);
+            Weights.push_back(Mix.FromProfile);
+        }
+        reportModule(OS, M, Funcs, PerFunc, Weights);
+        return PreservedAnalyses::all();
+    }
+
+    std::vector<OpcodeHistogram> PerFunc(Funcs.size());
+    forEachFunctionParallel(Funcs.size(), [&](size_t i) { PerFunc[i] = OpcodeCounter::generateOpcodeMap(*Funcs[i]); });
+    reportModule(OS, M, Funcs, PerFunc, {});
+    return PreservedAnalyses::all();
+}
+
 llvm::PassPluginLibraryInfo getOpcodeCounterPluginInfo() {
     return {LLVM_PLUGIN_API_VERSION, "OpcodeCounter", LLVM_VERSION_STRING,
             [](PassBuilder &PB) {
@@ -64,6 +364,24 @@ llvm::PassPluginLibraryInfo getOpcodeCounterPluginInfo() {
                             FPM.addPass(OpcodeCounterPrinter(llvm::errs()));
                             return true;
                         }
+                        if (Name == "print<opcode-counter-weighted>") {
+                            FPM.addPass(OpcodeCounterPrinter(llvm::errs(), true));
+                            return true;
+                        }
+                        return false;
+                    });
+                // 注册 opt -passes=print<opcode-counter-module>
+                PB.registerPipelineParsingCallback(
+                    [&](StringRef Name, ModulePassManager &MPM,
+                       ArrayRef<PassBuilder::PipelineElement>) {
+                        if (Name == "print<opcode-counter-module>") {
+                            MPM.addPass(OpcodeCounterModulePrinter(llvm::errs()));
+                            return true;
+                        }
+                        if (Name == "print<opcode-counter-module-weighted>") {
+                            MPM.addPass(OpcodeCounterModulePrinter(llvm::errs(), true));
+                            return true;
+                        }
                         return false;
                     });
                 // 注册 -O{1|2|3|s}
@@ -71,10 +389,11 @@ llvm::PassPluginLibraryInfo getOpcodeCounterPluginInfo() {
                     [](llvm::FunctionPassManager &PM, llvm::PassBuilder::OptimizationLevel Level) {
                         PM.addPass(OpcodeCounterPrinter(llvm::errs()));
                     });
-                // 注册 FAM.getResult<OpcodeCounter>(Func)
+                // 注册 FAM.getResult<OpcodeCounter>(Func) 和 FAM.getResult<WeightedOpcodeCounter>(Func)
                 PB.registerAnalysisRegistrationCallback(
                     [](FunctionAnalysisManager &FAM) {
                         FAM.registerPass([&] { return OpcodeCounter(); });
+                        FAM.registerPass([&] { return WeightedOpcodeCounter(); });
                     });
             }};
 }
@@ -83,18 +402,3 @@ extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
 llvmGetPassPluginInfo() {
     return getOpcodeCounterPluginInfo();
 }
-
-// 帮助函数
-static void printOpcodeCounterResult(raw_ostream &OutS, const ResultOpcodeCounter &OpcodeMap) {
-    OutS << "===========================" << "\n";
-    OutS << "OpcodeCounter 统计结果" << "\n";
-    OutS << "===========================" << "\n";
-    const char *str1 = "OPCODE";
-    const char *str2 = "#TIMES USED";
-    OutS << format("%-20s %-10s\n", str1, str2);
-    OutS << "===========================" << "\n";
-    for (auto &Inst : OpcodeMap) {
-        OutS << format("%-20s %-10lu\n", Inst.first().str().c_str(), Inst.second);
-    }
-    OutS << "===========================" << "\n\n";
-}
\ No newline at end of file
@@ -0,0 +1,206 @@
+/*
+OpcodeCounter 加权统计的磁盘缓存，见 OpcodeCounterCache.h。
+*/
+
+#include "OpcodeCounterCache.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include <cstring>
+
+using namespace llvm;
+
+namespace {
+// 把函数的结构按固定格式写成字节串，最后整体算一次 xxHash64
+class StructureWriter {
+public:
+    void writeInt(uint64_t V) { Bytes.append((const char *)&V, sizeof(V)); }
+
+    void writeString(StringRef S) {
+        writeInt(S.size());
+        Bytes.append(S.begin(), S.end());
+    }
+
+    void writeType(Type *Ty) {
+        writeInt(Ty->getTypeID());
+        if (Ty->isIntegerTy()) {
+            writeInt(Ty->getIntegerBitWidth());
+        } else if (auto *VTy = dyn_cast<VectorType>(Ty)) {
+            writeInt(VTy->getElementCount().getKnownMinValue());
+            writeType(VTy->getElementType());
+        }
+    }
+
+    // 只认 !prof 这类由字符串和整数组成的元数据
+    void writeMetadata(const MDNode *MD) {
+        if (!MD) {
+            writeInt(0);
+            return;
+        }
+        writeInt(MD->getNumOperands());
+        for (const MDOperand &Op : MD->operands()) {
+            if (auto *S = dyn_cast_or_null<MDString>(Op.get())) {
+                writeString(S->getString());
+            } else if (auto *CI = mdconst::dyn_extract_or_null<ConstantInt>(Op.get())) {
+                writeInt(CI->getValue().getLimitedValue());
+            } else {
+                writeInt(0);
+            }
+        }
+    }
+
+    std::string Bytes;
+};
+} // end namespace
+
+// 操作数的种类
+enum : uint64_t { OK_Local = 1, OK_Int, OK_FP, OK_Null, OK_Global, OK_Other };
+
+uint64_t hashFunctionStructure(const Function &F) {
+    // 参数、块、指令按出现的顺序编号，phi 可以引用后面的值，所以先编号
+    DenseMap<const Value *, uint64_t> Local;
+    uint64_t Next = 0;
+    for (auto &Arg : F.args()) {
+        Local[&Arg] = Next++;
+    }
+    for (auto &BB : F) {
+        Local[&BB] = Next++;
+        for (auto &Inst : BB) {
+            Local[&Inst] = Next++;
+        }
+    }
+
+    StructureWriter W;
+    W.writeString(F.getParent()->getTargetTriple());
+    W.writeType(F.getFunctionType());
+    W.writeInt(F.arg_size());
+    W.writeMetadata(F.getMetadata(LLVMContext::MD_prof));
+    for (auto &BB : F) {
+        W.writeInt(BB.size());
+        for (auto &Inst : BB) {
+            W.writeInt(Inst.getOpcode());
+            W.writeType(Inst.getType());
+            if (auto *Cmp = dyn_cast<CmpInst>(&Inst)) {
+                W.writeInt(Cmp->getPredicate());
+            }
+            if (auto *CB = dyn_cast<CallBase>(&Inst)) {
+                W.writeInt(CB->hasFnAttr(Attribute::Cold));
+                W.writeInt(CB->hasFnAttr(Attribute::NoReturn));
+            }
+            W.writeMetadata(Inst.getMetadata(LLVMContext::MD_prof));
+
+            W.writeInt(Inst.getNumOperands());
+            for (const Value *Op : Inst.operands()) {
+                W.writeType(Op->getType());
+                auto It = Local.find(Op);
+                if (It != Local.end()) {
+                    W.writeInt(OK_Local);
+                    W.writeInt(It->second);
+                } else if (auto *CI = dyn_cast<ConstantInt>(Op)) {
+                    W.writeInt(OK_Int);
+                    const APInt &Value = CI->getValue();
+                    W.Bytes.append((const char *)Value.getRawData(), Value.getNumWords() * sizeof(uint64_t));
+                } else if (auto *CF = dyn_cast<ConstantFP>(Op)) {
+                    W.writeInt(OK_FP);
+                    W.writeInt(CF->getValueAPF().bitcastToAPInt().getLimitedValue());
+                } else if (isa<ConstantPointerNull>(Op)) {
+                    W.writeInt(OK_Null);
+                } else if (auto *GV = dyn_cast<GlobalValue>(Op)) {
+                    W.writeInt(OK_Global);
+                    W.writeString(GV->getName());
+                } else {
+                    W.writeInt(OK_Other);
+                    W.writeInt(Op->getValueID());
+                }
+            }
+        }
+    }
+
+    // 避开 DenseMap 的空键和墓碑键
+    uint64_t Hash = xxHash64(W.Bytes);
+    return Hash >= ~0ULL - 1 ? Hash - 2 : Hash;
+}
+
+static const size_t CountsSize = sizeof(WeightedOpcodeHistogram::Counts);
+
+OpcodeCounterCache::OpcodeCounterCache(StringRef Path) : Path(Path.str()) {
+    auto Buf = MemoryBuffer::getFile(Path);
+    if (!Buf) {
+        return;
+    }
+    StringRef Data = (*Buf)->getBuffer();
+    OCCacheHeader Header;
+    if (Data.size() < sizeof(Header)) {
+        return;
+    }
+    memcpy(&Header, Data.data(), sizeof(Header));
+    if (Header.Magic != OCCacheMagic || Header.Version != OCCacheVersion ||
+        Header.LLVMMajor != LLVM_VERSION_MAJOR || Header.NumOpcodes != WeightedOpcodeHistogram::NumOpcodes ||
+        Header.NumClasses != OTC_NumClasses) {
+        return;
+    }
+    size_t RecordSize = sizeof(OCCacheEntry) + CountsSize;
+    if ((Data.size() - sizeof(Header)) / RecordSize < Header.NumEntries) {
+        return;
+    }
+    const char *P = Data.data() + sizeof(Header);
+    for (uint64_t i = 0; i < Header.NumEntries; i++, P += RecordSize) {
+        OCCacheEntry Entry;
+        memcpy(&Entry, P, sizeof(Entry));
+        WeightedOpcodeMix &Mix = Loaded[Entry.Hash];
+        Mix.FromProfile = Entry.FromProfile;
+        memcpy(Mix.Histogram.Counts.data(), P + sizeof(Entry), CountsSize);
+    }
+}
+
+bool OpcodeCounterCache::lookup(uint64_t Hash, WeightedOpcodeMix &Mix) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = Loaded.find(Hash);
+    if (It == Loaded.end()) {
+        Misses++;
+        return false;
+    }
+    Hits++;
+    Mix = It->second;
+    Used[Hash] = Mix;
+    return true;
+}
+
+void OpcodeCounterCache::insert(uint64_t Hash, const WeightedOpcodeMix &Mix) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Used[Hash] = Mix;
+}
+
+bool OpcodeCounterCache::save() {
+    int FD;
+    SmallString<128> TmpPath;
+    if (std::error_code EC = sys::fs::createUniqueFile(Path + ".tmp%%%%%%", FD, TmpPath)) {
+        errs() << "写不了 " << Path << ": " << EC.message() << "\n";
+        return false;
+    }
+    {
+        raw_fd_ostream OS(FD, true);
+        OCCacheHeader Header = {OCCacheMagic, OCCacheVersion, LLVM_VERSION_MAJOR, WeightedOpcodeHistogram::NumOpcodes,
+                                OTC_NumClasses, 0, Used.size()};
+        OS.write((const char *)&Header, sizeof(Header));
+        for (auto &Item : Used) {
+            OCCacheEntry Entry = {Item.first, Item.second.FromProfile};
+            OS.write((const char *)&Entry, sizeof(Entry));
+            OS.write((const char *)Item.second.Histogram.Counts.data(), CountsSize);
+        }
+    }
+    if (std::error_code EC = sys::fs::rename(TmpPath, Path)) {
+        errs() << "写不了 " << Path << ": " << EC.message() << "\n";
+        sys::fs::remove(TmpPath);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,108 @@
+/*
+OpcodeCounter 的直方图和表格打印
+
+OpcodeCounter 插件和 mingInterpreter -profile 都用这份代码，解释器统计到的执行次数和静态统计打印成同样的表格。
+不依赖 pass 管理器，MingInterpreter 直接把这个文件编译进去。
+*/
+
+#include "OpcodeCounter.h"
+#include "llvm/Support/CommandLine.h"
+
+using namespace llvm;
+
+static cl::opt<bool> ByType {
+    "opcode-counter-by-type",
+    cl::desc("按整数、浮点、向量、指针分列打印"),
+    cl::init(false)
+};
+
+format_object<int, unsigned long> formatOpcodeCount(uint64_t Count, int Width) {
+    return format("%-*lu", Width, (unsigned long)Count);
+}
+
+format_object<int, double> formatOpcodeCount(double Count, int Width) {
+    return format("%-*.2f", Width, Count);
+}
+
+static OpcodeTypeClass classify(const Instruction &Inst) {
+    Type *Ty = Inst.getType();
+    if (Ty->isVoidTy() && Inst.getNumOperands() > 0) {
+        Ty = Inst.getOperand(0)->getType();
+    }
+    if (Ty->isVectorTy()) {
+        return OTC_Vector;
+    }
+    if (Ty->isFloatingPointTy()) {
+        return OTC_FP;
+    }
+    if (Ty->isIntegerTy()) {
+        return OTC_Int;
+    }
+    if (Ty->isPointerTy()) {
+        return OTC_Pointer;
+    }
+    return OTC_Other;
+}
+
+template <typename CountT>
+void BasicOpcodeHistogram<CountT>::add(const Instruction &Inst, CountT Weight) {
+    Counts[Inst.getOpcode()][classify(Inst)] += Weight;
+}
+
+template <typename CountT>
+CountT BasicOpcodeHistogram<CountT>::count(unsigned Opcode) const {
+    CountT Sum = 0;
+    for (CountT C : Counts[Opcode]) {
+        Sum += C;
+    }
+    return Sum;
+}
+
+template <typename CountT>
+BasicOpcodeHistogram<CountT> &BasicOpcodeHistogram<CountT>::operator+=(const BasicOpcodeHistogram &Other) {
+    for (unsigned Op = 0; Op < NumOpcodes; Op++) {
+        for (unsigned C = 0; C < OTC_NumClasses; C++) {
+            Counts[Op][C] += Other.Counts[Op][C];
+        }
+    }
+    return *this;
+}
+
+template struct BasicOpcodeHistogram<uint64_t>;
+template struct BasicOpcodeHistogram<double>;
+
+template <typename CountT>
+void printOpcodeCounterResult(raw_ostream &OutS, const BasicOpcodeHistogram<CountT> &OpcodeMap) {
+    OutS << "===========================" << "\n";
+    OutS << "OpcodeCounter 统计结果" << "\n";
+    OutS << "===========================" << "\n";
+    const char *str1 = "OPCODE";
+    const char *str2 = "#TIMES USED";
+    OutS << format("%-20s %-10s", str1, str2);
+    if (ByType) {
+        const char *Classes[OTC_NumClasses] = {"INT", "FP", "VECTOR", "POINTER", "OTHER"};
+        for (const char *Class : Classes) {
+            OutS << format(" %-10s", Class);
+        }
+    }
+    OutS << "\n";
+    OutS << "===========================" << "\n";
+    // 按 opcode 的编号顺序，没出现的不打印
+    for (unsigned Op = 0; Op < BasicOpcodeHistogram<CountT>::NumOpcodes; Op++) {
+        CountT Count = OpcodeMap.count(Op);
+        if (Count == 0) {
+            continue;
+        }
+        OutS << format("%-20s ", Instruction::getOpcodeName(Op)) << formatOpcodeCount(Count, 10);
+        if (ByType) {
+            for (CountT C : OpcodeMap.Counts[Op]) {
+                OutS << " " << formatOpcodeCount(C, 10);
+            }
+        }
+        OutS << "\n";
+    }
+    OutS << "===========================" << "\n\n";
+}
+
+template void printOpcodeCounterResult(raw_ostream &, const BasicOpcodeHistogram<uint64_t> &);
+template void printOpcodeCounterResult(raw_ostream &, const BasicOpcodeHistogram<double> &);
@@ -13,9 +13,6 @@ opt -load-pass-plugin libStaticCallCounter.dylib -passes="print<static-cc>" -dis
 
 using namespace llvm;
 
-// 美化输出
-static void printStaticCCResult(llvm::raw_ostream &OutS, const ResultStaticCC &DirectCalls);
-
 // StaticCallCounter 的实现
 StaticCallCounter::Result StaticCallCounter::runOnModule(Module &M) {
     llvm::MapVector<const llvm::Function *, unsigned> Res; // 字典用来记录函数调用次数
@@ -50,7 +47,11 @@ StaticCallCounter::Result StaticCallCounter::runOnModule(Module &M) {
 
 PreservedAnalyses StaticCallCounterPrinter::run(Module &M, ModuleAnalysisManager &MAM) {
     auto DirectCalls = MAM.getResult<StaticCallCounter>(M);
-    printStaticCCResult(OS, DirectCalls);
+    NamedStaticCC Named;
+    for (auto &CallCount : DirectCalls) {
+        Named[CallCount.first->getName().str()] = CallCount.second;
+    }
+    printStaticCCResult(OS, Named);
     return PreservedAnalyses::all();
 }
 
@@ -91,7 +92,7 @@ llvmGetPassPluginInfo() {
 }
 
 // 帮助函数
-static void printStaticCCResult(raw_ostream &OutS, const ResultStaticCC &DirectCalls) {
+void printStaticCCResult(raw_ostream &OutS, const NamedStaticCC &DirectCalls) {
     OutS << "=================================" << "\n";
     OutS << "静态调用结果:" << "\n";
     OutS << "=================================" << "\n";
@@ -101,7 +102,7 @@ static void printStaticCCResult(raw_ostream &OutS, const ResultStaticCC &DirectC
     OutS << "=================================" << "\n";
     
     for (auto &CallCount : DirectCalls) {
-        OutS << format("%-20s %-10lu\n", CallCount.first->getName().str().c_str(), CallCount.second);
+        OutS << format("%-20s %-10lu\n", CallCount.first.c_str(), CallCount.second);
     }
     OutS << "=================================" << "\n";
 }
\ No newline at end of file
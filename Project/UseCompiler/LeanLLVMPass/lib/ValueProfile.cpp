@@ -0,0 +1,400 @@
+/*
+值剖析和按剖析结果特化，见 ValueProfile.h。
+
+-vp-kinds 选择剖析、特化哪几类位置，默认全部。不选的位置序号照样占着，两边的序号才对得上。
+插桩时也可以用 -vp-allow、-vp-deny 等只挑一部分函数，见 FunctionFilter.h。
+
+特化的条件：最常见的值至少出现 -vs-min-count 次，并且占这个位置执行次数的 -vs-min-percent 以上。
+分支权重按剖析结果设置。
+
+使用方法：
+1. 插桩、运行
+opt -load <BUILD_DIR>/lib/libValueProfile.so -load-pass-plugin <BUILD_DIR>/lib/libValueProfile.so --passes="value-prof" <bitcode-file> -o instrumented.bin
+VP_PROFILE=vp.prof lli -load <BUILD_DIR>/lib/libValueProfileRuntime.so instrumented.bin
+2. 在原来的 IR 上特化，再跑一遍优化
+opt -load <BUILD_DIR>/lib/libValueProfile.so -load-pass-plugin <BUILD_DIR>/lib/libValueProfile.so --passes="value-spec,default<O2>" -vs-profile=vp.prof <bitcode-file> -o specialized.bin
+
+*/
+
+#include "ValueProfile.h"
+#include "FunctionFilter.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/CallPromotionUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <cstring>
+#include <map>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "value-profile"
+
+STATISTIC(NumSitesInstrumented, "The # of value profiling sites instrumented");
+STATISTIC(NumDivSpecialized, "The # of divisions specialized on a constant divisor");
+STATISTIC(NumSwitchSpecialized, "The # of switches given a fast path for the hottest case");
+STATISTIC(NumCallsPromoted, "The # of indirect calls promoted to direct calls");
+
+static cl::list<VPKind> Kinds {
+    "vp-kinds",
+    cl::desc("剖析、特化哪几类位置，默认全部"),
+    cl::values(
+        clEnumValN(VPDivisor, "div", "整数除法、取余的除数"),
+        clEnumValN(VPSwitchCond, "switch", "switch 的条件"),
+        clEnumValN(VPCallTarget, "call", "间接调用的目标")),
+    cl::CommaSeparated
+};
+static FunctionFilterOptions FilterOpts("vp");
+
+static cl::list<std::string> ProfileFiles {
+    "vs-profile",
+    cl::desc("ValueProfiler 写的剖析文件，多个时合并"),
+    cl::value_desc("filename"),
+    cl::CommaSeparated
+};
+static cl::opt<unsigned> MinPercent {
+    "vs-min-percent",
+    cl::desc("最常见的值至少占这个百分比才特化"),
+    cl::value_desc("percent"),
+    cl::init(80)
+};
+static cl::opt<uint64_t> MinCount {
+    "vs-min-count",
+    cl::desc("最常见的值至少出现这么多次才特化"),
+    cl::value_desc("N"),
+    cl::init(1000)
+};
+
+static bool wantKind(VPKind Kind) {
+    return Kinds.empty() || is_contained(Kinds, Kind);
+}
+
+std::vector<ValueSite> collectValueSites(Function &F) {
+    std::vector<ValueSite> Sites;
+    for (BasicBlock &BB : F) {
+        for (Instruction &I : BB) {
+            if (auto *BO = dyn_cast<BinaryOperator>(&I)) {
+                unsigned Op = BO->getOpcode();
+                bool IsDiv = Op == Instruction::UDiv || Op == Instruction::SDiv || Op == Instruction::URem ||
+                             Op == Instruction::SRem;
+                if (IsDiv && BO->getType()->isIntegerTy() && BO->getType()->getIntegerBitWidth() <= 64 &&
+                    !isa<Constant>(BO->getOperand(1))) {
+                    Sites.push_back({&I, VPDivisor, BO->getOperand(1)});
+                }
+            } else if (auto *SI = dyn_cast<SwitchInst>(&I)) {
+                if (SI->getCondition()->getType()->getIntegerBitWidth() <= 64 && !isa<Constant>(SI->getCondition())) {
+                    Sites.push_back({&I, VPSwitchCond, SI->getCondition()});
+                }
+            } else if (auto *CB = dyn_cast<CallBase>(&I)) {
+                if (CB->isIndirectCall()) {
+                    Sites.push_back({&I, VPCallTarget, CB->getCalledOperand()});
+                }
+            }
+        }
+    }
+    return Sites;
+}
+
+// 和 ValueProfileData.h 里的 VPSite 一致
+static StructType *getSiteType(LLVMContext &CTX) {
+    Type *I32 = Type::getInt32Ty(CTX);
+    Type *I64 = Type::getInt64Ty(CTX);
+    StructType *EntryTy = StructType::get(CTX, {I64, I64});
+    return StructType::get(CTX, {I64, I32, I32, I64, ArrayType::get(EntryTy, VPTopK), Type::getInt8PtrTy(CTX), I32, I32});
+}
+
+// 模块构造函数里把取过地址的函数登记给运行时，用来把间接调用的目标换成 GUID
+static void registerFuncs(Module &M) {
+    LLVMContext &CTX = M.getContext();
+    Type *I8Ptr = Type::getInt8PtrTy(CTX);
+    Type *I64 = Type::getInt64Ty(CTX);
+    StructType *FuncTy = StructType::get(CTX, {I8Ptr, I64});
+
+    std::vector<Constant *> Table;
+    for (Function &F : M) {
+        if (F.hasAddressTaken()) {
+            Table.push_back(ConstantStruct::get(
+                FuncTy, {ConstantExpr::getBitCast(&F, I8Ptr),
+                         ConstantInt::get(I64, Function::getGUID(F.getGlobalIdentifier()))}));
+        }
+    }
+    if (Table.empty()) {
+        return;
+    }
+    ArrayType *TableTy = ArrayType::get(FuncTy, Table.size());
+    auto *Funcs = new GlobalVariable(M, TableTy, true, GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, Table), "VP.Funcs");
+
+    FunctionCallee Register = M.getOrInsertFunction("__vp_register_funcs", Type::getVoidTy(CTX),
+                                                    PointerType::getUnqual(FuncTy), I64);
+    Function *Init = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                      GlobalValue::InternalLinkage, "VP.init", M);
+    IRBuilder<> B(BasicBlock::Create(CTX, "entry", Init));
+    B.CreateCall(Register, {B.CreateConstInBoundsGEP2_64(TableTy, Funcs, 0, 0), B.getInt64(Table.size())});
+    B.CreateRetVoid();
+    appendToGlobalCtors(M, Init, /*Priority=*/0);
+}
+
+// ValueProfiler 的实现
+bool ValueProfiler::runOnModule(Module &M) {
+    LLVMContext &CTX = M.getContext();
+    Type *I32 = Type::getInt32Ty(CTX);
+    Type *I64 = Type::getInt64Ty(CTX);
+    StructType *SiteTy = getSiteType(CTX);
+    FunctionCallee Record =
+        M.getOrInsertFunction("__vp_record", Type::getVoidTy(CTX), PointerType::getUnqual(SiteTy), I64);
+
+    // 先挑出要插桩的函数，后面生成的辅助函数不会混进来
+    FunctionFilter Filter(FilterOpts);
+    std::vector<Function *> Profiled;
+    for (Function &F : M) {
+        if (!F.isDeclaration() && Filter.shouldInstrument(F)) {
+            Profiled.push_back(&F);
+        }
+    }
+
+    bool Changed = false;
+    bool HasCallSites = false;
+    for (Function *F : Profiled) {
+        uint64_t GUID = Function::getGUID(F->getGlobalIdentifier());
+        std::vector<ValueSite> Sites = collectValueSites(*F);
+        for (unsigned Idx = 0; Idx < Sites.size(); Idx++) {
+            const ValueSite &S = Sites[Idx];
+            if (!wantKind(S.Kind)) {
+                continue;
+            }
+            Constant *Init = ConstantStruct::get(
+                SiteTy, {ConstantInt::get(I64, GUID), ConstantInt::get(I32, Idx), ConstantInt::get(I32, S.Kind),
+                         ConstantInt::get(I64, 0), ConstantAggregateZero::get(SiteTy->getElementType(4)),
+                         ConstantPointerNull::get(Type::getInt8PtrTy(CTX)), ConstantInt::get(I32, 0),
+                         ConstantInt::get(I32, 0)});
+            auto *Site = new GlobalVariable(M, SiteTy, false, GlobalValue::PrivateLinkage, Init, "VP.Site");
+            Site->setAlignment(Align(8));
+
+            // 在 I 前面记录操作数
+            IRBuilder<> B(S.I);
+            Value *V = S.Kind == VPCallTarget ? B.CreatePtrToInt(S.Operand, I64) : B.CreateZExt(S.Operand, I64);
+            B.CreateCall(Record, {Site, V});
+            HasCallSites |= S.Kind == VPCallTarget;
+            NumSitesInstrumented++;
+            Changed = true;
+        }
+
+        // 下面只在 -debug 模式显示
+        LLVM_DEBUG(dbgs() << "Profiling " << Sites.size() << " sites in " << F->getName() << "\n");
+    }
+
+    if (!Changed) {
+        return false;
+    }
+    if (HasCallSites) {
+        registerFuncs(M);
+    }
+
+    // 模块结束时写文件
+    Function *Fini = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                      GlobalValue::InternalLinkage, "VP.fini", M);
+    IRBuilder<> B(BasicBlock::Create(CTX, "entry", Fini));
+    B.CreateCall(M.getOrInsertFunction("__vp_dump", Type::getVoidTy(CTX)));
+    B.CreateRetVoid();
+    appendToGlobalDtors(M, Fini, /*Priority=*/0);
+    return true;
+}
+
+PreservedAnalyses ValueProfiler::run(llvm::Module &M, llvm::ModuleAnalysisManager &) {
+    bool Changed = runOnModule(M);
+    return (Changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all());
+}
+
+namespace {
+// 合并以后一个位置的剖析结果
+struct SiteProfile {
+    uint32_t Kind;
+    uint64_t Total = 0;
+    std::map<uint64_t, uint64_t> Counts;
+};
+} // end namespace
+
+using ProfileMap = std::map<std::pair<uint64_t, uint32_t>, SiteProfile>;
+
+static void readProfile(StringRef Path, ProfileMap &Profile) {
+    auto Buf = MemoryBuffer::getFile(Path);
+    if (!Buf) {
+        report_fatal_error(Twine("打不开 ") + Path + ": " + Buf.getError().message());
+    }
+    StringRef Data = (*Buf)->getBuffer();
+    VPProfileHeader Header;
+    if (Data.size() < sizeof(Header)) {
+        report_fatal_error(Twine(Path) + ": 文件太短");
+    }
+    memcpy(&Header, Data.data(), sizeof(Header));
+    if (Header.Magic != VPProfileMagic || Header.Version != VPProfileVersion ||
+        (Data.size() - sizeof(Header)) / sizeof(VPProfileRecord) < Header.NumRecords) {
+        report_fatal_error(Twine(Path) + ": 不是 ValueProfiler 的剖析文件，或者版本不对");
+    }
+    const char *P = Data.data() + sizeof(Header);
+    for (uint64_t i = 0; i < Header.NumRecords; i++, P += sizeof(VPProfileRecord)) {
+        VPProfileRecord Record;
+        memcpy(&Record, P, sizeof(Record));
+        SiteProfile &S = Profile[{Record.FuncGUID, Record.Index}];
+        S.Kind = Record.Kind;
+        S.Total += Record.Total;
+        for (const VPEntry &E : Record.Entries) {
+            if (E.Count) {
+                S.Counts[E.Value] += E.Count;
+            }
+        }
+    }
+}
+
+// 分支权重是 32 位的，次数太大时等比例缩小
+static MDNode *hotWeights(LLVMContext &CTX, uint64_t Hot, uint64_t Total) {
+    uint64_t Cold = Total > Hot ? Total - Hot : 0;
+    uint64_t Scale = std::max(Hot, Cold) / UINT32_MAX + 1;
+    return MDBuilder(CTX).createBranchWeights(Hot / Scale, Cold / Scale);
+}
+
+// d == C ? x / C : x / d
+static void specializeDivision(BinaryOperator *I, ConstantInt *C, MDNode *Weights) {
+    IRBuilder<> B(I);
+    Value *Cmp = B.CreateICmpEQ(I->getOperand(1), C);
+    Instruction *ThenTerm, *ElseTerm;
+    SplitBlockAndInsertIfThenElse(Cmp, I, &ThenTerm, &ElseTerm, Weights);
+    BasicBlock *Tail = ThenTerm->getSuccessor(0);
+
+    Instruction *Fast = I->clone();
+    Fast->setOperand(1, C);
+    Fast->setName(I->getName() + ".fast");
+    Fast->insertBefore(ThenTerm);
+    I->moveBefore(ElseTerm);
+
+    PHINode *Phi = PHINode::Create(I->getType(), 2, "", &Tail->front());
+    I->replaceAllUsesWith(Phi);
+    Phi->addIncoming(Fast, ThenTerm->getParent());
+    Phi->addIncoming(I, ElseTerm->getParent());
+    Phi->takeName(I);
+}
+
+// 条件等于 C 时直接跳到它的分支，否则再走 switch
+static void specializeSwitch(SwitchInst *SI, ConstantInt *C, MDNode *Weights) {
+    BasicBlock *BB = SI->getParent();
+    BasicBlock *Dest = SI->findCaseValue(C)->getCaseSuccessor();
+    BasicBlock *SwitchBB = SplitBlock(BB, SI);
+
+    Instruction *OldBr = BB->getTerminator();
+    IRBuilder<> B(OldBr);
+    B.CreateCondBr(B.CreateICmpEQ(SI->getCondition(), C), Dest, SwitchBB, Weights);
+    OldBr->eraseFromParent();
+    for (PHINode &PN : Dest->phis()) {
+        PN.addIncoming(PN.getIncomingValueForBlock(SwitchBB), BB);
+    }
+}
+
+// ValueSpecializer 的实现
+bool ValueSpecializer::runOnModule(Module &M) {
+    if (ProfileFiles.empty()) {
+        report_fatal_error("value-spec 需要 -vs-profile");
+    }
+    ProfileMap Profile;
+    for (const std::string &Path : ProfileFiles) {
+        readProfile(Path, Profile);
+    }
+
+    LLVMContext &CTX = M.getContext();
+    DenseMap<uint64_t, Function *> ByGUID;
+    std::vector<Function *> Defined;
+    for (Function &F : M) {
+        ByGUID[Function::getGUID(F.getGlobalIdentifier())] = &F;
+        if (!F.isDeclaration()) {
+            Defined.push_back(&F);
+        }
+    }
+
+    bool Changed = false;
+    for (Function *F : Defined) {
+        uint64_t GUID = Function::getGUID(F->getGlobalIdentifier());
+        // 先把位置都列出来再改，改的时候会拆块、复制指令
+        std::vector<ValueSite> Sites = collectValueSites(*F);
+        for (unsigned Idx = 0; Idx < Sites.size(); Idx++) {
+            const ValueSite &S = Sites[Idx];
+            auto It = Profile.find({GUID, Idx});
+            if (!wantKind(S.Kind) || It == Profile.end() || It->second.Kind != S.Kind) {
+                continue;
+            }
+            const SiteProfile &P = It->second;
+            auto Best = std::max_element(P.Counts.begin(), P.Counts.end(),
+                                         [](const std::pair<const uint64_t, uint64_t> &A,
+                                            const std::pair<const uint64_t, uint64_t> &B) {
+                                             return A.second < B.second;
+                                         });
+            if (Best == P.Counts.end() || Best->second < MinCount || Best->second * 100 < P.Total * MinPercent) {
+                continue;
+            }
+            MDNode *Weights = hotWeights(CTX, Best->second, P.Total);
+
+            switch (S.Kind) {
+            case VPDivisor:
+                specializeDivision(cast<BinaryOperator>(S.I), cast<ConstantInt>(ConstantInt::get(S.Operand->getType(), Best->first)),
+                                   Weights);
+                NumDivSpecialized++;
+                break;
+            case VPSwitchCond:
+                specializeSwitch(cast<SwitchInst>(S.I), cast<ConstantInt>(ConstantInt::get(S.Operand->getType(), Best->first)),
+                                 Weights);
+                NumSwitchSpecialized++;
+                break;
+            case VPCallTarget: {
+                Function *Callee = ByGUID.lookup(Best->first);
+                auto &CB = cast<CallBase>(*S.I);
+                if (!Callee || !isLegalToPromote(CB, Callee)) {
+                    continue;
+                }
+                promoteCallWithIfThenElse(CB, Callee, Weights);
+                NumCallsPromoted++;
+                break;
+            }
+            }
+            LLVM_DEBUG(dbgs() << "Specialized site " << Idx << " in " << F->getName() << " on " << Best->first
+                              << " (" << Best->second << "/" << P.Total << ")\n");
+            Changed = true;
+        }
+    }
+    return Changed;
+}
+
+PreservedAnalyses ValueSpecializer::run(llvm::Module &M, llvm::ModuleAnalysisManager &) {
+    bool Changed = runOnModule(M);
+    return (Changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all());
+}
+
+// 注册
+llvm::PassPluginLibraryInfo getValueProfilePluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "ValueProfile", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) {
+                PB.registerPipelineParsingCallback(
+                    [](StringRef Name, ModulePassManager &MPM,
+                       ArrayRef<PassBuilder::PipelineElement>) {
+                        if (Name == "value-prof") {
+                            MPM.addPass(ValueProfiler());
+                            return true;
+                        }
+                        if (Name == "value-spec") {
+                            MPM.addPass(ValueSpecializer());
+                            return true;
+                        }
+                        return false;
+                    });
+            }}; // end return
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return getValueProfilePluginInfo();
+}
@@ -0,0 +1,220 @@
+/*
+InjectFuncCall -ifc-buffered 的运行时，格式见 FuncTrace.h。
+
+每个线程第一次进入被跟踪的函数时分配一个环形缓冲区，挂到全局链表上。线程退出时把缓冲区标成退役，
+后台线程写完里面剩下的记录后把它从链表上摘下来释放。__ift_enter 只往自己的缓冲区里写一条
+16 字节的记录，单生产者单消费者，不加锁。后台线程每毫秒把所有缓冲区里的记录 fwrite 到文件。
+缓冲区满时生产者叫醒后台线程，等它腾出位置，不丢记录。
+程序退出时（atexit）停掉后台线程，把剩下的记录写完。之后再进入的函数不记录。
+
+文件名取环境变量 IFT_TRACE，默认是 ift.trace。
+
+链接方式：
+llc -relocation-model=pic instrumented.bin -o instrumented.s
+gcc instrumented.s -o instrumented -L <BUILD_DIR>/lib -lFuncTraceRuntime -Wl,-rpath,<BUILD_DIR>/lib
+*/
+
+#include "FuncTrace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+
+namespace {
+
+// 每个线程的缓冲区能放的记录数，2 的幂
+const uint64_t Capacity = 1 << 16;
+
+struct ThreadBuffer {
+    // 生产者写 Head，后台线程写 Tail，分开放在两条缓存行上
+    alignas(64) std::atomic<uint64_t> Head{0};
+    alignas(64) std::atomic<uint64_t> Tail{0};
+    // 线程已经退出，Head 不会再变
+    std::atomic<bool> Retired{false};
+    // 只有持有 FileLock 的线程会改已经挂上链表的缓冲区的 Next
+    ThreadBuffer *Next = nullptr;
+    FuncTraceRecord Records[Capacity];
+};
+
+std::atomic<ThreadBuffer *> Buffers{nullptr};
+// 热路径上只读这个指针，有析构函数的 thread_local 每次访问都要检查初始化
+thread_local ThreadBuffer *CurrentBuffer = nullptr;
+// 缓冲区已经退役或者分配失败，这个线程不再记录
+thread_local bool NoBuffer = false;
+
+// 线程退出时把缓冲区交给后台线程释放
+struct BufferRetirer {
+    ThreadBuffer *B;
+    ~BufferRetirer() {
+        // 线程退出之后还有 thread_local 析构函数会进被跟踪的函数，不能再往缓冲区里写
+        CurrentBuffer = nullptr;
+        NoBuffer = true;
+        B->Retired.store(true, std::memory_order_release);
+    }
+};
+
+// 文件和后台线程
+std::mutex FileLock;
+FILE *Output = nullptr;
+uint32_t NumFuncs = 0;
+
+std::mutex WakeLock;
+std::condition_variable Wake;
+std::thread Flusher;
+std::atomic<bool> Started{false};
+std::atomic<bool> Stopping{false};
+std::atomic<bool> Stopped{false};
+
+uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// 把退役的 B 从链表上摘下来释放。Prev 是 B 的前一个，B 是表头时为 nullptr。调用者持有 FileLock
+void release(ThreadBuffer *Prev, ThreadBuffer *B) {
+    if (Prev) {
+        Prev->Next = B->Next;
+    } else {
+        // 新线程只会往表头插，表头变了就从新表头往后找 B 的前一个
+        ThreadBuffer *Head = B;
+        if (!Buffers.compare_exchange_strong(Head, B->Next, std::memory_order_acquire)) {
+            while (Head->Next != B) {
+                Head = Head->Next;
+            }
+            Head->Next = B->Next;
+        }
+    }
+    B->~ThreadBuffer();
+    free(B);
+}
+
+// 把所有缓冲区里已经写好的记录写到文件，释放写完的退役缓冲区。调用者持有 FileLock
+void drain() {
+    ThreadBuffer *Prev = nullptr;
+    ThreadBuffer *B = Buffers.load(std::memory_order_acquire);
+    while (B) {
+        // 先看退役再读 Head，退役了读到的就是最后的 Head
+        bool Retired = B->Retired.load(std::memory_order_acquire);
+        uint64_t Tail = B->Tail.load(std::memory_order_relaxed);
+        uint64_t Head = B->Head.load(std::memory_order_acquire);
+        while (Tail != Head) {
+            // 环绕时分两段写
+            uint64_t Begin = Tail & (Capacity - 1);
+            uint64_t Count = std::min(Head - Tail, Capacity - Begin);
+            fwrite(&B->Records[Begin], sizeof(FuncTraceRecord), Count, Output);
+            Tail += Count;
+        }
+        B->Tail.store(Tail, std::memory_order_release);
+        ThreadBuffer *Next = B->Next;
+        if (Retired) {
+            release(Prev, B);
+        } else {
+            Prev = B;
+        }
+        B = Next;
+    }
+}
+
+void flushLoop() {
+    std::unique_lock<std::mutex> Lock(WakeLock);
+    while (!Stopping.load()) {
+        Wake.wait_for(Lock, std::chrono::milliseconds(1));
+        std::lock_guard<std::mutex> Guard(FileLock);
+        drain();
+    }
+}
+
+void shutdown() {
+    Stopping.store(true);
+    Wake.notify_one();
+    Flusher.join();
+    std::lock_guard<std::mutex> Guard(FileLock);
+    drain();
+    Stopped.store(true);
+    fclose(Output);
+}
+
+// 第一次登记时打开文件、启动后台线程。调用者持有 FileLock
+bool start() {
+    const char *Path = getenv("IFT_TRACE");
+    Output = fopen(Path ? Path : "ift.trace", "wb");
+    if (!Output) {
+        perror("ift: fopen");
+        return false;
+    }
+    FuncTraceHeader Header = {FuncTraceMagic, FuncTraceVersion};
+    fwrite(&Header, sizeof(Header), 1, Output);
+    Flusher = std::thread(flushLoop);
+    atexit(shutdown);
+    Started.store(true);
+    return true;
+}
+
+// 分配失败返回 nullptr，这个线程之后不再记录
+ThreadBuffer *newBuffer() {
+    // C++14 的 new 不保证按缓存行对齐
+    void *Mem = aligned_alloc(alignof(ThreadBuffer), sizeof(ThreadBuffer));
+    if (!Mem) {
+        NoBuffer = true;
+        fputs("ift: 分配跟踪缓冲区失败，这个线程的调用不再记录\n", stderr);
+        return nullptr;
+    }
+    ThreadBuffer *B = new (Mem) ThreadBuffer;
+    // 每个线程只会走到这里一次，析构函数在线程退出时执行
+    static thread_local BufferRetirer Retirer{B};
+    ThreadBuffer *Old = Buffers.load(std::memory_order_relaxed);
+    do {
+        B->Next = Old;
+    } while (!Buffers.compare_exchange_weak(Old, B, std::memory_order_release, std::memory_order_relaxed));
+    return B;
+}
+
+} // end namespace
+
+extern "C" uint32_t __ift_register(const char **Names, uint32_t N) {
+    std::lock_guard<std::mutex> Guard(FileLock);
+    if (!Output && !start()) {
+        return 0;
+    }
+    uint32_t Base = NumFuncs;
+    NumFuncs += N;
+    static const char Zeros[8] = {0};
+    for (uint32_t i = 0; i < N; i++) {
+        uint64_t Len = strlen(Names[i]);
+        FuncTraceRecord Record = {Base + i, FuncTraceNameTag, Len};
+        fwrite(&Record, sizeof(Record), 1, Output);
+        fwrite(Names[i], 1, Len, Output);
+        fwrite(Zeros, 1, (8 - Len % 8) % 8, Output);
+    }
+    return Base;
+}
+
+extern "C" void __ift_enter(uint32_t FuncId, uint32_t NumArgs) {
+    if (!Started.load(std::memory_order_relaxed) || Stopped.load(std::memory_order_relaxed)) {
+        return;
+    }
+    ThreadBuffer *B = CurrentBuffer;
+    if (!B) {
+        if (NoBuffer || !(B = CurrentBuffer = newBuffer())) {
+            return;
+        }
+    }
+    uint64_t Head = B->Head.load(std::memory_order_relaxed);
+    while (Head - B->Tail.load(std::memory_order_acquire) == Capacity) {
+        if (Stopped.load()) {
+            return;
+        }
+        Wake.notify_one();
+        std::this_thread::yield();
+    }
+    B->Records[Head & (Capacity - 1)] = {FuncId, NumArgs, now()};
+    B->Head.store(Head + 1, std::memory_order_release);
+}
@@ -0,0 +1,111 @@
+/*
+ValueProfiler 的运行时，格式见 ValueProfile.h。
+
+每个位置是插桩时生成的一个 VPSite 全局变量。第一次执行时挂到全局链表上。被插桩模块的析构函数调用 __vp_dump 写文件，
+不用 atexit：lli 里这些全局变量在 JIT 的内存里，动态库的 atexit 跑的时候已经释放了。
+多个插桩过的模块链接在一起时每个模块退出时都写一次，最后一次包含所有位置。
+前 K 个值用 Misra-Gries 算法：值已经在表里就加一，有空位就占上，否则所有计数减一。
+这样每个值的计数不会多算，少算的不超过 总数 / (K + 1)，拿来判断某个值是否占绝大多数不会误判。
+更新表时用每个位置自己的自旋锁，抢不到就只加总数，不等待。
+
+文件名取环境变量 VP_PROFILE，默认是 vp.prof。
+*/
+
+#include "ValueProfileData.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+std::atomic<VPSite *> Sites{nullptr};
+
+std::mutex FuncLock;
+std::vector<VPFunc> Funcs;
+
+void registerSite(VPSite *S) {
+    uint32_t Expected = 0;
+    if (!__atomic_compare_exchange_n(&S->Registered, &Expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+    VPSite *Head = Sites.load(std::memory_order_relaxed);
+    do {
+        S->Next = Head;
+    } while (!Sites.compare_exchange_weak(Head, S, std::memory_order_release, std::memory_order_relaxed));
+}
+
+} // end namespace
+
+extern "C" void __vp_dump() {
+    std::unordered_map<uint64_t, uint64_t> GUIDs;
+    {
+        std::lock_guard<std::mutex> Guard(FuncLock);
+        for (const VPFunc &F : Funcs) {
+            GUIDs[(uint64_t)F.Addr] = F.GUID;
+        }
+    }
+
+    std::vector<VPProfileRecord> Records;
+    for (VPSite *S = Sites.load(std::memory_order_acquire); S; S = S->Next) {
+        VPProfileRecord Record = {S->FuncGUID, S->Index, S->Kind, S->Total, {}};
+        for (unsigned i = 0; i < VPTopK; i++) {
+            Record.Entries[i] = S->Entries[i];
+            // 不认识的地址写 0，不会匹配任何函数
+            if (S->Kind == VPCallTarget && Record.Entries[i].Count) {
+                auto It = GUIDs.find(Record.Entries[i].Value);
+                Record.Entries[i].Value = It != GUIDs.end() ? It->second : 0;
+            }
+        }
+        Records.push_back(Record);
+    }
+
+    const char *Path = getenv("VP_PROFILE");
+    FILE *Out = fopen(Path ? Path : "vp.prof", "wb");
+    if (!Out) {
+        perror("vp: fopen");
+        return;
+    }
+    VPProfileHeader Header = {VPProfileMagic, VPProfileVersion, Records.size()};
+    fwrite(&Header, sizeof(Header), 1, Out);
+    fwrite(Records.data(), sizeof(VPProfileRecord), Records.size(), Out);
+    fclose(Out);
+}
+
+extern "C" void __vp_register_funcs(const VPFunc *Table, uint64_t N) {
+    std::lock_guard<std::mutex> Guard(FuncLock);
+    Funcs.insert(Funcs.end(), Table, Table + N);
+}
+
+extern "C" void __vp_record(VPSite *S, uint64_t Value) {
+    if (!__atomic_load_n(&S->Registered, __ATOMIC_RELAXED)) {
+        registerSite(S);
+    }
+    __atomic_fetch_add(&S->Total, 1, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&S->Lock, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    VPEntry *Empty = nullptr;
+    for (VPEntry &E : S->Entries) {
+        if (E.Count && E.Value == Value) {
+            E.Count++;
+            __atomic_store_n(&S->Lock, 0, __ATOMIC_RELEASE);
+            return;
+        }
+        if (!E.Count && !Empty) {
+            Empty = &E;
+        }
+    }
+    if (Empty) {
+        *Empty = {Value, 1};
+    } else {
+        for (VPEntry &E : S->Entries) {
+            E.Count--;
+        }
+    }
+    __atomic_store_n(&S->Lock, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,213 @@
+/*
+动态分析结果读取工具
+
+DynamicCallCounter 加上 -dcc-output 以后，被插桩的程序退出时把每个函数的 GUID 和调用次数写成二进制文件。
+这个工具读一个或多个这样的文件，按 GUID 把次数加起来，按次数从大到小打印，格式和 printf_wrapper 打印的一样。
+给了插桩前的模块时用它把 GUID 查回函数名，否则打印 GUID。-dcc-blocks 写的块次数也一起合并、打印，块名同样要靠模块查回来。
+
+使用方式：
+1. 插桩并运行，每次运行写一个文件
+opt -load <BUILD_DIR>/lib/libDynamicCallCounter.so -load-pass-plugin <BUILD_DIR>/lib/libDynamicCallCounter.so --passes="dynamic-cc" -dcc-output=dcc.prof <bitcode-file> -o instrumented.bin
+DCC_PROFILE=run1.prof lli instrumented.bin
+DCC_PROFILE=run2.prof lli instrumented.bin
+2. 合并、打印
+<BUILD/DIR>/bin/dynamic-profile -module <bitcode-file> run1.prof run2.prof -o merged.prof
+
+*/
+
+#include "DynamicCallCounter.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSlotTracker.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <vector>
+
+using namespace llvm;
+
+// 命令行参数
+static cl::OptionCategory ProfileCategory("dynamic profile options");
+static cl::list<std::string> InputFiles{
+    cl::Positional,
+    cl::desc{"<profile files>"},
+    cl::OneOrMore,
+    cl::cat{ProfileCategory}};
+static cl::opt<std::string> ModuleFile{
+    "module",
+    cl::desc{"插桩前的模块，用来把 GUID 查回函数名"},
+    cl::value_desc{"bitcode filename"},
+    cl::init(""),
+    cl::cat{ProfileCategory}};
+static cl::opt<std::string> OutputFile{
+    "o",
+    cl::desc{"合并结果写成同样格式的二进制文件"},
+    cl::value_desc{"filename"},
+    cl::init(""),
+    cl::cat{ProfileCategory}};
+
+// (GUID, 块序号) --> 执行次数，按函数、块的顺序排
+using BlockCountMap = std::map<std::pair<uint64_t, uint64_t>, uint64_t>;
+
+// 读一个文件，次数加到 Counts、BlockCounts 里。格式不对返回 false
+static bool readProfile(StringRef Path, DenseMap<uint64_t, uint64_t> &Counts, BlockCountMap &BlockCounts,
+                        uint64_t &SampleRate) {
+    auto Buf = MemoryBuffer::getFile(Path);
+    if (!Buf) {
+        errs() << "打不开 " << Path << ": " << Buf.getError().message() << "\n";
+        return false;
+    }
+    StringRef Data = (*Buf)->getBuffer();
+    DCCProfileHeader Header;
+    if (Data.size() < sizeof(Header)) {
+        errs() << Path << ": 文件太短\n";
+        return false;
+    }
+    memcpy(&Header, Data.data(), sizeof(Header));
+    if (Header.Magic != DCCProfileMagic || Header.Version != DCCProfileVersion) {
+        errs() << Path << ": 不是 DynamicCallCounter 的剖析文件，或者版本不对\n";
+        return false;
+    }
+    uint64_t Body = Data.size() - sizeof(Header);
+    if (Body / sizeof(DCCProfileRecord) < Header.NumFuncs ||
+        (Body - Header.NumFuncs * sizeof(DCCProfileRecord)) / sizeof(DCCProfileBlockRecord) < Header.NumBlocks) {
+        errs() << Path << ": 记录不完整\n";
+        return false;
+    }
+    const char *P = Data.data() + sizeof(Header);
+    for (uint64_t i = 0; i < Header.NumFuncs; i++, P += sizeof(DCCProfileRecord)) {
+        DCCProfileRecord Record;
+        memcpy(&Record, P, sizeof(Record));
+        Counts[Record.GUID] += Record.Count;
+    }
+    for (uint64_t i = 0; i < Header.NumBlocks; i++, P += sizeof(DCCProfileBlockRecord)) {
+        DCCProfileBlockRecord Record;
+        memcpy(&Record, P, sizeof(Record));
+        BlockCounts[{Record.GUID, Record.Block}] += Record.Count;
+    }
+    SampleRate = std::max(SampleRate, Header.SampleRate);
+    return true;
+}
+
+static bool writeProfile(StringRef Path, const std::vector<std::pair<uint64_t, uint64_t>> &Counts,
+                         const BlockCountMap &BlockCounts, uint64_t SampleRate) {
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+    if (EC) {
+        errs() << "写不了 " << Path << ": " << EC.message() << "\n";
+        return false;
+    }
+    DCCProfileHeader Header = {DCCProfileMagic, DCCProfileVersion, Counts.size(), SampleRate, BlockCounts.size()};
+    OS.write((const char *)&Header, sizeof(Header));
+    for (auto &Item : Counts) {
+        DCCProfileRecord Record = {Item.first, Item.second};
+        OS.write((const char *)&Record, sizeof(Record));
+    }
+    for (auto &Item : BlockCounts) {
+        DCCProfileBlockRecord Record = {Item.first.first, Item.first.second, Item.second};
+        OS.write((const char *)&Record, sizeof(Record));
+    }
+    return true;
+}
+
+// Main driver 代码
+int main(int Argc, char **Argv) {
+    // 隐藏所有 options
+    cl::HideUnrelatedOptions(ProfileCategory);
+    // 解析命令行
+    cl::ParseCommandLineOptions(Argc, Argv, "读取、合并 DynamicCallCounter 的二进制剖析文件\n");
+
+    // 确保 llvm_shutdown 在程序结束时被调用，它会自动释放 LLVM 对象内存
+    llvm_shutdown_obj SDO;
+
+    DenseMap<uint64_t, uint64_t> Counts;
+    BlockCountMap BlockCounts;
+    uint64_t SampleRate = 1;
+    for (const std::string &Path : InputFiles) {
+        if (!readProfile(Path, Counts, BlockCounts, SampleRate)) {
+            return -1;
+        }
+    }
+
+    // GUID 查回函数名，(GUID, 块序号) 查回块名
+    DenseMap<uint64_t, std::string> Names;
+    std::map<std::pair<uint64_t, uint64_t>, std::string> BlockNames;
+    LLVMContext Ctx;
+    if (!ModuleFile.empty()) {
+        SMDiagnostic Err;
+        std::unique_ptr<Module> M = parseIRFile(ModuleFile, Err, Ctx);
+        if (!M) {
+            errs() << "Error reading bitcode file: " << ModuleFile << "\n";
+            Err.print(Argv[0], errs());
+            return -1;
+        }
+        ModuleSlotTracker MST(M.get());
+        for (Function &F : *M) {
+            uint64_t GUID = Function::getGUID(F.getGlobalIdentifier());
+            Names[GUID] = F.getName().str();
+            if (F.isDeclaration()) {
+                continue;
+            }
+            MST.incorporateFunction(F);
+            uint64_t Idx = 0;
+            for (BasicBlock &BB : F) {
+                std::string Name;
+                raw_string_ostream OS(Name);
+                OS << F.getName() << ":";
+                BB.printAsOperand(OS, false, MST);
+                BlockNames[{GUID, Idx++}] = OS.str();
+            }
+        }
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> Sorted(Counts.begin(), Counts.end());
+    std::sort(Sorted.begin(), Sorted.end(),
+              [](const std::pair<uint64_t, uint64_t> &A, const std::pair<uint64_t, uint64_t> &B) {
+                  return A.second != B.second ? A.second > B.second : A.first < B.first;
+              });
+
+    if (!OutputFile.empty() && !writeProfile(OutputFile, Sorted, BlockCounts, SampleRate)) {
+        return -1;
+    }
+
+    // 和 printf_wrapper 的表格一样
+    raw_ostream &OutS = outs();
+    OutS << "====================================================\n";
+    OutS << "动态分析结果：\n";
+    OutS << "====================================================\n";
+    if (SampleRate > 1) {
+        OutS << "每个线程每 " << SampleRate << " 次调用采样一次，次数是估计值\n";
+    }
+    OutS << "函数名                      #N 调用次数\n";
+    OutS << "----------------------------------------------------\n";
+    for (auto &Item : Sorted) {
+        auto It = Names.find(Item.first);
+        std::string Name = It != Names.end() ? It->second : "0x" + utohexstr(Item.first);
+        OutS << format("%-20s %-10lu\n", Name.c_str(), Item.second);
+    }
+
+    if (!BlockCounts.empty()) {
+        OutS << "====================================================\n";
+        OutS << "基本块执行次数：\n";
+        OutS << "====================================================\n";
+        OutS << "函数名:基本块                   #N 执行次数\n";
+        OutS << "----------------------------------------------------\n";
+        for (auto &Item : BlockCounts) {
+            auto It = BlockNames.find(Item.first);
+            std::string Name = It != BlockNames.end()
+                                   ? It->second
+                                   : "0x" + utohexstr(Item.first.first) + ":" + utostr(Item.first.second);
+            OutS << format("%-30s %-10lu\n", Name.c_str(), Item.second);
+        }
+    }
+    return 0;
+}
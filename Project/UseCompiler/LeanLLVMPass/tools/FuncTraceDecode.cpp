@@ -0,0 +1,105 @@
+/*
+把 InjectFuncCall -ifc-buffered 的二进制跟踪文件还原成文本
+
+各线程的记录按时间戳合并，输出和 InjectFuncCall 默认插入的 printf 一样。加上 -timestamps 时每条前面加上
+相对第一条记录的纳秒数。
+
+使用方式：
+<BUILD_DIR>/bin/ift-decode ift.trace
+*/
+
+#include "FuncTrace.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+// 命令行参数
+static cl::OptionCategory DecodeCategory("ift-decode options");
+static cl::opt<std::string> InputFile{
+    cl::Positional,
+    cl::desc{"<trace file>"},
+    cl::Required,
+    cl::cat{DecodeCategory}};
+static cl::opt<bool> Timestamps{
+    "timestamps",
+    cl::desc{"每条记录前打印相对时间（纳秒）"},
+    cl::init(false),
+    cl::cat{DecodeCategory}};
+
+// Main driver 代码
+int main(int Argc, char **Argv) {
+    // 隐藏所有 options
+    cl::HideUnrelatedOptions(DecodeCategory);
+    // 解析命令行
+    cl::ParseCommandLineOptions(Argc, Argv, "还原 InjectFuncCall 的二进制跟踪\n");
+
+    // 确保 llvm_shutdown 在程序结束时被调用，它会自动释放 LLVM 对象内存
+    llvm_shutdown_obj SDO;
+
+    auto Buf = MemoryBuffer::getFile(InputFile);
+    if (!Buf) {
+        errs() << "打不开 " << InputFile << ": " << Buf.getError().message() << "\n";
+        return -1;
+    }
+    StringRef Data = (*Buf)->getBuffer();
+    FuncTraceHeader Header;
+    if (Data.size() < sizeof(Header)) {
+        errs() << InputFile << ": 文件太短\n";
+        return -1;
+    }
+    memcpy(&Header, Data.data(), sizeof(Header));
+    if (Header.Magic != FuncTraceMagic || Header.Version != FuncTraceVersion) {
+        errs() << InputFile << ": 不是 InjectFuncCall 的跟踪文件，或者版本不对\n";
+        return -1;
+    }
+
+    // 名字记录和普通记录分开
+    std::vector<std::string> Names;
+    std::vector<FuncTraceRecord> Records;
+    uint64_t Pos = sizeof(Header);
+    while (Pos + sizeof(FuncTraceRecord) <= Data.size()) {
+        FuncTraceRecord Record;
+        memcpy(&Record, Data.data() + Pos, sizeof(Record));
+        Pos += sizeof(Record);
+        if (Record.NumArgs != FuncTraceNameTag) {
+            Records.push_back(Record);
+            continue;
+        }
+        if (Pos + Record.Timestamp > Data.size()) {
+            errs() << InputFile << ": 名字记录不完整\n";
+            return -1;
+        }
+        if (Names.size() <= Record.FuncId) {
+            Names.resize(Record.FuncId + 1);
+        }
+        Names[Record.FuncId] = Data.substr(Pos, Record.Timestamp).str();
+        Pos += alignTo(Record.Timestamp, 8);
+    }
+    if (Pos != Data.size()) {
+        errs() << InputFile << ": 最后一条记录不完整，忽略\n";
+    }
+
+    std::stable_sort(Records.begin(), Records.end(), [](const FuncTraceRecord &A, const FuncTraceRecord &B) {
+        return A.Timestamp < B.Timestamp;
+    });
+
+    // 和 InjectFuncCall 的 printf 一样
+    raw_ostream &OutS = outs();
+    for (const FuncTraceRecord &Record : Records) {
+        if (Timestamps) {
+            OutS << format("[%12lu] ", Record.Timestamp - Records.front().Timestamp);
+        }
+        StringRef Name = Record.FuncId < Names.size() ? StringRef(Names[Record.FuncId]) : StringRef("<unknown>");
+        OutS << "函数名：" << Name << "\n 参数个数：" << Record.NumArgs << "\n";
+    }
+    return 0;
+}
@@ -4,11 +4,16 @@
 
 这是一个命令行工具，用于统计输入的 LLVM 文件中的所有静态调用，用的是 StaticCallCounter pass
 
+可以给多个文件或者目录，目录下所有的 .bc 和 .ll 文件都会被分析。每个文件在线程池里用自己的 LLVMContext 解析、分析，
+只把按函数名汇总的结果带回来，按文件名排序以后依次合并，输出和线程数无关。
+内部链接的函数（static 函数）不同文件里可以重名，名字前面加上源文件名，写成 file.c:helper，外部链接的只用函数名。
+
 使用方式：
 1. 生成 llvm 文件
 clang -emit-llvm <input-file> -c -o <output-file>
 2. 运行
 <BUILD/DIR>/bin/static <output-llvm-file>
+<BUILD/DIR>/bin/static -j 16 <dir> <more-llvm-files>
 
 */
 
@@ -16,26 +21,40 @@ clang -emit-llvm <input-file> -c -o <output-file>
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 
 using namespace llvm;
 
 // 命令行参数
 static cl::OptionCategory CallCounterCategory("call counter options");
-static cl::opt<std::string> InputModule{
+static cl::list<std::string> InputModules{
     cl::Positional,
-    cl::desc{"<Module to analyze>"},
+    cl::desc{"<Modules or directories to analyze>"},
     cl::value_desc{"bitcode filename"},
-    cl::init(""),
-    cl::Required,
+    cl::OneOrMore,
+    cl::cat{CallCounterCategory}};
+static cl::opt<unsigned> Threads{
+    "j",
+    cl::desc{"并行分析的线程数，0 表示和 CPU 核数一样"},
+    cl::value_desc{"N"},
+    cl::init(0),
     cl::cat{CallCounterCategory}};
 
+// 一个文件的分析结果
+struct FileResult {
+    bool Ok = false;
+    // 解析失败时的错误信息
+    std::string Error;
+    NamedStaticCC DirectCalls;
+};
+
 // static 实现
-static void countStaicCalls(Module &M) {
-    // 创建一个 pass 管理器模块，并添加 StaticCallCounterPrinter pass
-    ModulePassManager MPM;
-    MPM.addPass(StaticCallCounterPrinter(llvm::errs()));
+static NamedStaticCC countStaicCalls(Module &M) {
     // 创建一个分析管理器，并注册 StaticCallCounter pass
     ModuleAnalysisManager MAM;
     MAM.registerPass([&] { return StaticCallCounter{}; });
@@ -43,9 +62,52 @@ static void countStaicCalls(Module &M) {
     // 注册所有定义在 PassRegisty.def 可用的分析 pass。我们只需要 PassInstrumentationAnalysis，为了保持简洁，可以让 PassBuilder 注册所有的分析 pass。
     PassBuilder PB;
     PB.registerModuleAnalyses(MAM);
-    // 最后运行
-    MPM.run(M, MAM);
+    // 最后运行，结果按函数名带出来，M 和它的 LLVMContext 马上就要释放
+    // getGlobalIdentifier() 给内部链接的函数加上源文件名，不同模块里的同名 static 函数不会合并成一行
+    NamedStaticCC Named;
+    for (auto &CallCount : MAM.getResult<StaticCallCounter>(M)) {
+        Named[CallCount.first->getGlobalIdentifier()] = CallCount.second;
+    }
+    return Named;
+}
 
+// 在线程池里运行，每个文件一个 LLVMContext，线程之间不共享 LLVM 对象
+static void analyzeFile(const std::string &Path, const char *Argv0, FileResult &Result) {
+    SMDiagnostic Err;
+    LLVMContext Ctx;
+    std::unique_ptr<Module> M = parseIRFile(Path, Err, Ctx);
+    if (!M) {
+        raw_string_ostream OS(Result.Error);
+        OS << "Error reading bitcode file: " << Path << "\n";
+        Err.print(Argv0, OS);
+        return;
+    }
+    Result.DirectCalls = countStaicCalls(*M);
+    Result.Ok = true;
+}
+
+// 展开目录，按文件名排序
+static std::vector<std::string> collectInputs() {
+    std::vector<std::string> Files;
+    for (const std::string &Input : InputModules) {
+        if (!sys::fs::is_directory(Input)) {
+            Files.push_back(Input);
+            continue;
+        }
+        std::error_code EC;
+        for (sys::fs::recursive_directory_iterator It(Input, EC), End; It != End && !EC; It.increment(EC)) {
+            StringRef Ext = sys::path::extension(It->path());
+            if ((Ext == ".bc" || Ext == ".ll") && !sys::fs::is_directory(It->path())) {
+                Files.push_back(It->path());
+            }
+        }
+        if (EC) {
+            errs() << "读不了目录 " << Input << ": " << EC.message() << "\n";
+        }
+    }
+    std::sort(Files.begin(), Files.end());
+    Files.erase(std::unique(Files.begin(), Files.end()), Files.end());
+    return Files;
 }
 
 // Main driver 代码
@@ -59,19 +121,40 @@ int main(int Argc, char **Argv) {
     // http://llvm.org/docs/ProgrammersManual.html#ending-execution-with-llvm-shutdown
     llvm_shutdown_obj SDO;
 
-    // 解析 IR 文件
-    SMDiagnostic Err;
-    LLVMContext Ctx;
-    std::unique_ptr<Module> M = parseIRFile(InputModule, Err, Ctx);
-
-    if (!M) {
-        errs() << "Error reading bitcode file: " << InputModule << "\n";
-        Err.print(Argv[0], errs());
+    std::vector<std::string> Files = collectInputs();
+    if (Files.empty()) {
+        errs() << "没有找到 .bc 或 .ll 文件\n";
         return -1;
     }
 
+    // 解析 IR 文件并分析，结果按下标放，不用加锁
+    std::vector<FileResult> Results(Files.size());
+    if (Files.size() == 1) {
+        analyzeFile(Files[0], Argv[0], Results[0]);
+    } else {
+        ThreadPool Pool(hardware_concurrency(Threads));
+        for (size_t i = 0; i < Files.size(); i++) {
+            Pool.async([&, i] { analyzeFile(Files[i], Argv[0], Results[i]); });
+        }
+        Pool.wait();
+    }
+
+    // 按文件顺序合并，函数的顺序是第一次出现的顺序
+    NamedStaticCC Merged;
+    bool Failed = false;
+    for (FileResult &Result : Results) {
+        if (!Result.Ok) {
+            errs() << Result.Error;
+            Failed = true;
+            continue;
+        }
+        for (auto &CallCount : Result.DirectCalls) {
+            Merged[CallCount.first] += CallCount.second;
+        }
+    }
+
     // 运行分析打印
-    countStaicCalls(*M);
-    return 0;
+    printStaticCCResult(errs(), Merged);
+    return Failed ? -1 : 0;
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,1137 @@
+#include "MBytecode.h"
+#include "MCache.h"
+#include "MExtern.h"
+#include "MTier.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemAlloc.h"
+#include "llvm/Support/Host.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "mbytecode"
+
+STATISTIC(NumFused, "合成超级指令的次数");
+
+// GCC 和 Clang 支持 &&label，用直接线程化分派
+#if defined(__GNUC__)
+#define M_THREADED_DISPATCH 1
+#else
+#define M_THREADED_DISPATCH 0
+#endif
+
+static inline uint64_t maskFor(unsigned Bits) {
+    return Bits >= 64 ? ~0ULL : (1ULL << Bits) - 1;
+}
+
+static inline int64_t sext(uint64_t V, unsigned Bits) {
+    return (int64_t)(V << (64 - Bits)) >> (64 - Bits);
+}
+
+template <typename T> static inline T loadAs(const void *P) {
+    T V;
+    memcpy(&V, P, sizeof(T));
+    return V;
+}
+
+template <typename T> static inline void storeAs(void *P, T V) {
+    memcpy(P, &V, sizeof(T));
+}
+
+static bool fcmp(unsigned Pred, double X, double Y) {
+    bool Uno = std::isnan(X) || std::isnan(Y);
+    switch (Pred) {
+    case FCmpInst::FCMP_FALSE: return false;
+    case FCmpInst::FCMP_OEQ: return !Uno && X == Y;
+    case FCmpInst::FCMP_OGT: return !Uno && X > Y;
+    case FCmpInst::FCMP_OGE: return !Uno && X >= Y;
+    case FCmpInst::FCMP_OLT: return !Uno && X < Y;
+    case FCmpInst::FCMP_OLE: return !Uno && X <= Y;
+    case FCmpInst::FCMP_ONE: return !Uno && X != Y;
+    case FCmpInst::FCMP_ORD: return !Uno;
+    case FCmpInst::FCMP_UNO: return Uno;
+    case FCmpInst::FCMP_UEQ: return Uno || X == Y;
+    case FCmpInst::FCMP_UGT: return Uno || X > Y;
+    case FCmpInst::FCMP_UGE: return Uno || X >= Y;
+    case FCmpInst::FCMP_ULT: return Uno || X < Y;
+    case FCmpInst::FCMP_ULE: return Uno || X <= Y;
+    case FCmpInst::FCMP_UNE: return Uno || X != Y;
+    default: return true;
+    }
+}
+
+bool MBytecodeEngine::isSlotType(Type *Ty) {
+    if (Ty->isIntegerTy())
+        return Ty->getIntegerBitWidth() <= 64;
+    return Ty->isFloatTy() || Ty->isDoubleTy() ||
+           (Ty->isPointerTy() && Ty->getPointerAddressSpace() == 0);
+}
+
+// 整数和指针的位宽，指针按 64 位处理
+static unsigned bitsOf(Type *Ty) {
+    return Ty->isIntegerTy() ? Ty->getIntegerBitWidth() : 64;
+}
+
+GenericValue MBytecodeEngine::toGeneric(MSlot S, Type *Ty) {
+    GenericValue GV;
+    switch (Ty->getTypeID()) {
+    case Type::IntegerTyID:
+        GV.IntVal = APInt(Ty->getIntegerBitWidth(), S.I);
+        break;
+    case Type::FloatTyID:
+        GV.FloatVal = S.F;
+        break;
+    case Type::DoubleTyID:
+        GV.DoubleVal = S.D;
+        break;
+    case Type::PointerTyID:
+        GV.PointerVal = S.P;
+        break;
+    default:
+        break;
+    }
+    return GV;
+}
+
+MSlot MBytecodeEngine::fromGeneric(const GenericValue &GV, Type *Ty) {
+    MSlot S;
+    S.I = 0;
+    switch (Ty->getTypeID()) {
+    case Type::IntegerTyID:
+        S.I = GV.IntVal.getZExtValue();
+        break;
+    case Type::FloatTyID:
+        S.F = GV.FloatVal;
+        break;
+    case Type::DoubleTyID:
+        S.D = GV.DoubleVal;
+        break;
+    case Type::PointerTyID:
+        S.P = GV.PointerVal;
+        break;
+    default:
+        break;
+    }
+    return S;
+}
+
+// 降级
+namespace {
+class MLowering {
+    public:
+    MLowering(ExecutionEngine &EE, MRuntime &RT, Function &F)
+        : RT(RT), F(F), DL(EE.getDataLayout()) {}
+
+    std::unique_ptr<MBytecodeFunction> run();
+
+    private:
+    // 边上的跳转目标，有 PHI 的关键边和条件跳转的回边会生成一段跳板
+    struct Edge {
+        BasicBlock *Pred;
+        BasicBlock *Succ;
+        bool NeedsStub;
+        bool Backedge;
+    };
+    // 哪条指令的哪个字段需要回填
+    enum FixupField { FixImm, FixB, FixDst };
+    struct Fixup {
+        uint32_t Inst;
+        FixupField Field;
+        uint32_t Edge;
+    };
+    struct SwitchFixup {
+        uint32_t Table;
+        int32_t Case; // -1 表示 default
+        uint32_t Edge;
+    };
+
+    bool fail(const Twine &Why) {
+        LLVM_DEBUG(dbgs() << "mbytecode: 不降级 " << F.getName() << "：" << Why << "\n");
+        Failed = true;
+        return false;
+    }
+    uint32_t newSlot() { return NextSlot++; }
+    uint32_t slotOf(Value *V);
+    bool numberValues();
+    uint32_t emit(MOp Op, uint32_t Dst = 0, uint32_t A = 0, uint32_t B = 0,
+                  int64_t Imm = 0, unsigned Bits = 64, unsigned Aux = 0);
+    uint32_t edgeTo(BasicBlock *Pred, BasicBlock *Succ, bool Critical);
+    void emitPhiMoves(BasicBlock *Pred, BasicBlock *Succ);
+    MInst *loweredAtEnd(Instruction *I, unsigned N);
+    bool fuseCmpBranch(BranchInst &BI);
+    bool fuseGEPLoad(LoadInst &LI);
+    bool fuseAddMem(StoreInst &SI);
+    bool lowerInst(Instruction &I);
+    bool lowerBinary(BinaryOperator &BO);
+    bool lowerCast(CastInst &CI);
+    bool lowerGEP(GetElementPtrInst &GEP);
+    bool lowerCall(CallInst &CI);
+    bool lowerBranch(Instruction &I);
+
+    MRuntime &RT;
+    Function &F;
+    const DataLayout &DL;
+    std::unique_ptr<MBytecodeFunction> BF;
+    DenseMap<const Value *, uint32_t> Slots;
+    std::vector<std::pair<uint32_t, MSlot>> Consts;
+    std::vector<uint32_t> Temps;
+    DenseMap<const BasicBlock *, uint32_t> BlockPC;
+    // 每条 IR 指令降级出来的第一条字节码
+    DenseMap<const Instruction *, uint32_t> InstPC;
+    DenseMap<std::pair<BasicBlock *, BasicBlock *>, uint32_t> EdgeIds;
+    DenseSet<std::pair<const BasicBlock *, const BasicBlock *>> Backedges;
+    std::vector<Edge> Edges;
+    std::vector<Fixup> Fixups;
+    std::vector<SwitchFixup> SwitchFixups;
+    BasicBlock *NextBB = nullptr;
+    uint32_t NextSlot = 0;
+    bool Failed = false;
+};
+} // end namespace
+
+uint32_t MLowering::slotOf(Value *V) {
+    auto It = Slots.find(V);
+    if (It != Slots.end())
+        return It->second;
+
+    // 到这里的只会是常量，指令和参数在 numberValues 里已经编号
+    auto *C = dyn_cast<Constant>(V);
+    if (!C || !MBytecodeEngine::isSlotType(V->getType())) {
+        fail("不支持的操作数");
+        return 0;
+    }
+    MSlot S;
+    S.I = 0;
+    if (auto *CI = dyn_cast<ConstantInt>(C)) {
+        S.I = CI->getZExtValue();
+    } else if (auto *CF = dyn_cast<ConstantFP>(C)) {
+        if (C->getType()->isFloatTy())
+            S.F = CF->getValueAPF().convertToFloat();
+        else
+            S.D = CF->getValueAPF().convertToDouble();
+    } else if (!isa<ConstantPointerNull>(C) && !isa<UndefValue>(C)) {
+        // 全局变量、函数和常量表达式交给解释器解析
+        S = MBytecodeEngine::fromGeneric(RT.constantValue(C), C->getType());
+        BF->Relocs.push_back({NextSlot, C});
+    }
+    uint32_t Slot = newSlot();
+    Slots[V] = Slot;
+    Consts.push_back({Slot, S});
+    return Slot;
+}
+
+// 给参数和有结果的指令编号。零扩展、指针 bitcast 这类不改变槽内容的指令直接复用操作数的槽
+bool MLowering::numberValues() {
+    for (Argument &Arg : F.args()) {
+        if (!MBytecodeEngine::isSlotType(Arg.getType()))
+            return fail("不支持的参数类型");
+        Slots[&Arg] = newSlot();
+    }
+    for (BasicBlock &BB : F) {
+        for (Instruction &I : BB) {
+            if (I.getType()->isVoidTy())
+                continue;
+            if (!MBytecodeEngine::isSlotType(I.getType()))
+                return fail("不支持的结果类型 " + Twine(I.getOpcodeName()));
+            bool Alias = false;
+            switch (I.getOpcode()) {
+            case Instruction::ZExt:
+            case Instruction::Freeze:
+            case Instruction::IntToPtr:
+                Alias = true;
+                break;
+            case Instruction::BitCast:
+                Alias = I.getType()->isPointerTy();
+                break;
+            case Instruction::PtrToInt:
+                Alias = bitsOf(I.getType()) == 64;
+                break;
+            default:
+                break;
+            }
+            Value *Op = Alias ? I.getOperand(0) : nullptr;
+            if (Op && !isa<PHINode>(Op) && MBytecodeEngine::isSlotType(Op->getType()) &&
+                (isa<Constant>(Op) || Slots.count(Op))) {
+                Slots[&I] = slotOf(Op);
+                continue;
+            }
+            Slots[&I] = newSlot();
+        }
+    }
+    return !Failed;
+}
+
+uint32_t MLowering::emit(MOp Op, uint32_t Dst, uint32_t A, uint32_t B,
+                         int64_t Imm, unsigned Bits, unsigned Aux) {
+    MInst Inst;
+    Inst.Target = nullptr;
+    Inst.Op = Op;
+    Inst.Bits = Bits;
+    Inst.Aux = Aux;
+    Inst.Dst = Dst;
+    Inst.A = A;
+    Inst.B = B;
+    Inst.Imm = Imm;
+    BF->Code.push_back(Inst);
+    return BF->Code.size() - 1;
+}
+
+uint32_t MLowering::edgeTo(BasicBlock *Pred, BasicBlock *Succ, bool Critical) {
+    auto Key = std::make_pair(Pred, Succ);
+    auto It = EdgeIds.find(Key);
+    if (It != EdgeIds.end())
+        return It->second;
+    bool Backedge = Backedges.count({Pred, Succ});
+    bool NeedsStub = Critical && (Backedge || isa<PHINode>(Succ->begin()));
+    Edges.push_back({Pred, Succ, NeedsStub, Backedge});
+    EdgeIds[Key] = Edges.size() - 1;
+    return Edges.size() - 1;
+}
+
+// PHI 的赋值是并行的，源槽和目标槽有重叠时先拷到临时槽
+void MLowering::emitPhiMoves(BasicBlock *Pred, BasicBlock *Succ) {
+    SmallVector<std::pair<uint32_t, uint32_t>, 8> Moves;
+    for (PHINode &PN : Succ->phis()) {
+        uint32_t Dst = Slots[&PN];
+        uint32_t Src = slotOf(PN.getIncomingValueForBlock(Pred));
+        if (Dst != Src)
+            Moves.push_back({Dst, Src});
+    }
+    bool Overlap = false;
+    for (auto &M : Moves)
+        for (auto &N : Moves)
+            if (M.second == N.first)
+                Overlap = true;
+    if (!Overlap) {
+        for (auto &M : Moves)
+            emit(OP_MOV, M.first, M.second);
+        return;
+    }
+    while (Temps.size() < Moves.size())
+        Temps.push_back(newSlot());
+    for (unsigned i = 0; i < Moves.size(); i++)
+        emit(OP_MOV, Temps[i], Moves[i].second);
+    for (unsigned i = 0; i < Moves.size(); i++)
+        emit(OP_MOV, Moves[i].first, Temps[i]);
+}
+
+std::unique_ptr<MBytecodeFunction> MLowering::run() {
+    // 槽里的 float 和窄整数按小端布局读写
+    if (!sys::IsLittleEndianHost)
+        return nullptr;
+    if (F.isDeclaration() || F.isVarArg())
+        return nullptr;
+    if (!F.getReturnType()->isVoidTy() && !MBytecodeEngine::isSlotType(F.getReturnType()))
+        return nullptr;
+
+    BF.reset(new MBytecodeFunction());
+    BF->F = &F;
+    BF->NumArgs = F.arg_size();
+    if (!numberValues())
+        return nullptr;
+
+    // 回边用 JMP_BACK 跳，顺便记热度
+    SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 8> BackedgeList;
+    FindFunctionBackedges(F, BackedgeList);
+    Backedges.insert(BackedgeList.begin(), BackedgeList.end());
+
+    for (auto It = F.begin(), E = F.end(); It != E; ++It) {
+        BasicBlock &BB = *It;
+        NextBB = std::next(It) == E ? nullptr : &*std::next(It);
+        BlockPC[&BB] = BF->Code.size();
+        for (Instruction &I : BB) {
+            InstPC[&I] = BF->Code.size();
+            if (!lowerInst(I) || Failed)
+                return nullptr;
+        }
+    }
+
+    // 关键边的跳板：PHI 赋值后跳到后继块
+    std::vector<uint32_t> EdgePC(Edges.size());
+    for (unsigned i = 0; i < Edges.size(); i++) {
+        if (!Edges[i].NeedsStub) {
+            EdgePC[i] = BlockPC[Edges[i].Succ];
+            continue;
+        }
+        EdgePC[i] = BF->Code.size();
+        emitPhiMoves(Edges[i].Pred, Edges[i].Succ);
+        emit(Edges[i].Backedge ? OP_JMP_BACK : OP_JMP, 0, 0, 0, BlockPC[Edges[i].Succ]);
+    }
+    if (Failed)
+        return nullptr;
+    for (Fixup &Fix : Fixups) {
+        MInst &Inst = BF->Code[Fix.Inst];
+        if (Fix.Field == FixImm)
+            Inst.Imm = EdgePC[Fix.Edge];
+        else if (Fix.Field == FixB)
+            Inst.B = EdgePC[Fix.Edge];
+        else
+            Inst.Dst = EdgePC[Fix.Edge];
+    }
+    for (SwitchFixup &Fix : SwitchFixups) {
+        MSwitchTable &Table = BF->Switches[Fix.Table];
+        if (Fix.Case < 0)
+            Table.Default = EdgePC[Fix.Edge];
+        else
+            Table.Cases[Fix.Case].second = EdgePC[Fix.Edge];
+    }
+
+    // 帧模板
+    BF->Frame.resize(NextSlot);
+    for (MSlot &S : BF->Frame)
+        S.I = 0;
+    for (auto &C : Consts)
+        BF->Frame[C.first] = C.second;
+
+    LLVM_DEBUG(dbgs() << "mbytecode: " << F.getName() << " -> " << BF->Code.size()
+                      << " 条指令, " << NextSlot << " 个槽\n");
+    return std::move(BF);
+}
+
+bool MLowering::lowerInst(Instruction &I) {
+    uint32_t Dst = I.getType()->isVoidTy() ? M_NO_SLOT : Slots[&I];
+
+    if (auto *BO = dyn_cast<BinaryOperator>(&I))
+        return lowerBinary(*BO);
+    if (auto *CI = dyn_cast<CastInst>(&I))
+        return lowerCast(*CI);
+
+    switch (I.getOpcode()) {
+    case Instruction::PHI:
+        // 在前驱的出边上赋值
+        return true;
+    case Instruction::FNeg:
+        emit(I.getType()->isFloatTy() ? OP_FNEG_F : OP_FNEG_D, Dst, slotOf(I.getOperand(0)));
+        return true;
+    case Instruction::Freeze:
+        if (Slots[&I] != slotOf(I.getOperand(0)))
+            emit(OP_MOV, Dst, slotOf(I.getOperand(0)));
+        return true;
+    case Instruction::ICmp: {
+        auto &Cmp = cast<ICmpInst>(I);
+        Type *OpTy = Cmp.getOperand(0)->getType();
+        MOp Op;
+        switch (Cmp.getPredicate()) {
+        case CmpInst::ICMP_EQ: Op = OP_ICMP_EQ; break;
+        case CmpInst::ICMP_NE: Op = OP_ICMP_NE; break;
+        case CmpInst::ICMP_UGT: Op = OP_ICMP_UGT; break;
+        case CmpInst::ICMP_UGE: Op = OP_ICMP_UGE; break;
+        case CmpInst::ICMP_ULT: Op = OP_ICMP_ULT; break;
+        case CmpInst::ICMP_ULE: Op = OP_ICMP_ULE; break;
+        case CmpInst::ICMP_SGT: Op = OP_ICMP_SGT; break;
+        case CmpInst::ICMP_SGE: Op = OP_ICMP_SGE; break;
+        case CmpInst::ICMP_SLT: Op = OP_ICMP_SLT; break;
+        default: Op = OP_ICMP_SLE; break;
+        }
+        emit(Op, Dst, slotOf(Cmp.getOperand(0)), slotOf(Cmp.getOperand(1)), 0, bitsOf(OpTy));
+        return true;
+    }
+    case Instruction::FCmp: {
+        auto &Cmp = cast<FCmpInst>(I);
+        emit(OP_FCMP, Dst, slotOf(Cmp.getOperand(0)), slotOf(Cmp.getOperand(1)), 0,
+             Cmp.getOperand(0)->getType()->isFloatTy() ? 32 : 64, Cmp.getPredicate());
+        return true;
+    }
+    case Instruction::Select:
+        if (!I.getOperand(0)->getType()->isIntegerTy(1))
+            return fail("向量 select");
+        emit(OP_SELECT, Dst, slotOf(I.getOperand(0)), slotOf(I.getOperand(1)),
+             slotOf(I.getOperand(2)));
+        return true;
+    case Instruction::Load: {
+        auto &LI = cast<LoadInst>(I);
+        if (LI.isAtomic())
+            return fail("原子 load");
+        unsigned Size = DL.getTypeStoreSize(LI.getType());
+        MOp Op = Size == 1 ? OP_LOAD8 : Size == 2 ? OP_LOAD16 : Size == 4 ? OP_LOAD32 : OP_LOAD64;
+        if (Size != 1 && Size != 2 && Size != 4 && Size != 8)
+            return fail("不支持的 load 大小");
+        if (!fuseGEPLoad(LI))
+            emit(Op, Dst, slotOf(LI.getPointerOperand()));
+        // i1 这类窄整数在内存里占一个字节，读出来要截掉多余的位
+        if (LI.getType()->isIntegerTy() && LI.getType()->getIntegerBitWidth() < Size * 8)
+            emit(OP_MASK, Dst, Dst, 0, maskFor(LI.getType()->getIntegerBitWidth()));
+        return true;
+    }
+    case Instruction::Store: {
+        auto &SI = cast<StoreInst>(I);
+        if (SI.isAtomic())
+            return fail("原子 store");
+        Type *Ty = SI.getValueOperand()->getType();
+        if (!MBytecodeEngine::isSlotType(Ty))
+            return fail("不支持的 store 类型");
+        unsigned Size = DL.getTypeStoreSize(Ty);
+        MOp Op = Size == 1 ? OP_STORE8 : Size == 2 ? OP_STORE16 : Size == 4 ? OP_STORE32 : OP_STORE64;
+        if (Size != 1 && Size != 2 && Size != 4 && Size != 8)
+            return fail("不支持的 store 大小");
+        if (!fuseAddMem(SI))
+            emit(Op, 0, slotOf(SI.getValueOperand()), slotOf(SI.getPointerOperand()));
+        return true;
+    }
+    case Instruction::Alloca: {
+        auto &AI = cast<AllocaInst>(I);
+        uint64_t Size = DL.getTypeAllocSize(AI.getAllocatedType()).getFixedSize();
+        unsigned AlignLog2 = Log2(AI.getAlign());
+        if (auto *Count = dyn_cast<ConstantInt>(AI.getArraySize())) {
+            emit(OP_ALLOCA, Dst, 0, 0, Size * Count->getZExtValue(), 64, AlignLog2);
+            return true;
+        }
+        emit(OP_ALLOCA_DYN, Dst, slotOf(AI.getArraySize()), 0, Size, 64, AlignLog2);
+        return true;
+    }
+    case Instruction::GetElementPtr:
+        return lowerGEP(cast<GetElementPtrInst>(I));
+    case Instruction::Call:
+        return lowerCall(cast<CallInst>(I));
+    case Instruction::Ret:
+        if (I.getNumOperands() == 0)
+            emit(OP_RET_VOID);
+        else
+            emit(OP_RET, 0, slotOf(I.getOperand(0)));
+        return true;
+    case Instruction::Br:
+    case Instruction::Switch:
+        return lowerBranch(I);
+    case Instruction::Unreachable:
+        emit(OP_UNREACHABLE);
+        return true;
+    default:
+        return fail("不支持的指令 " + Twine(I.getOpcodeName()));
+    }
+}
+
+bool MLowering::lowerBinary(BinaryOperator &BO) {
+    uint32_t Dst = Slots[&BO];
+    uint32_t A = slotOf(BO.getOperand(0));
+    uint32_t B = slotOf(BO.getOperand(1));
+    Type *Ty = BO.getType();
+    if (Ty->isFloatTy() || Ty->isDoubleTy()) {
+        bool IsFloat = Ty->isFloatTy();
+        MOp Op;
+        switch (BO.getOpcode()) {
+        case Instruction::FAdd: Op = IsFloat ? OP_FADD_F : OP_FADD_D; break;
+        case Instruction::FSub: Op = IsFloat ? OP_FSUB_F : OP_FSUB_D; break;
+        case Instruction::FMul: Op = IsFloat ? OP_FMUL_F : OP_FMUL_D; break;
+        case Instruction::FDiv: Op = IsFloat ? OP_FDIV_F : OP_FDIV_D; break;
+        case Instruction::FRem: Op = IsFloat ? OP_FREM_F : OP_FREM_D; break;
+        default: return fail("不支持的浮点运算");
+        }
+        emit(Op, Dst, A, B);
+        return true;
+    }
+
+    unsigned Bits = Ty->getIntegerBitWidth();
+    MOp Op;
+    switch (BO.getOpcode()) {
+    case Instruction::Add: Op = OP_ADD; break;
+    case Instruction::Sub: Op = OP_SUB; break;
+    case Instruction::Mul: Op = OP_MUL; break;
+    case Instruction::UDiv: Op = OP_UDIV; break;
+    case Instruction::SDiv: Op = OP_SDIV; break;
+    case Instruction::URem: Op = OP_UREM; break;
+    case Instruction::SRem: Op = OP_SREM; break;
+    case Instruction::Shl: Op = OP_SHL; break;
+    case Instruction::LShr: Op = OP_LSHR; break;
+    case Instruction::AShr: Op = OP_ASHR; break;
+    case Instruction::And: Op = OP_AND; break;
+    case Instruction::Or: Op = OP_OR; break;
+    case Instruction::Xor: Op = OP_XOR; break;
+    default: return fail("不支持的整数运算");
+    }
+    emit(Op, Dst, A, B, maskFor(Bits), Bits);
+    return true;
+}
+
+bool MLowering::lowerCast(CastInst &CI) {
+    uint32_t Dst = Slots[&CI];
+    uint32_t Src = slotOf(CI.getOperand(0));
+    Type *SrcTy = CI.getSrcTy();
+    Type *DstTy = CI.getDestTy();
+    if (!MBytecodeEngine::isSlotType(SrcTy))
+        return fail("不支持的 cast 源类型");
+
+    switch (CI.getOpcode()) {
+    case Instruction::Trunc:
+        emit(OP_MASK, Dst, Src, 0, maskFor(bitsOf(DstTy)));
+        return true;
+    case Instruction::ZExt:
+    case Instruction::IntToPtr:
+        if (Dst != Src)
+            emit(OP_MOV, Dst, Src);
+        return true;
+    case Instruction::PtrToInt:
+        if (Dst != Src)
+            emit(OP_MASK, Dst, Src, 0, maskFor(bitsOf(DstTy)));
+        return true;
+    case Instruction::SExt:
+        emit(OP_SEXT, Dst, Src, 0, maskFor(bitsOf(DstTy)), bitsOf(SrcTy));
+        return true;
+    case Instruction::FPTrunc:
+        emit(OP_FPTRUNC, Dst, Src);
+        return true;
+    case Instruction::FPExt:
+        emit(OP_FPEXT, Dst, Src);
+        return true;
+    case Instruction::FPToUI:
+        emit(SrcTy->isFloatTy() ? OP_FPTOUI_F : OP_FPTOUI_D, Dst, Src, 0, maskFor(bitsOf(DstTy)));
+        return true;
+    case Instruction::FPToSI:
+        emit(SrcTy->isFloatTy() ? OP_FPTOSI_F : OP_FPTOSI_D, Dst, Src, 0, maskFor(bitsOf(DstTy)));
+        return true;
+    case Instruction::UIToFP:
+        emit(DstTy->isFloatTy() ? OP_UITOFP_F : OP_UITOFP_D, Dst, Src);
+        return true;
+    case Instruction::SIToFP:
+        emit(DstTy->isFloatTy() ? OP_SITOFP_F : OP_SITOFP_D, Dst, Src, 0, 0, bitsOf(SrcTy));
+        return true;
+    case Instruction::BitCast:
+        // 指针之间在编号时已经复用了槽；i32 和 float 之间只保留低 32 位
+        if (Dst == Src)
+            return true;
+        if (DL.getTypeSizeInBits(DstTy) == 32)
+            emit(OP_MASK, Dst, Src, 0, maskFor(32));
+        else
+            emit(OP_MOV, Dst, Src);
+        return true;
+    default:
+        return fail("不支持的 cast");
+    }
+}
+
+// GEP 拆成常量偏移和若干“变量下标 * 元素大小”
+bool MLowering::lowerGEP(GetElementPtrInst &GEP) {
+    uint32_t Dst = Slots[&GEP];
+    uint32_t Base = slotOf(GEP.getPointerOperand());
+    uint32_t Cur = Base;
+    int64_t Offset = 0;
+    for (gep_type_iterator GTI = gep_type_begin(GEP), E = gep_type_end(GEP); GTI != E; ++GTI) {
+        Value *Idx = GTI.getOperand();
+        if (!Idx->getType()->isIntegerTy() || Idx->getType()->getIntegerBitWidth() > 64)
+            return fail("不支持的 GEP 下标");
+        if (StructType *STy = GTI.getStructTypeOrNull()) {
+            unsigned Field = cast<ConstantInt>(Idx)->getZExtValue();
+            Offset += DL.getStructLayout(STy)->getElementOffset(Field);
+            continue;
+        }
+        int64_t Size = DL.getTypeAllocSize(GTI.getIndexedType()).getFixedSize();
+        if (auto *CI = dyn_cast<ConstantInt>(Idx)) {
+            Offset += CI->getSExtValue() * Size;
+            continue;
+        }
+        emit(OP_GEP_IDX, Dst, Cur, slotOf(Idx), Size, Idx->getType()->getIntegerBitWidth());
+        Cur = Dst;
+    }
+    if (Offset != 0 || Cur == Base)
+        emit(OP_GEP_CONST, Dst, Cur, 0, Offset);
+    return true;
+}
+
+bool MLowering::lowerCall(CallInst &CI) {
+    if (CI.isInlineAsm())
+        return fail("内联汇编");
+
+    if (auto *II = dyn_cast<IntrinsicInst>(&CI)) {
+        switch (II->getIntrinsicID()) {
+        case Intrinsic::dbg_declare:
+        case Intrinsic::dbg_value:
+        case Intrinsic::dbg_label:
+        case Intrinsic::lifetime_start:
+        case Intrinsic::lifetime_end:
+        case Intrinsic::assume:
+        case Intrinsic::donothing:
+        case Intrinsic::experimental_noalias_scope_decl:
+            return true;
+        case Intrinsic::memcpy:
+        case Intrinsic::memmove:
+            emit(II->getIntrinsicID() == Intrinsic::memcpy ? OP_MEMCPY : OP_MEMMOVE, 0,
+                 slotOf(II->getArgOperand(0)), slotOf(II->getArgOperand(1)),
+                 slotOf(II->getArgOperand(2)));
+            return true;
+        case Intrinsic::memset:
+            emit(OP_MEMSET, 0, slotOf(II->getArgOperand(0)), slotOf(II->getArgOperand(1)),
+                 slotOf(II->getArgOperand(2)));
+            return true;
+        default:
+            // 有 thunk 的 intrinsic 当普通外部调用
+            if (!mFindExternThunk(*II->getCalledFunction()))
+                return fail("不支持的 intrinsic " + II->getCalledFunction()->getName());
+            break;
+        }
+    }
+
+    MCallSite CS;
+    CS.Call = &CI;
+    CS.Callee = CI.getCalledFunction();
+    CS.CalleeSlot = CS.Callee ? M_NO_SLOT : slotOf(CI.getCalledOperand());
+    CS.Resolved = nullptr;
+    CS.Thunk = nullptr;
+    CS.RetTy = CI.getType();
+    if (!CS.RetTy->isVoidTy() && !MBytecodeEngine::isSlotType(CS.RetTy))
+        return fail("不支持的返回类型");
+    for (Value *Arg : CI.args()) {
+        if (!MBytecodeEngine::isSlotType(Arg->getType()))
+            return fail("不支持的实参类型");
+        CS.Args.push_back(slotOf(Arg));
+        CS.ArgTypes.push_back(Arg->getType());
+    }
+    BF->Calls.push_back(std::move(CS));
+    emit(OP_CALL, CI.getType()->isVoidTy() ? M_NO_SLOT : Slots[&CI], 0, 0, BF->Calls.size() - 1);
+    return true;
+}
+
+bool MLowering::lowerBranch(Instruction &I) {
+    BasicBlock *BB = I.getParent();
+    if (auto *BI = dyn_cast<BranchInst>(&I)) {
+        if (BI->isUnconditional()) {
+            // 只有一个后继，PHI 赋值直接放在块尾
+            BasicBlock *Succ = BI->getSuccessor(0);
+            emitPhiMoves(BB, Succ);
+            if (Backedges.count({BB, Succ}))
+                Fixups.push_back({emit(OP_JMP_BACK), FixImm, edgeTo(BB, Succ, false)});
+            else if (Succ != NextBB)
+                Fixups.push_back({emit(OP_JMP), FixImm, edgeTo(BB, Succ, false)});
+            return true;
+        }
+        if (fuseCmpBranch(*BI))
+            return true;
+        uint32_t Inst = emit(OP_BR, 0, slotOf(BI->getCondition()));
+        Fixups.push_back({Inst, FixImm, edgeTo(BB, BI->getSuccessor(0), true)});
+        Fixups.push_back({Inst, FixB, edgeTo(BB, BI->getSuccessor(1), true)});
+        return true;
+    }
+
+    auto &SI = cast<SwitchInst>(I);
+    if (SI.getCondition()->getType()->getIntegerBitWidth() > 64)
+        return fail("switch 条件超过 64 位");
+    MSwitchTable Table;
+    Table.Default = 0;
+    uint32_t TableIdx = BF->Switches.size();
+    for (auto &Case : SI.cases()) {
+        SwitchFixups.push_back({TableIdx, (int32_t)Table.Cases.size(),
+                                edgeTo(BB, Case.getCaseSuccessor(), true)});
+        Table.Cases.push_back({Case.getCaseValue()->getZExtValue(), 0});
+    }
+    SwitchFixups.push_back({TableIdx, -1, edgeTo(BB, SI.getDefaultDest(), true)});
+    BF->Switches.push_back(std::move(Table));
+    emit(OP_SWITCH, 0, slotOf(SI.getCondition()), 0, TableIdx);
+    return true;
+}
+
+// 超级指令。只合并同一个块里紧挨着的指令，而且被合并掉的结果只有下一条指令在用，
+// 所以不用再写它的槽，块中间也不会有跳转目标。合并就是把刚生成的字节码原地改写
+// I 是紧挨在前面的指令，降级成了末尾的 N 条字节码时返回第一条
+MInst *MLowering::loweredAtEnd(Instruction *I, unsigned N) {
+    if (!I || !I->hasOneUse() || BF->Code.size() < N)
+        return nullptr;
+    auto It = InstPC.find(I);
+    if (It == InstPC.end() || It->second != BF->Code.size() - N)
+        return nullptr;
+    return &BF->Code[It->second];
+}
+
+// icmp + br
+bool MLowering::fuseCmpBranch(BranchInst &BI) {
+    auto *Cmp = dyn_cast<ICmpInst>(BI.getCondition());
+    if (!Cmp || Cmp != BI.getPrevNode())
+        return false;
+    MInst *Inst = loweredAtEnd(Cmp, 1);
+    if (!Inst || Inst->Op < OP_ICMP_EQ || Inst->Op > OP_ICMP_SLE)
+        return false;
+    BasicBlock *BB = BI.getParent();
+    Inst->Op = OP_BR_EQ + (Inst->Op - OP_ICMP_EQ);
+    uint32_t Idx = Inst - BF->Code.data();
+    Fixups.push_back({Idx, FixImm, edgeTo(BB, BI.getSuccessor(0), true)});
+    Fixups.push_back({Idx, FixDst, edgeTo(BB, BI.getSuccessor(1), true)});
+    ++NumFused;
+    return true;
+}
+
+// GEP + load，GEP 只生成了一条字节码时才合并
+bool MLowering::fuseGEPLoad(LoadInst &LI) {
+    auto *GEP = dyn_cast<GetElementPtrInst>(LI.getPointerOperand());
+    if (!GEP || GEP != LI.getPrevNode())
+        return false;
+    MInst *Inst = loweredAtEnd(GEP, 1);
+    if (!Inst || (Inst->Op != OP_GEP_CONST && Inst->Op != OP_GEP_IDX))
+        return false;
+    unsigned Size = DL.getTypeStoreSize(LI.getType());
+    unsigned Width = Size == 1 ? 0 : Size == 2 ? 1 : Size == 4 ? 2 : 3;
+    Inst->Op = (Inst->Op == OP_GEP_CONST ? OP_LOAD8_OFF : OP_LOAD8_IDX) + Width;
+    Inst->Dst = Slots[&LI];
+    ++NumFused;
+    return true;
+}
+
+// load p; add; store p，加数可以在任意一边
+bool MLowering::fuseAddMem(StoreInst &SI) {
+    auto *Add = dyn_cast<BinaryOperator>(SI.getValueOperand());
+    if (!Add || Add->getOpcode() != Instruction::Add || Add != SI.getPrevNode())
+        return false;
+    // add 是块里的第一条指令时前面没有指令，比如 load 在循环头、add 和 store 在循环体
+    auto *Load = dyn_cast_or_null<LoadInst>(Add->getPrevNode());
+    if (!Load || Load->getPointerOperand() != SI.getPointerOperand() ||
+        (Add->getOperand(0) != Load) == (Add->getOperand(1) != Load))
+        return false;
+    MInst *Inst = loweredAtEnd(Load, 2);
+    if (!Inst || !loweredAtEnd(Add, 1) || (Inst->Op != OP_LOAD32 && Inst->Op != OP_LOAD64))
+        return false;
+    Value *Addend = Add->getOperand(0) == Load ? Add->getOperand(1) : Add->getOperand(0);
+    Inst->Op = Inst->Op == OP_LOAD32 ? OP_ADD_MEM32 : OP_ADD_MEM64;
+    Inst->B = slotOf(Addend);
+    BF->Code.pop_back();
+    ++NumFused;
+    return true;
+}
+
+// 帧分配
+MFrameArena::~MFrameArena() {
+    for (Chunk &C : Chunks)
+        free(C.Begin);
+}
+
+void *MFrameArena::allocateSlow(size_t Size, size_t Align) {
+    // 当前块之后的块都是空闲的，下一块不够大就换一块更大的
+    unsigned Next = Ptr ? Cur + 1 : Cur;
+    size_t Need = Size + Align;
+    if (Next < Chunks.size() && (size_t)(Chunks[Next].End - Chunks[Next].Begin) < Need) {
+        free(Chunks[Next].Begin);
+        Chunks.erase(Chunks.begin() + Next);
+    }
+    if (Next >= Chunks.size() || (size_t)(Chunks[Next].End - Chunks[Next].Begin) < Need) {
+        size_t Bytes = std::max<size_t>(Need, 64 * 1024);
+        char *Begin = (char *)safe_malloc(Bytes);
+        Chunks.insert(Chunks.begin() + Next, {Begin, Begin + Bytes});
+    }
+    Cur = Next;
+    Ptr = Chunks[Cur].Begin;
+    End = Chunks[Cur].End;
+    return allocate(Size, Align);
+}
+
+// 执行
+MBytecodeEngine::MBytecodeEngine(ExecutionEngine &EE, MRuntime &RT)
+    : EE(EE), RT(RT) {}
+
+MBytecodeFunction *MBytecodeEngine::getOrLower(Function *F) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = Lowered.find(F);
+    if (It != Lowered.end())
+        return It->second.get();
+    mMaterialize(F);
+    std::unique_ptr<MBytecodeFunction> BF = Cache ? Cache->load(*F, RT) : nullptr;
+    if (!BF) {
+        BF = MLowering(EE, RT, *F).run();
+        if (BF && Cache)
+            Cache->store(*BF);
+    }
+    MBytecodeFunction *Result = BF.get();
+    Lowered[F] = std::move(BF);
+    return Result;
+}
+
+GenericValue MBytecodeEngine::runFunction(MBytecodeFunction &BF,
+                                          ArrayRef<GenericValue> ArgValues) {
+    Function *F = BF.F;
+    SmallVector<MSlot, 8> Args;
+    for (Argument &Arg : F->args())
+        Args.push_back(fromGeneric(ArgValues[Arg.getArgNo()], Arg.getType()));
+    MSlot Ret = call(BF, Args.data());
+    return toGeneric(Ret, F->getReturnType());
+}
+
+// 调用点第一次执行，或者间接调用时走这里
+MSlot MBytecodeEngine::callSlow(MCallSite &CS, const MSlot *R, const MSlot *Args) {
+    Function *Callee = CS.Callee ? CS.Callee : (Function *)R[CS.CalleeSlot].P;
+    if (!Callee->isDeclaration()) {
+        if (MBytecodeFunction *BF = getOrLower(Callee)) {
+            if (CS.Callee)
+                CS.Resolved.set(BF);
+            return call(*BF, Args);
+        }
+    }
+    // 解释执行的代码创建线程：入口函数也用字节码跑，新线程有自己的帧
+    if (Callee->isDeclaration() && Callee->getName() == "pthread_create")
+        return spawnThread(Args);
+    // 常用的外部函数直接调本地 thunk，以后这个调用点都不再查
+    if (MExternThunk Thunk = mFindExternThunk(*Callee, CS.ArgTypes)) {
+        if (CS.Callee)
+            CS.Thunk.set(Thunk);
+        return Thunk(Args, CS.ArgTypes);
+    }
+    // 外部函数或者不能降级的函数，还是走 GenericValue
+    std::vector<GenericValue> GVArgs;
+    for (unsigned i = 0; i < CS.Args.size(); i++)
+        GVArgs.push_back(toGeneric(Args[i], CS.ArgTypes[i]));
+    return fromGeneric(RT.callExternal(Callee, GVArgs), CS.RetTy);
+}
+
+// 取实参再调用。computed goto 跳出作用域时不会调用析构函数，有析构的局部变量都放在这里
+MSlot MBytecodeEngine::callOp(MCallSite &CS, const MSlot *R) {
+    SmallVector<MSlot, 8> Args;
+    for (uint32_t Slot : CS.Args)
+        Args.push_back(R[Slot]);
+    if (MBytecodeFunction *Resolved = CS.Resolved.get())
+        return call(*Resolved, Args.data());
+    if (MExternThunk Thunk = CS.Thunk.get())
+        return Thunk(Args.data(), CS.ArgTypes);
+    return callSlow(CS, R, Args.data());
+}
+
+namespace {
+struct MThreadStart {
+    MBytecodeEngine *Engine;
+    MBytecodeFunction *BF;
+    MSlot Arg;
+};
+} // end namespace
+
+MSlot MBytecodeEngine::spawnThread(const MSlot *Args) {
+    auto *Start = (Function *)Args[2].P;
+    MBytecodeFunction *BF = Start ? getOrLower(Start) : nullptr;
+    if (!BF || BF->NumArgs != 1)
+        report_fatal_error("mbytecode: pthread_create 的入口函数不能降级成字节码");
+    auto *Ctx = new MThreadStart{this, BF, Args[3]};
+    int Err = pthread_create((pthread_t *)Args[0].P, (const pthread_attr_t *)Args[1].P, threadEntry, Ctx);
+    if (Err)
+        delete Ctx;
+    MSlot Ret;
+    Ret.I = (uint32_t)Err;
+    return Ret;
+}
+
+void *MBytecodeEngine::threadEntry(void *Start) {
+    std::unique_ptr<MThreadStart> Ctx((MThreadStart *)Start);
+    return Ctx->Engine->call(*Ctx->BF, &Ctx->Arg).P;
+}
+
+// 每个线程一个，帧的分配和释放总是在同一个线程里
+static thread_local MFrameArena Arena;
+
+#if M_THREADED_DISPATCH
+#define M_DISPATCH() goto *PC->Target
+#define M_OP(Name) L_##Name:
+#else
+#define M_DISPATCH() goto Dispatch
+#define M_OP(Name) case OP_##Name:
+#endif
+#define M_NEXT() do { ++PC; M_DISPATCH(); } while (0)
+#define M_JUMP(To) do { PC = Code + (To); M_DISPATCH(); } while (0)
+
+MSlot MBytecodeEngine::call(MBytecodeFunction &BF, const MSlot *Args) {
+#if M_THREADED_DISPATCH
+    static const void *const Labels[] = {
+#define M_LABEL(Name) &&L_##Name,
+        M_BYTECODE_OPS(M_LABEL)
+#undef M_LABEL
+    };
+    if (!BF.Threaded.get()) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        if (!BF.Threaded.get()) {
+            for (MInst &Inst : BF.Code)
+                Inst.Target = Labels[Inst.Op];
+            BF.Threaded.set(true);
+        }
+    }
+#endif
+
+    // 分层执行：热了就换成本地代码
+    if (Tier && !BF.TierDone.get()) {
+        uint64_t Hotness = BF.Hotness.get() + 1;
+        BF.Hotness.set(Hotness);
+        if (Hotness >= Tier->threshold()) {
+            BF.Native.set(Tier->compile(BF.F));
+            BF.TierDone.set(true);
+        }
+    }
+    if (MNativeFn Native = BF.Native.get()) {
+        MSlot Ret;
+        Ret.I = 0;
+        Native(Args, &Ret);
+        return Ret;
+    }
+
+    // 帧和 alloca 都从 Arena 里分配，返回时一起退回
+    MFrameArena::Mark Mark = Arena.mark();
+    MSlot *R = (MSlot *)Arena.allocate(BF.Frame.size() * sizeof(MSlot), alignof(MSlot));
+    std::copy(BF.Frame.begin(), BF.Frame.end(), R);
+    std::copy(Args, Args + BF.NumArgs, R);
+    const MInst *Code = BF.Code.data();
+    const MInst *PC = Code;
+    MSlot Ret;
+    Ret.I = 0;
+
+#if M_THREADED_DISPATCH
+    M_DISPATCH();
+#else
+Dispatch:
+    switch (PC->Op) {
+#endif
+    M_OP(MOV) R[PC->Dst] = R[PC->A]; M_NEXT();
+    M_OP(MASK) R[PC->Dst].I = R[PC->A].I & PC->Imm; M_NEXT();
+
+    M_OP(ADD) R[PC->Dst].I = (R[PC->A].I + R[PC->B].I) & PC->Imm; M_NEXT();
+    M_OP(SUB) R[PC->Dst].I = (R[PC->A].I - R[PC->B].I) & PC->Imm; M_NEXT();
+    M_OP(MUL) R[PC->Dst].I = (R[PC->A].I * R[PC->B].I) & PC->Imm; M_NEXT();
+    M_OP(UDIV) R[PC->Dst].I = R[PC->A].I / R[PC->B].I; M_NEXT();
+    M_OP(SDIV)
+        R[PC->Dst].I = (uint64_t)(sext(R[PC->A].I, PC->Bits) / sext(R[PC->B].I, PC->Bits)) & PC->Imm;
+        M_NEXT();
+    M_OP(UREM) R[PC->Dst].I = R[PC->A].I % R[PC->B].I; M_NEXT();
+    M_OP(SREM)
+        R[PC->Dst].I = (uint64_t)(sext(R[PC->A].I, PC->Bits) % sext(R[PC->B].I, PC->Bits)) & PC->Imm;
+        M_NEXT();
+    M_OP(SHL) R[PC->Dst].I = (R[PC->A].I << (R[PC->B].I & 63)) & PC->Imm; M_NEXT();
+    M_OP(LSHR) R[PC->Dst].I = R[PC->A].I >> (R[PC->B].I & 63); M_NEXT();
+    M_OP(ASHR)
+        R[PC->Dst].I = (uint64_t)(sext(R[PC->A].I, PC->Bits) >> (R[PC->B].I & 63)) & PC->Imm;
+        M_NEXT();
+    M_OP(AND) R[PC->Dst].I = R[PC->A].I & R[PC->B].I; M_NEXT();
+    M_OP(OR) R[PC->Dst].I = R[PC->A].I | R[PC->B].I; M_NEXT();
+    M_OP(XOR) R[PC->Dst].I = R[PC->A].I ^ R[PC->B].I; M_NEXT();
+
+    M_OP(FADD_F) R[PC->Dst].F = R[PC->A].F + R[PC->B].F; M_NEXT();
+    M_OP(FSUB_F) R[PC->Dst].F = R[PC->A].F - R[PC->B].F; M_NEXT();
+    M_OP(FMUL_F) R[PC->Dst].F = R[PC->A].F * R[PC->B].F; M_NEXT();
+    M_OP(FDIV_F) R[PC->Dst].F = R[PC->A].F / R[PC->B].F; M_NEXT();
+    M_OP(FREM_F) R[PC->Dst].F = fmodf(R[PC->A].F, R[PC->B].F); M_NEXT();
+    M_OP(FNEG_F) R[PC->Dst].F = -R[PC->A].F; M_NEXT();
+    M_OP(FADD_D) R[PC->Dst].D = R[PC->A].D + R[PC->B].D; M_NEXT();
+    M_OP(FSUB_D) R[PC->Dst].D = R[PC->A].D - R[PC->B].D; M_NEXT();
+    M_OP(FMUL_D) R[PC->Dst].D = R[PC->A].D * R[PC->B].D; M_NEXT();
+    M_OP(FDIV_D) R[PC->Dst].D = R[PC->A].D / R[PC->B].D; M_NEXT();
+    M_OP(FREM_D) R[PC->Dst].D = fmod(R[PC->A].D, R[PC->B].D); M_NEXT();
+    M_OP(FNEG_D) R[PC->Dst].D = -R[PC->A].D; M_NEXT();
+
+    M_OP(ICMP_EQ) R[PC->Dst].I = R[PC->A].I == R[PC->B].I; M_NEXT();
+    M_OP(ICMP_NE) R[PC->Dst].I = R[PC->A].I != R[PC->B].I; M_NEXT();
+    M_OP(ICMP_UGT) R[PC->Dst].I = R[PC->A].I > R[PC->B].I; M_NEXT();
+    M_OP(ICMP_UGE) R[PC->Dst].I = R[PC->A].I >= R[PC->B].I; M_NEXT();
+    M_OP(ICMP_ULT) R[PC->Dst].I = R[PC->A].I < R[PC->B].I; M_NEXT();
+    M_OP(ICMP_ULE) R[PC->Dst].I = R[PC->A].I <= R[PC->B].I; M_NEXT();
+    M_OP(ICMP_SGT) R[PC->Dst].I = sext(R[PC->A].I, PC->Bits) > sext(R[PC->B].I, PC->Bits); M_NEXT();
+    M_OP(ICMP_SGE) R[PC->Dst].I = sext(R[PC->A].I, PC->Bits) >= sext(R[PC->B].I, PC->Bits); M_NEXT();
+    M_OP(ICMP_SLT) R[PC->Dst].I = sext(R[PC->A].I, PC->Bits) < sext(R[PC->B].I, PC->Bits); M_NEXT();
+    M_OP(ICMP_SLE) R[PC->Dst].I = sext(R[PC->A].I, PC->Bits) <= sext(R[PC->B].I, PC->Bits); M_NEXT();
+    M_OP(FCMP)
+        if (PC->Bits == 32)
+            R[PC->Dst].I = fcmp(PC->Aux, R[PC->A].F, R[PC->B].F);
+        else
+            R[PC->Dst].I = fcmp(PC->Aux, R[PC->A].D, R[PC->B].D);
+        M_NEXT();
+    M_OP(SELECT) R[PC->Dst] = R[PC->A].I ? R[PC->B] : R[PC->Imm]; M_NEXT();
+
+    M_OP(SEXT) R[PC->Dst].I = (uint64_t)sext(R[PC->A].I, PC->Bits) & PC->Imm; M_NEXT();
+    M_OP(FPTRUNC) R[PC->Dst].F = (float)R[PC->A].D; M_NEXT();
+    M_OP(FPEXT) R[PC->Dst].D = (double)R[PC->A].F; M_NEXT();
+    M_OP(FPTOUI_F) R[PC->Dst].I = (uint64_t)R[PC->A].F & PC->Imm; M_NEXT();
+    M_OP(FPTOUI_D) R[PC->Dst].I = (uint64_t)R[PC->A].D & PC->Imm; M_NEXT();
+    M_OP(FPTOSI_F) R[PC->Dst].I = (uint64_t)(int64_t)R[PC->A].F & PC->Imm; M_NEXT();
+    M_OP(FPTOSI_D) R[PC->Dst].I = (uint64_t)(int64_t)R[PC->A].D & PC->Imm; M_NEXT();
+    M_OP(UITOFP_F) R[PC->Dst].F = (float)R[PC->A].I; M_NEXT();
+    M_OP(UITOFP_D) R[PC->Dst].D = (double)R[PC->A].I; M_NEXT();
+    M_OP(SITOFP_F) R[PC->Dst].F = (float)sext(R[PC->A].I, PC->Bits); M_NEXT();
+    M_OP(SITOFP_D) R[PC->Dst].D = (double)sext(R[PC->A].I, PC->Bits); M_NEXT();
+
+    M_OP(LOAD8) R[PC->Dst].I = loadAs<uint8_t>(R[PC->A].P); M_NEXT();
+    M_OP(LOAD16) R[PC->Dst].I = loadAs<uint16_t>(R[PC->A].P); M_NEXT();
+    M_OP(LOAD32) R[PC->Dst].I = loadAs<uint32_t>(R[PC->A].P); M_NEXT();
+    M_OP(LOAD64) R[PC->Dst].I = loadAs<uint64_t>(R[PC->A].P); M_NEXT();
+    M_OP(STORE8) storeAs<uint8_t>(R[PC->B].P, R[PC->A].I); M_NEXT();
+    M_OP(STORE16) storeAs<uint16_t>(R[PC->B].P, R[PC->A].I); M_NEXT();
+    M_OP(STORE32) storeAs<uint32_t>(R[PC->B].P, R[PC->A].I); M_NEXT();
+    M_OP(STORE64) storeAs<uint64_t>(R[PC->B].P, R[PC->A].I); M_NEXT();
+
+    M_OP(ALLOCA)
+        R[PC->Dst].P = Arena.allocate(PC->Imm ? PC->Imm : 1, (size_t)1 << PC->Aux);
+        M_NEXT();
+    M_OP(ALLOCA_DYN) {
+        uint64_t Size = R[PC->A].I * PC->Imm;
+        R[PC->Dst].P = Arena.allocate(Size ? Size : 1, (size_t)1 << PC->Aux);
+        M_NEXT();
+    }
+    M_OP(GEP_CONST) R[PC->Dst].I = R[PC->A].I + PC->Imm; M_NEXT();
+    M_OP(GEP_IDX) R[PC->Dst].I = R[PC->A].I + sext(R[PC->B].I, PC->Bits) * PC->Imm; M_NEXT();
+
+    M_OP(MEMCPY) memcpy(R[PC->A].P, R[PC->B].P, R[PC->Imm].I); M_NEXT();
+    M_OP(MEMMOVE) memmove(R[PC->A].P, R[PC->B].P, R[PC->Imm].I); M_NEXT();
+    M_OP(MEMSET) memset(R[PC->A].P, (int)(R[PC->B].I & 0xff), R[PC->Imm].I); M_NEXT();
+
+    M_OP(JMP) M_JUMP(PC->Imm);
+    M_OP(JMP_BACK) BF.Hotness.set(BF.Hotness.get() + 1); M_JUMP(PC->Imm);
+    M_OP(BR)
+        if (R[PC->A].I)
+            M_JUMP(PC->Imm);
+        M_JUMP(PC->B);
+    M_OP(SWITCH) {
+        const MSwitchTable &Table = BF.Switches[PC->Imm];
+        uint64_t V = R[PC->A].I;
+        for (auto &Case : Table.Cases)
+            if (Case.first == V)
+                M_JUMP(Case.second);
+        M_JUMP(Table.Default);
+    }
+    M_OP(CALL) {
+        MSlot V = callOp(BF.Calls[PC->Imm], R);
+        if (PC->Dst != M_NO_SLOT)
+            R[PC->Dst] = V;
+        M_NEXT();
+    }
+    // 超级指令
+#define M_BR_IF(Name, Cond) M_OP(Name) if (Cond) M_JUMP(PC->Imm); M_JUMP(PC->Dst);
+    M_BR_IF(BR_EQ, R[PC->A].I == R[PC->B].I)
+    M_BR_IF(BR_NE, R[PC->A].I != R[PC->B].I)
+    M_BR_IF(BR_UGT, R[PC->A].I > R[PC->B].I)
+    M_BR_IF(BR_UGE, R[PC->A].I >= R[PC->B].I)
+    M_BR_IF(BR_ULT, R[PC->A].I < R[PC->B].I)
+    M_BR_IF(BR_ULE, R[PC->A].I <= R[PC->B].I)
+    M_BR_IF(BR_SGT, sext(R[PC->A].I, PC->Bits) > sext(R[PC->B].I, PC->Bits))
+    M_BR_IF(BR_SGE, sext(R[PC->A].I, PC->Bits) >= sext(R[PC->B].I, PC->Bits))
+    M_BR_IF(BR_SLT, sext(R[PC->A].I, PC->Bits) < sext(R[PC->B].I, PC->Bits))
+    M_BR_IF(BR_SLE, sext(R[PC->A].I, PC->Bits) <= sext(R[PC->B].I, PC->Bits))
+#undef M_BR_IF
+#define M_OFF (R[PC->A].I + PC->Imm)
+#define M_IDX (R[PC->A].I + sext(R[PC->B].I, PC->Bits) * PC->Imm)
+    M_OP(LOAD8_OFF) R[PC->Dst].I = loadAs<uint8_t>((void *)M_OFF); M_NEXT();
+    M_OP(LOAD16_OFF) R[PC->Dst].I = loadAs<uint16_t>((void *)M_OFF); M_NEXT();
+    M_OP(LOAD32_OFF) R[PC->Dst].I = loadAs<uint32_t>((void *)M_OFF); M_NEXT();
+    M_OP(LOAD64_OFF) R[PC->Dst].I = loadAs<uint64_t>((void *)M_OFF); M_NEXT();
+    M_OP(LOAD8_IDX) R[PC->Dst].I = loadAs<uint8_t>((void *)M_IDX); M_NEXT();
+    M_OP(LOAD16_IDX) R[PC->Dst].I = loadAs<uint16_t>((void *)M_IDX); M_NEXT();
+    M_OP(LOAD32_IDX) R[PC->Dst].I = loadAs<uint32_t>((void *)M_IDX); M_NEXT();
+    M_OP(LOAD64_IDX) R[PC->Dst].I = loadAs<uint64_t>((void *)M_IDX); M_NEXT();
+#undef M_OFF
+#undef M_IDX
+    M_OP(ADD_MEM32)
+        storeAs<uint32_t>(R[PC->A].P, loadAs<uint32_t>(R[PC->A].P) + (uint32_t)R[PC->B].I);
+        M_NEXT();
+    M_OP(ADD_MEM64)
+        storeAs<uint64_t>(R[PC->A].P, loadAs<uint64_t>(R[PC->A].P) + R[PC->B].I);
+        M_NEXT();
+
+    M_OP(RET) Ret = R[PC->A]; goto Done;
+    M_OP(RET_VOID) goto Done;
+    M_OP(UNREACHABLE) report_fatal_error("mbytecode: 执行到了 unreachable");
+#if !M_THREADED_DISPATCH
+    default:
+        llvm_unreachable("未知的字节码");
+    }
+#endif
+
+Done:
+    Arena.release(Mark);
+    return Ret;
+}
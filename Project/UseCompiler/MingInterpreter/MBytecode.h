@@ -0,0 +1,254 @@
+#ifndef M_Bytecode_H
+#define M_Bytecode_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/GenericValue.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorHandling.h"
+
+/*
+寄存器字节码
+
+每个 llvm::Function 只降级一次，得到一段紧凑、预先解码好的字节码：
+1. 参数、指令结果、常量都编号成连续的槽（slot），执行时直接用下标访问帧数组，不再查 GenericValue 的 map。
+2. 常量在降级时就解析好，放进帧模板，调用时整体拷贝。
+3. PHI 节点在降级时变成边上的 MOV，关键边会单独生成一段跳板。
+4. GCC/Clang 下用 computed goto 做直接线程化分派，其他编译器退回 switch。
+
+只支持标量的整数（不超过 64 位）、float、double 和指针。用到向量、聚合值、异常、原子操作、变参的函数不降级，仍然走原来的 InstVisitor 解释。
+*/
+
+// 一个槽放一个值，整数总是零扩展到 64 位保存
+union MSlot {
+    uint64_t I;
+    float F;
+    double D;
+    void *P;
+};
+
+// 分层执行编译出来的本地代码入口，参数和返回值都按槽传
+typedef void (*MNativeFn)(const MSlot *Args, MSlot *Ret);
+// 执行时多个线程都可能回填的字段。写进去的值对所有线程都一样，用 acquire/release 读写就够了，
+// x86 上和普通读写一样快。可以拷贝，这样还能放进 std::vector
+template <typename T> class MShared {
+    public:
+    MShared(T Init = T()) : V(Init) {}
+    MShared(const MShared &Other) : V(Other.get()) {}
+    MShared &operator=(const MShared &Other) {
+        set(Other.get());
+        return *this;
+    }
+    T get() const { return V.load(std::memory_order_acquire); }
+    void set(T X) { V.store(X, std::memory_order_release); }
+
+    private:
+    std::atomic<T> V;
+};
+
+// 常用外部函数的本地 thunk，见 MExtern.h。ArgTypes 是实参的类型，变参函数靠它区分整数和浮点数
+typedef MSlot (*MExternThunk)(const MSlot *Args, llvm::ArrayRef<llvm::Type *> ArgTypes);
+class MTierJIT;
+class MBitcodeCache;
+
+// 懒加载的模块里函数体第一次用到时才从 bitcode 里读出来
+// BitcodeReader 不是线程安全的，多个线程同时用到新函数时要排队
+inline void mMaterialize(llvm::Function *F) {
+    static std::mutex Lock;
+    if (!F->isMaterializable())
+        return;
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (F->isMaterializable())
+        if (llvm::Error Err = F->materialize())
+            llvm::report_fatal_error(std::move(Err));
+}
+
+// 字节码操作码
+#define M_BYTECODE_OPS(X) \
+    X(MOV) X(MASK) \
+    X(ADD) X(SUB) X(MUL) X(UDIV) X(SDIV) X(UREM) X(SREM) \
+    X(SHL) X(LSHR) X(ASHR) X(AND) X(OR) X(XOR) \
+    X(FADD_F) X(FSUB_F) X(FMUL_F) X(FDIV_F) X(FREM_F) X(FNEG_F) \
+    X(FADD_D) X(FSUB_D) X(FMUL_D) X(FDIV_D) X(FREM_D) X(FNEG_D) \
+    X(ICMP_EQ) X(ICMP_NE) X(ICMP_UGT) X(ICMP_UGE) X(ICMP_ULT) X(ICMP_ULE) \
+    X(ICMP_SGT) X(ICMP_SGE) X(ICMP_SLT) X(ICMP_SLE) \
+    X(FCMP) X(SELECT) \
+    X(SEXT) X(FPTRUNC) X(FPEXT) \
+    X(FPTOUI_F) X(FPTOUI_D) X(FPTOSI_F) X(FPTOSI_D) \
+    X(UITOFP_F) X(UITOFP_D) X(SITOFP_F) X(SITOFP_D) \
+    X(LOAD8) X(LOAD16) X(LOAD32) X(LOAD64) \
+    X(STORE8) X(STORE16) X(STORE32) X(STORE64) \
+    X(ALLOCA) X(ALLOCA_DYN) X(GEP_CONST) X(GEP_IDX) \
+    X(MEMCPY) X(MEMMOVE) X(MEMSET) \
+    X(JMP) X(JMP_BACK) X(BR) X(SWITCH) X(CALL) X(RET) X(RET_VOID) X(UNREACHABLE) \
+    M_FUSED_OPS(X)
+
+// 超级指令：降级时把相邻的几条合成一条，少几次分派。顺序分别和 ICMP_*、LOAD* 一致
+// BR_*：icmp + br，Imm 是真分支，Dst 是假分支
+// LOAD*_OFF：GEP_CONST + load，LOAD*_IDX：GEP_IDX + load
+// ADD_MEM*：同一地址上的 load + add + store，插桩计数器就是这样
+#define M_FUSED_OPS(X) \
+    X(BR_EQ) X(BR_NE) X(BR_UGT) X(BR_UGE) X(BR_ULT) X(BR_ULE) \
+    X(BR_SGT) X(BR_SGE) X(BR_SLT) X(BR_SLE) \
+    X(LOAD8_OFF) X(LOAD16_OFF) X(LOAD32_OFF) X(LOAD64_OFF) \
+    X(LOAD8_IDX) X(LOAD16_IDX) X(LOAD32_IDX) X(LOAD64_IDX) \
+    X(ADD_MEM32) X(ADD_MEM64)
+
+enum MOp : uint16_t {
+#define M_ENUM_OP(Name) OP_##Name,
+    M_BYTECODE_OPS(M_ENUM_OP)
+#undef M_ENUM_OP
+    OP_COUNT
+};
+
+// 没有结果的指令用这个槽号
+const uint32_t M_NO_SLOT = ~0u;
+
+// 一条字节码指令，32 字节定长
+struct MInst {
+    const void *Target; // 直接线程化时是处理代码的标签地址
+    uint16_t Op;
+    uint8_t Bits;       // 需要符号扩展的操作记录源位宽
+    uint8_t Aux;        // FCMP 的谓词，ALLOCA 对齐的 log2
+    uint32_t Dst;
+    uint32_t A;
+    uint32_t B;
+    int64_t Imm;        // 结果掩码、常量偏移、跳转目标或第三个操作数
+};
+
+// 调用点，首次执行时解析被调函数并缓存
+struct MCallSite {
+    llvm::CallInst *Call;
+    llvm::Function *Callee;            // 间接调用时为空
+    uint32_t CalleeSlot;               // 间接调用时函数指针所在的槽
+    MShared<struct MBytecodeFunction *> Resolved;
+    MShared<MExternThunk> Thunk;       // 被调函数是有 thunk 的外部函数
+    llvm::Type *RetTy;
+    std::vector<uint32_t> Args;
+    std::vector<llvm::Type *> ArgTypes;
+};
+
+// switch 的跳转表
+struct MSwitchTable {
+    std::vector<std::pair<uint64_t, uint32_t>> Cases;
+    uint32_t Default;
+};
+
+// 降级后的函数
+struct MBytecodeFunction {
+    llvm::Function *F;
+    unsigned NumArgs;
+    std::vector<MSlot> Frame;           // 帧模板，常量已经填好
+    std::vector<MInst> Code;
+    std::vector<MCallSite> Calls;
+    std::vector<MSwitchTable> Switches;
+    // 帧模板里值取决于解释器内存地址的常量（全局变量、函数、常量表达式），缓存到磁盘时要重新解析
+    std::vector<std::pair<uint32_t, llvm::Constant *>> Relocs;
+    MShared<bool> Threaded = false;
+    // 分层执行：进入次数加回边次数。多线程时会丢几次计数，只是启发式的，不影响结果
+    MShared<uint64_t> Hotness = 0;
+    MShared<bool> TierDone = false;
+    MShared<MNativeFn> Native = nullptr;
+};
+
+// 帧和 alloca 的栈式分配器。调用总是后进先出地返回，返回时把栈顶退回进入时的位置就释放了整个帧，
+// 块用完也不还给系统，递归调用不再每次都 malloc/free
+class MFrameArena {
+    public:
+    struct Mark {
+        unsigned Chunk;
+        char *Ptr;
+    };
+
+    MFrameArena() = default;
+    MFrameArena(const MFrameArena &) = delete;
+    MFrameArena &operator=(const MFrameArena &) = delete;
+    ~MFrameArena();
+
+    void *allocate(size_t Size, size_t Align) {
+        char *P = (char *)(((uintptr_t)Ptr + Align - 1) & ~(uintptr_t)(Align - 1));
+        if (Ptr && P + Size <= End) {
+            Ptr = P + Size;
+            return P;
+        }
+        return allocateSlow(Size, Align);
+    }
+    Mark mark() const { return {Cur, Ptr}; }
+    void release(Mark M) {
+        Cur = M.Chunk;
+        Ptr = M.Ptr;
+        End = Ptr ? Chunks[Cur].End : nullptr;
+    }
+
+    private:
+    struct Chunk {
+        char *Begin;
+        char *End;
+    };
+    void *allocateSlow(size_t Size, size_t Align);
+
+    std::vector<Chunk> Chunks;
+    unsigned Cur = 0;
+    char *Ptr = nullptr;
+    char *End = nullptr;
+};
+
+// 字节码执行时需要解释器提供的服务，MInterpreter 实现
+class MRuntime {
+    public:
+    virtual ~MRuntime() {}
+    // 字节码处理不了的调用：外部函数，或者不能降级的函数
+    virtual llvm::GenericValue callExternal(llvm::Function *F,
+                                            llvm::ArrayRef<llvm::GenericValue> Args) = 0;
+    // 常量的值，全局变量要用解释器分配的内存
+    virtual llvm::GenericValue constantValue(const llvm::Constant *C) = 0;
+};
+
+// 线程安全：降级好的字节码所有线程共用，每个线程有自己的帧（线程局部的 MFrameArena），
+// 降级、分层编译和第一次解析调用点都加锁。回到解释器的调用由 MRuntime 负责串行化
+class MBytecodeEngine {
+    public:
+    // EE 提供数据布局，需要和解释器用同一个
+    MBytecodeEngine(llvm::ExecutionEngine &EE, MRuntime &RT);
+
+    // 打开分层执行，热函数换成本地代码
+    void setTier(MTierJIT *T) { Tier = T; }
+    // 降级结果先查磁盘缓存，新降级的函数也存进去
+    void setCache(MBitcodeCache *C) { Cache = C; }
+
+    // 取得函数的字节码，第一次会降级。不能降级返回 nullptr
+    MBytecodeFunction *getOrLower(llvm::Function *F);
+
+    llvm::GenericValue runFunction(MBytecodeFunction &BF,
+                                   llvm::ArrayRef<llvm::GenericValue> ArgValues);
+
+    // 能放进一个槽的类型
+    static bool isSlotType(llvm::Type *Ty);
+    static llvm::GenericValue toGeneric(MSlot S, llvm::Type *Ty);
+    static MSlot fromGeneric(const llvm::GenericValue &GV, llvm::Type *Ty);
+
+    private:
+    MSlot call(MBytecodeFunction &BF, const MSlot *Args);
+    MSlot callOp(MCallSite &CS, const MSlot *R);
+    MSlot callSlow(MCallSite &CS, const MSlot *R, const MSlot *Args);
+    MSlot spawnThread(const MSlot *Args);
+    static void *threadEntry(void *Start);
+
+    llvm::ExecutionEngine &EE;
+    MRuntime &RT;
+    MTierJIT *Tier = nullptr;
+    MBitcodeCache *Cache = nullptr;
+    std::mutex Lock;
+    // 值为空表示已经尝试过，不能降级
+    llvm::DenseMap<const llvm::Function *, std::unique_ptr<MBytecodeFunction>> Lowered;
+};
+
+#endif
@@ -0,0 +1,281 @@
+#include "MCache.h"
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+using namespace llvm;
+
+namespace {
+const uint32_t M_CACHE_MAGIC = 0x4343424d; // "MBCC"
+// MInst 的布局或者操作码变了都要改版本号
+const uint32_t M_CACHE_VERSION = 2;
+
+// 往缓冲区里追加定长整数和字符串
+class MWriter {
+    public:
+    explicit MWriter(std::string &Out) : Out(Out) {}
+    template <typename T> void put(T V) { Out.append((const char *)&V, sizeof(V)); }
+    void putString(StringRef S) {
+        put<uint32_t>(S.size());
+        Out.append(S.data(), S.size());
+    }
+    void putBytes(const void *P, size_t Size) { Out.append((const char *)P, Size); }
+
+    private:
+    std::string &Out;
+};
+
+// 读的时候检查越界，出错以后所有读取都返回失败
+class MReader {
+    public:
+    explicit MReader(StringRef In) : P(In.begin()), End(In.end()) {}
+    template <typename T> bool get(T &V) { return getBytes(&V, sizeof(V)); }
+    bool getString(StringRef &S) {
+        uint32_t Len;
+        if (!get(Len) || (size_t)(End - P) < Len)
+            return Ok = false;
+        S = StringRef(P, Len);
+        P += Len;
+        return true;
+    }
+    bool getBytes(void *Dst, size_t Size) {
+        if (!Ok || (size_t)(End - P) < Size)
+            return Ok = false;
+        memcpy(Dst, P, Size);
+        P += Size;
+        return true;
+    }
+    bool atEnd() const { return P == End; }
+
+    private:
+    const char *P;
+    const char *End;
+    bool Ok = true;
+};
+} // end namespace
+
+MBitcodeCache *MBitcodeCache::Active = nullptr;
+
+MBitcodeCache::MBitcodeCache(StringRef Dir, StringRef Bitcode) {
+    SmallString<128> File(Dir);
+    sys::path::append(File, utohexstr(xxHash64(Bitcode)) + ".mbc");
+    Path = File.str().str();
+
+    // 被解释的程序调用 exit 时析构函数不会执行
+    static bool Registered = (std::atexit(saveActive), true);
+    (void)Registered;
+    Active = this;
+
+    auto Existing = MemoryBuffer::getFile(Path);
+    if (!Existing)
+        return;
+    MReader R((*Existing)->getBuffer());
+    uint32_t Magic, Version, InstSize, NumFunctions;
+    if (!R.get(Magic) || !R.get(Version) || !R.get(InstSize) || !R.get(NumFunctions) ||
+        Magic != M_CACHE_MAGIC || Version != M_CACHE_VERSION || InstSize != sizeof(MInst))
+        return;
+    StringMap<std::string> Loaded;
+    for (uint32_t i = 0; i < NumFunctions; i++) {
+        StringRef Name, Body;
+        if (!R.getString(Name) || !R.getString(Body))
+            return;
+        Loaded[Name] = Body.str();
+    }
+    if (!R.atEnd())
+        return;
+    Entries = std::move(Loaded);
+    Verified = true;
+}
+
+MBitcodeCache::~MBitcodeCache() {
+    save();
+    if (Active == this)
+        Active = nullptr;
+}
+
+void MBitcodeCache::saveActive() {
+    if (Active)
+        Active->save();
+}
+
+void MBitcodeCache::store(const MBytecodeFunction &BF) {
+    Function &F = *BF.F;
+    DenseMap<const Value *, uint32_t> InstIdx;
+    // 常量在函数里第一次出现的位置
+    DenseMap<const Value *, std::pair<uint32_t, uint32_t>> FirstUse;
+    uint32_t Idx = 0;
+    for (Instruction &I : instructions(F)) {
+        for (unsigned Op = 0; Op < I.getNumOperands(); Op++)
+            if (isa<Constant>(I.getOperand(Op)))
+                FirstUse.insert({I.getOperand(Op), {Idx, Op}});
+        InstIdx[&I] = Idx++;
+    }
+
+    std::string Body;
+    MWriter W(Body);
+    W.put<uint32_t>(BF.NumArgs);
+    W.put<uint32_t>(BF.Frame.size());
+    W.putBytes(BF.Frame.data(), BF.Frame.size() * sizeof(MSlot));
+    W.put<uint32_t>(BF.Code.size());
+    for (MInst Inst : BF.Code) {
+        Inst.Target = nullptr;
+        W.putBytes(&Inst, sizeof(Inst));
+    }
+    W.put<uint32_t>(BF.Switches.size());
+    for (const MSwitchTable &Table : BF.Switches) {
+        W.put<uint32_t>(Table.Default);
+        W.put<uint32_t>(Table.Cases.size());
+        for (auto &Case : Table.Cases) {
+            W.put<uint64_t>(Case.first);
+            W.put<uint32_t>(Case.second);
+        }
+    }
+    W.put<uint32_t>(BF.Calls.size());
+    for (const MCallSite &CS : BF.Calls) {
+        W.put<uint32_t>(InstIdx.lookup(CS.Call));
+        W.put<uint32_t>(CS.CalleeSlot);
+        W.putString(CS.Callee ? CS.Callee->getName() : StringRef());
+        W.put<uint32_t>(CS.Args.size());
+        for (uint32_t Slot : CS.Args)
+            W.put<uint32_t>(Slot);
+    }
+    W.put<uint32_t>(BF.Relocs.size());
+    for (auto &Reloc : BF.Relocs) {
+        auto Use = FirstUse.find(Reloc.second);
+        // 不是作为操作数出现的常量没法定位，这个函数就不缓存了
+        if (Use == FirstUse.end())
+            return;
+        W.put<uint32_t>(Reloc.first);
+        W.put<uint32_t>(Use->second.first);
+        W.put<uint32_t>(Use->second.second);
+    }
+    Entries[F.getName()] = std::move(Body);
+    Dirty = true;
+}
+
+std::unique_ptr<MBytecodeFunction> MBitcodeCache::load(Function &F, MRuntime &RT) {
+    auto It = Entries.find(F.getName());
+    if (It == Entries.end())
+        return nullptr;
+    std::vector<Instruction *> Insts;
+    for (Instruction &I : instructions(F))
+        Insts.push_back(&I);
+
+    MReader R(It->second);
+    std::unique_ptr<MBytecodeFunction> BF(new MBytecodeFunction());
+    BF->F = &F;
+    uint32_t NumArgs, NumSlots, NumCode, NumSwitches, NumCalls, NumRelocs;
+    if (!R.get(NumArgs) || NumArgs != F.arg_size() || !R.get(NumSlots))
+        return nullptr;
+    BF->NumArgs = NumArgs;
+    BF->Frame.resize(NumSlots);
+    if (!R.getBytes(BF->Frame.data(), NumSlots * sizeof(MSlot)) || !R.get(NumCode))
+        return nullptr;
+    BF->Code.resize(NumCode);
+    if (!R.getBytes(BF->Code.data(), NumCode * sizeof(MInst)) || !R.get(NumSwitches))
+        return nullptr;
+
+    for (uint32_t i = 0; i < NumSwitches; i++) {
+        MSwitchTable Table;
+        uint32_t NumCases;
+        if (!R.get(Table.Default) || !R.get(NumCases))
+            return nullptr;
+        for (uint32_t c = 0; c < NumCases; c++) {
+            std::pair<uint64_t, uint32_t> Case;
+            if (!R.get(Case.first) || !R.get(Case.second))
+                return nullptr;
+            Table.Cases.push_back(Case);
+        }
+        BF->Switches.push_back(std::move(Table));
+    }
+
+    if (!R.get(NumCalls))
+        return nullptr;
+    for (uint32_t i = 0; i < NumCalls; i++) {
+        MCallSite CS;
+        uint32_t CallIdx, NumCallArgs;
+        StringRef CalleeName;
+        if (!R.get(CallIdx) || !R.get(CS.CalleeSlot) || !R.getString(CalleeName) || !R.get(NumCallArgs))
+            return nullptr;
+        CS.Call = CallIdx < Insts.size() ? dyn_cast<CallInst>(Insts[CallIdx]) : nullptr;
+        if (!CS.Call || CS.Call->arg_size() != NumCallArgs)
+            return nullptr;
+        CS.Callee = CS.Call->getCalledFunction();
+        if ((CS.Callee ? CS.Callee->getName() : StringRef()) != CalleeName)
+            return nullptr;
+        CS.Resolved = nullptr;
+        CS.Thunk = nullptr;
+        CS.RetTy = CS.Call->getType();
+        for (uint32_t a = 0; a < NumCallArgs; a++) {
+            uint32_t Slot;
+            if (!R.get(Slot))
+                return nullptr;
+            CS.Args.push_back(Slot);
+            CS.ArgTypes.push_back(CS.Call->getArgOperand(a)->getType());
+        }
+        BF->Calls.push_back(std::move(CS));
+    }
+
+    // 依赖地址的常量重新解析
+    if (!R.get(NumRelocs))
+        return nullptr;
+    for (uint32_t i = 0; i < NumRelocs; i++) {
+        uint32_t Slot, InstIdx, OpIdx;
+        if (!R.get(Slot) || !R.get(InstIdx) || !R.get(OpIdx) || Slot >= NumSlots ||
+            InstIdx >= Insts.size() || OpIdx >= Insts[InstIdx]->getNumOperands())
+            return nullptr;
+        auto *C = dyn_cast<Constant>(Insts[InstIdx]->getOperand(OpIdx));
+        if (!C)
+            return nullptr;
+        BF->Frame[Slot] = MBytecodeEngine::fromGeneric(RT.constantValue(C), C->getType());
+        BF->Relocs.push_back({Slot, C});
+    }
+    if (!R.atEnd())
+        return nullptr;
+    return BF;
+}
+
+void MBitcodeCache::save() {
+    if (!Dirty)
+        return;
+    Dirty = false;
+
+    std::string Out;
+    MWriter W(Out);
+    W.put<uint32_t>(M_CACHE_MAGIC);
+    W.put<uint32_t>(M_CACHE_VERSION);
+    W.put<uint32_t>(sizeof(MInst));
+    W.put<uint32_t>(Entries.size());
+    for (auto &Entry : Entries) {
+        W.putString(Entry.first());
+        W.putString(Entry.second);
+    }
+
+    // 先写临时文件再改名，同时运行的几个解释器不会读到写了一半的缓存
+    if (std::error_code EC = sys::fs::create_directories(sys::path::parent_path(Path))) {
+        errs() << "mcache: 建不了目录 " << sys::path::parent_path(Path) << ": " << EC.message() << "\n";
+        return;
+    }
+    int FD;
+    SmallString<128> TempPath;
+    if (std::error_code EC = sys::fs::createUniqueFile(Path + ".tmp%%%%%%", FD, TempPath)) {
+        errs() << "mcache: 写不了 " << Path << ": " << EC.message() << "\n";
+        return;
+    }
+    {
+        raw_fd_ostream OS(FD, true);
+        OS << Out;
+    }
+    if (std::error_code EC = sys::fs::rename(TempPath, Path)) {
+        errs() << "mcache: 写不了 " << Path << ": " << EC.message() << "\n";
+        sys::fs::remove(TempPath);
+    }
+}
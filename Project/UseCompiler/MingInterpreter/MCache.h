@@ -0,0 +1,53 @@
+#ifndef M_Cache_H
+#define M_Cache_H
+
+#include <memory>
+#include <string>
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "MBytecode.h"
+
+/*
+bitcode 缓存
+
+按 bitcode 文件内容的哈希在缓存目录里放一个 <hash>.mbc：
+1. 文件存在就说明这份 bitcode 已经完整读过一遍并通过了 verifier，再次运行时可以懒加载，不用先把所有函数体都读出来。
+2. 里面存着上次运行降级过的函数的字节码。指令、跳转表、帧模板原样保存；调用点存被调函数名和 call 指令的下标，
+   依赖内存地址的常量存它在函数里第一次出现的位置（指令下标，操作数下标），加载时重新向解释器要值。
+
+函数的指令下标按 instructions(F) 的顺序数。找不到对应的指令或者对不上时放弃这条缓存，重新降级。
+*/
+
+class MBitcodeCache {
+    public:
+    // Dir 是缓存目录，Bitcode 是整个 bitcode 文件的内容
+    MBitcodeCache(llvm::StringRef Dir, llvm::StringRef Bitcode);
+    ~MBitcodeCache();
+    MBitcodeCache(const MBitcodeCache &) = delete;
+    MBitcodeCache &operator=(const MBitcodeCache &) = delete;
+
+    // 这份 bitcode 之前验证过
+    bool verified() const { return Verified; }
+    // 验证通过以后调用，退出时会写缓存文件
+    void setVerified() { Verified = Dirty = true; }
+
+    // 从缓存里取 F 的字节码，F 必须已经读出函数体。没有或者对不上返回 nullptr
+    std::unique_ptr<MBytecodeFunction> load(llvm::Function &F, MRuntime &RT);
+    void store(const MBytecodeFunction &BF);
+
+    // 写缓存文件，没有变化时什么也不做
+    void save();
+
+    private:
+    static void saveActive();
+    static MBitcodeCache *Active;
+
+    std::string Path;
+    bool Verified = false;
+    bool Dirty = false;
+    // 函数名到序列化好的字节码
+    llvm::StringMap<std::string> Entries;
+};
+
+#endif
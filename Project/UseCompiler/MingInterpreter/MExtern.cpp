@@ -0,0 +1,257 @@
+#include "MExtern.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <string>
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/DerivedTypes.h"
+
+using namespace llvm;
+
+static inline MSlot slotI(uint64_t V) {
+    MSlot S;
+    S.I = V;
+    return S;
+}
+// i32 的结果零扩展保存
+static inline MSlot slotI32(int V) { return slotI((uint32_t)V); }
+static inline MSlot slotP(void *P) {
+    MSlot S;
+    S.P = P;
+    return S;
+}
+static inline MSlot slotP(const void *P) { return slotP(const_cast<void *>(P)); }
+static inline MSlot slotD(double V) {
+    MSlot S;
+    S.I = 0;
+    S.D = V;
+    return S;
+}
+static inline MSlot slotF(float V) {
+    MSlot S;
+    S.I = 0;
+    S.F = V;
+    return S;
+}
+#define M_ARG_I32(N) ((int)(int32_t)Args[N].I)
+#define M_ARG_I64(N) ((int64_t)Args[N].I)
+#define M_ARG_P(N) (Args[N].P)
+#define M_ARG_S(N) ((const char *)Args[N].P)
+
+// printf 的一段格式串，最多带两个 * 宽度
+template <typename T>
+static int printSegment(const char *Seg, const int *Stars, unsigned NumStars, T V) {
+    switch (NumStars) {
+    case 0: return printf(Seg, V);
+    case 1: return printf(Seg, Stars[0], V);
+    default: return printf(Seg, Stars[0], Stars[1], V);
+    }
+}
+
+// 输出没有转换说明的一段，%% 换成 %，返回写出的字节数
+static int printLiteral(const std::string &Seg) {
+    std::string Text;
+    for (size_t i = 0; i < Seg.size(); i++) {
+        Text += Seg[i];
+        if (Seg[i] == '%' && i + 1 < Seg.size() && Seg[i + 1] == '%')
+            i++;
+    }
+    if (fwrite(Text.data(), 1, Text.size(), stdout) != Text.size())
+        return -1;
+    return Text.size();
+}
+
+// 把格式串按转换说明切开，每段带一个实参调用 printf，实参按 IR 类型传。
+// 实参都是槽能放下的类型，调用点查 thunk 时已经检查过
+static MSlot printfThunk(const MSlot *Args, ArrayRef<Type *> ArgTypes) {
+    const char *P = M_ARG_S(0);
+    unsigned Next = 1;
+    int Total = 0;
+    std::string Seg;
+    while (*P) {
+        const char *Start = P;
+        // 普通字符和 %% 先攒着
+        while (*P && !(P[0] == '%' && P[1] != '%'))
+            P += (P[0] == '%') ? 2 : 1;
+        char Conv = 0;
+        const char *Pct = *P ? P : nullptr;
+        if (Pct) {
+            // 标志、宽度、精度、长度修饰，直到转换字符
+            ++P;
+            while (*P && !strchr("diouxXcsfFeEgGaApn", *P))
+                ++P;
+            if (*P)
+                Conv = *P++;
+        }
+        Seg.assign(Start, P);
+
+        int N;
+        if (!Conv) {
+            // 只有普通字符和 %%；末尾有不完整的转换说明时原样输出
+            N = printLiteral(Seg);
+        } else if (Conv == 'n') {
+            Seg.resize(Seg.rfind('%'));
+            N = printLiteral(Seg);
+            if (N >= 0 && Next < ArgTypes.size())
+                *(int *)Args[Next++].P = Total + N;
+        } else {
+            int Stars[2] = {0, 0};
+            unsigned NumStars = 0;
+            for (size_t i = Seg.rfind('%'); i < Seg.size() && NumStars < 2; i++)
+                if (Seg[i] == '*')
+                    Stars[NumStars++] = Next < ArgTypes.size() ? M_ARG_I32(Next++) : 0;
+            if (Next >= ArgTypes.size()) {
+                N = printSegment(Seg.c_str(), Stars, NumStars, 0);
+            } else {
+                Type *Ty = ArgTypes[Next];
+                const MSlot &A = Args[Next++];
+                if (Ty->isDoubleTy())
+                    N = printSegment(Seg.c_str(), Stars, NumStars, A.D);
+                else if (Ty->isFloatTy())
+                    N = printSegment(Seg.c_str(), Stars, NumStars, (double)A.F);
+                else if (Ty->isPointerTy())
+                    N = printSegment(Seg.c_str(), Stars, NumStars, A.P);
+                else if (Ty->getIntegerBitWidth() <= 32)
+                    N = printSegment(Seg.c_str(), Stars, NumStars, (int)(int32_t)A.I);
+                else
+                    N = printSegment(Seg.c_str(), Stars, NumStars, (long long)A.I);
+            }
+        }
+        if (N < 0)
+            return slotI32(-1);
+        Total += N;
+    }
+    return slotI32(Total);
+}
+
+namespace {
+// 签名写成 "返回:参数"。v void，i i32，l i64，p 指针，d double，f float，末尾 . 表示变参
+// Blocking 表示会等别的线程，InstVisitor 调用时要放开 interpLock
+struct MThunkEntry {
+    const char *Name;
+    const char *Sig;
+    MExternThunk Thunk;
+    bool Blocking;
+};
+} // end namespace
+
+#define M_THUNK(Name, Sig, Body) \
+    {Name, Sig, [](const MSlot *Args, ArrayRef<Type *>) -> MSlot { Body; }, false}
+#define M_BLOCKING_THUNK(Name, Sig, Body) \
+    {Name, Sig, [](const MSlot *Args, ArrayRef<Type *>) -> MSlot { Body; }, true}
+#define M_MATH_D(Name) M_THUNK(#Name, "d:d", return slotD(Name(Args[0].D)))
+#define M_MATH_DD(Name) M_THUNK(#Name, "d:dd", return slotD(Name(Args[0].D, Args[1].D)))
+
+static const MThunkEntry Thunks[] = {
+    // 内存和字符串
+    M_THUNK("memcpy", "p:ppl", return slotP(memcpy(M_ARG_P(0), M_ARG_P(1), Args[2].I))),
+    M_THUNK("memmove", "p:ppl", return slotP(memmove(M_ARG_P(0), M_ARG_P(1), Args[2].I))),
+    M_THUNK("memset", "p:pil", return slotP(memset(M_ARG_P(0), M_ARG_I32(1), Args[2].I))),
+    M_THUNK("memcmp", "i:ppl", return slotI32(memcmp(M_ARG_P(0), M_ARG_P(1), Args[2].I))),
+    M_THUNK("strlen", "l:p", return slotI(strlen(M_ARG_S(0)))),
+    M_THUNK("strcmp", "i:pp", return slotI32(strcmp(M_ARG_S(0), M_ARG_S(1)))),
+    M_THUNK("strncmp", "i:ppl", return slotI32(strncmp(M_ARG_S(0), M_ARG_S(1), Args[2].I))),
+    M_THUNK("strcpy", "p:pp", return slotP(strcpy((char *)M_ARG_P(0), M_ARG_S(1)))),
+    M_THUNK("strncpy", "p:ppl", return slotP(strncpy((char *)M_ARG_P(0), M_ARG_S(1), Args[2].I))),
+    M_THUNK("strcat", "p:pp", return slotP(strcat((char *)M_ARG_P(0), M_ARG_S(1)))),
+    M_THUNK("strchr", "p:pi", return slotP(strchr(M_ARG_S(0), M_ARG_I32(1)))),
+    M_THUNK("atoi", "i:p", return slotI32(atoi(M_ARG_S(0)))),
+    // 内存分配
+    M_THUNK("malloc", "p:l", return slotP(malloc(Args[0].I))),
+    M_THUNK("calloc", "p:ll", return slotP(calloc(Args[0].I, Args[1].I))),
+    M_THUNK("realloc", "p:pl", return slotP(realloc(M_ARG_P(0), Args[1].I))),
+    M_THUNK("free", "v:p", free(M_ARG_P(0)); return slotI(0)),
+    // 输出
+    {"printf", "i:p.", printfThunk, false},
+    M_THUNK("puts", "i:p", return slotI32(puts(M_ARG_S(0)))),
+    M_THUNK("putchar", "i:i", return slotI32(putchar(M_ARG_I32(0)))),
+    // 线程，pthread_create 由字节码自己处理。等待时不能占着解释器
+    M_BLOCKING_THUNK("pthread_join", "i:lp", return slotI32(pthread_join((pthread_t)Args[0].I, (void **)M_ARG_P(1)))),
+    M_THUNK("pthread_self", "l:", return slotI((uint64_t)pthread_self())),
+    M_BLOCKING_THUNK("pthread_mutex_lock", "i:p", return slotI32(pthread_mutex_lock((pthread_mutex_t *)M_ARG_P(0)))),
+    M_THUNK("pthread_mutex_unlock", "i:p", return slotI32(pthread_mutex_unlock((pthread_mutex_t *)M_ARG_P(0)))),
+    M_BLOCKING_THUNK("pthread_cond_wait", "i:pp",
+                     return slotI32(pthread_cond_wait((pthread_cond_t *)M_ARG_P(0), (pthread_mutex_t *)M_ARG_P(1)))),
+    // 整数
+    M_THUNK("abs", "i:i", return slotI32(abs(M_ARG_I32(0)))),
+    M_THUNK("labs", "l:l", return slotI(labs(M_ARG_I64(0)))),
+    // 数学函数
+    M_MATH_D(sqrt), M_MATH_D(sin), M_MATH_D(cos), M_MATH_D(tan), M_MATH_D(atan),
+    M_MATH_D(exp), M_MATH_D(log), M_MATH_D(log10), M_MATH_D(fabs), M_MATH_D(floor), M_MATH_D(ceil),
+    M_MATH_DD(pow), M_MATH_DD(fmod), M_MATH_DD(atan2),
+    M_THUNK("sqrtf", "f:f", return slotF(sqrtf(Args[0].F))),
+    M_THUNK("fabsf", "f:f", return slotF(fabsf(Args[0].F))),
+    // 和上面同样语义的 intrinsic
+    M_THUNK("llvm.sqrt.f64", "d:d", return slotD(sqrt(Args[0].D))),
+    M_THUNK("llvm.fabs.f64", "d:d", return slotD(fabs(Args[0].D))),
+    M_THUNK("llvm.floor.f64", "d:d", return slotD(floor(Args[0].D))),
+    M_THUNK("llvm.ceil.f64", "d:d", return slotD(ceil(Args[0].D))),
+    M_THUNK("llvm.sin.f64", "d:d", return slotD(sin(Args[0].D))),
+    M_THUNK("llvm.cos.f64", "d:d", return slotD(cos(Args[0].D))),
+    M_THUNK("llvm.exp.f64", "d:d", return slotD(exp(Args[0].D))),
+    M_THUNK("llvm.log.f64", "d:d", return slotD(log(Args[0].D))),
+    M_THUNK("llvm.pow.f64", "d:dd", return slotD(pow(Args[0].D, Args[1].D))),
+    M_THUNK("llvm.sqrt.f32", "f:f", return slotF(sqrtf(Args[0].F))),
+    M_THUNK("llvm.fabs.f32", "f:f", return slotF(fabsf(Args[0].F))),
+};
+
+static bool matchType(char C, Type *Ty) {
+    switch (C) {
+    case 'v': return Ty->isVoidTy();
+    case 'i': return Ty->isIntegerTy(32);
+    case 'l': return Ty->isIntegerTy(64);
+    case 'p': return Ty->isPointerTy() && Ty->getPointerAddressSpace() == 0;
+    case 'd': return Ty->isDoubleTy();
+    case 'f': return Ty->isFloatTy();
+    default: return false;
+    }
+}
+
+static bool matchSignature(const char *Sig, FunctionType *FTy) {
+    if (!matchType(Sig[0], FTy->getReturnType()) || Sig[1] != ':')
+        return false;
+    const char *P = Sig + 2;
+    for (Type *Param : FTy->params()) {
+        if (!matchType(*P, Param))
+            return false;
+        ++P;
+    }
+    bool VarArg = *P == '.';
+    return *(VarArg ? P + 1 : P) == 0 && VarArg == FTy->isVarArg();
+}
+
+static const MThunkEntry *findEntry(const Function &F) {
+    // 表里的 size_t、long 都按 64 位登记
+    if (sizeof(void *) != 8 || sizeof(long) != 8 || !F.isDeclaration())
+        return nullptr;
+    // 没有 thunk 的外部函数每次调用都会来查，用哈希表
+    static const StringMap<const MThunkEntry *> Index = [] {
+        StringMap<const MThunkEntry *> Map;
+        for (const MThunkEntry &Entry : Thunks)
+            Map[Entry.Name] = &Entry;
+        return Map;
+    }();
+    auto It = Index.find(F.getName());
+    if (It == Index.end() || !matchSignature(It->second->Sig, F.getFunctionType()))
+        return nullptr;
+    return It->second;
+}
+
+MExternThunk mFindExternThunk(const Function &F) {
+    const MThunkEntry *Entry = findEntry(F);
+    return Entry ? Entry->Thunk : nullptr;
+}
+
+bool mExternThunkBlocks(const Function &F) {
+    const MThunkEntry *Entry = findEntry(F);
+    return Entry && Entry->Blocking;
+}
+
+MExternThunk mFindExternThunk(const Function &F, ArrayRef<Type *> ArgTypes) {
+    for (Type *Ty : ArgTypes)
+        if (!MBytecodeEngine::isSlotType(Ty))
+            return nullptr;
+    return mFindExternThunk(F);
+}
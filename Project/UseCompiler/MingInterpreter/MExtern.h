@@ -0,0 +1,29 @@
+#ifndef M_Extern_H
+#define M_Extern_H
+
+#include "llvm/IR/Function.h"
+#include "MBytecode.h"
+
+/*
+常用外部函数的本地快速路径
+
+解释器调用外部函数要把参数打包成 GenericValue，按名字查 lle_X_ 表，查不到再走 libffi，每次调用都这样来一遍。
+这里给 memcpy、memset、strlen、printf、malloc/free、数学函数这些常用的 libc 函数手写了 thunk，参数直接按槽传，
+调用点第一次执行时按名字和签名查一次，之后直接调用。
+
+签名和登记的不一样（比如程序自己声明了同名但参数不同的函数）就不用 thunk。
+exit、atexit、abort 这类解释器要自己处理的函数不在表里。
+
+pthread_join、pthread_mutex_lock、pthread_cond_wait 这类会等别的线程的 thunk 登记成阻塞的。InstVisitor
+调它们时先收起本线程的帧、放开 interpLock，别的线程调不能降级的函数时才进得了解释器。
+表里没有或者签名不符的阻塞函数还是在锁里调，等的线程要进解释器时会死锁。
+*/
+
+// 找 F 的 thunk，没有或者签名不符返回 nullptr
+MExternThunk mFindExternThunk(const llvm::Function &F);
+// 同上，再检查调用点的实参。变参部分有放不进槽的类型（x86_fp80、half、向量等）时也返回 nullptr，调用回到解释器
+MExternThunk mFindExternThunk(const llvm::Function &F, llvm::ArrayRef<llvm::Type *> ArgTypes);
+// F 的 thunk 会阻塞等别的线程，InstVisitor 调用时要放开 interpLock
+bool mExternThunkBlocks(const llvm::Function &F);
+
+#endif
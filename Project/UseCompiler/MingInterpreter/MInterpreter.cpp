@@ -1,23 +1,100 @@
 #include "MInterpreter.h"
 #include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Errno.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
 
 using namespace llvm;
 
-MInterpreter::MInterpreter(Module *M) :
-      ExecutionEngine(M),
-      module(M)
+namespace {
+    cl::opt<bool>
+    useBytecode("bytecode", cl::desc("先降级成寄存器字节码再解释执行"), cl::init(false));
+    cl::opt<bool>
+    useTier("tier", cl::desc("分层执行，热函数用 JIT 编译成本地代码"), cl::init(false));
+    cl::opt<unsigned>
+    tierThreshold("tier-threshold", cl::desc("函数进入次数加回边次数达到多少算热"), cl::init(1000));
+    cl::opt<bool>
+    lazyLoad("lazy-load", cl::desc("函数体第一次调用时才从 bitcode 里读出来"), cl::init(true));
+    cl::opt<std::string>
+    bcCache("bc-cache", cl::desc("按 bitcode 哈希缓存验证结果和降级好的字节码"), cl::value_desc("dir"));
+}
+
+// 本线程拿了几层 interpLock，放锁等别的线程时要全部放开
+static thread_local unsigned interpLockDepth = 0;
+
+namespace {
+    // 拿着 interpLock 跑解释器
+    class MInterpGuard {
+        std::recursive_mutex &Lock;
+    public:
+        explicit MInterpGuard(std::recursive_mutex &L) : Lock(L) {
+            Lock.lock();
+            ++interpLockDepth;
+        }
+        ~MInterpGuard() {
+            --interpLockDepth;
+            Lock.unlock();
+        }
+    };
+
+    // 调会阻塞的外部函数期间放开 interpLock：本线程的帧先收到这里，执行栈留空给别的线程用，
+    // 回来时重新拿锁，这时别的线程也已经收走了自己的帧，再把帧放回去
+    class MInterpUnlock {
+        std::recursive_mutex &Lock;
+        std::vector<ExecutionContext> &Stack;
+        std::vector<ExecutionContext> Saved;
+        unsigned Depth;
+    public:
+        MInterpUnlock(std::recursive_mutex &L, std::vector<ExecutionContext> &S)
+            : Lock(L), Stack(S), Depth(interpLockDepth) {
+            Saved.swap(Stack);
+            interpLockDepth = 0;
+            for (unsigned i = 0; i < Depth; i++)
+                Lock.unlock();
+        }
+        ~MInterpUnlock() {
+            for (unsigned i = 0; i < Depth; i++)
+                Lock.lock();
+            interpLockDepth = Depth;
+            Stack.swap(Saved);
+        }
+    };
+}
+
+// 模块只交给 interp，自己的 ExecutionEngine 不持有模块，只用它的数据布局跑 runFunctionAsMain()
+MInterpreter::MInterpreter(std::unique_ptr<Module> M) :
+      ExecutionEngine(M->getDataLayout()),
+      module(M.get()),
+      mainPrepared(false)
 {
-  interp = new Interpreter(M);
-  pItp = (PInterpreter *)pItp;  // GIANT HACK
+  interp = new Interpreter(std::move(M));
+  pItp = (PInterpreter *)interp;  // GIANT HACK
 
-  // 数据布局 ExecutionEngine::runFunctionAsMain().
-  setDataLayout(interp->getDataLayout());
+  // 只带数据布局的构造函数不会初始化这些开关
+  DisableLazyCompilation();
+  DisableGVCompilation(false);
+  DisableSymbolSearching(false);
+  setVerifyModules(false);
 
-  Modules.clear();
+  // 字节码和解释器共用同一份全局变量内存
+  bytecode = useBytecode ? new MBytecodeEngine(*interp, *this) : 0;
+
+  tier = useTier ? new MTierJIT(*module, *this, tierThreshold) : 0;
+  if (bytecode)
+    bytecode->setTier(tier);
 }
 
 MInterpreter::~MInterpreter() {
+  delete bytecode;
+  delete tier;
   delete interp;
 }
 
@@ -31,7 +108,92 @@ void MInterpreter::run() {
 }
 
 void MInterpreter::execute(Instruction &I) {
+  CallInst *CI = dyn_cast<CallInst>(&I);
+  if (CI) {
+    materializeCallee(*CI);
+    if (callThunk(*CI))
+      return;
+  }
+  if (!tier) {
+    pItp->visit(I);
+    return;
+  }
+  if (CI && callNative(*CI))
+    return;
+  BasicBlock *From = I.getParent();
   pItp->visit(I);
+  // 跳转之后 CurBB 已经是目标块
+  if (isa<BranchInst>(I) || isa<SwitchInst>(I))
+    tier->branch(From, pItp->ECStack.back().CurBB);
+}
+
+void MInterpreter::materializeCallee(CallInst &CI) {
+  Value *Callee = CI.getCalledOperand();
+  Function *F = dyn_cast<Function>(Callee->stripPointerCasts());
+  // 间接调用从当前帧里取函数指针，解释器里函数指针就是 Function*
+  if (!F && !isa<Constant>(Callee) && !CI.isInlineAsm())
+    F = (Function *)GVTOP(pItp->ECStack.back().Values[Callee]);
+  if (F)
+    mMaterialize(F);
+}
+
+bool MInterpreter::callNative(CallInst &CI) {
+  Function *F = CI.getCalledFunction();
+  if (!F || F->isDeclaration())
+    return false;
+  MNativeFn Native = tier->enter(F);
+  if (!Native)
+    return false;
+
+  SmallVector<MSlot, 8> Args;
+  callArgs(CI, Args);
+  MSlot Ret;
+  Ret.I = 0;
+  Native(Args.data(), &Ret);
+  if (!CI.getType()->isVoidTy())
+    pItp->ECStack.back().Values[&CI] = MBytecodeEngine::toGeneric(Ret, CI.getType());
+  return true;
+}
+
+bool MInterpreter::callThunk(CallInst &CI) {
+  SmallVector<Type *, 8> ArgTypes;
+  auto It = thunks.find(&CI);
+  if (It == thunks.end()) {
+    for (Value *V : CI.args())
+      ArgTypes.push_back(V->getType());
+    Function *F = CI.getCalledFunction();
+    CallThunk Entry = {F ? mFindExternThunk(*F, ArgTypes) : nullptr, F && mExternThunkBlocks(*F)};
+    It = thunks.insert({&CI, Entry}).first;
+  }
+  // 放锁期间别的线程会往 thunks 里插，迭代器会失效
+  CallThunk Entry = It->second;
+  if (!Entry.Thunk)
+    return false;
+  if (ArgTypes.size() != CI.arg_size())
+    for (Value *V : CI.args())
+      ArgTypes.push_back(V->getType());
+
+  SmallVector<MSlot, 8> Args;
+  callArgs(CI, Args);
+  MSlot Ret;
+  if (Entry.Blocking) {
+    // 等的可能是一个要进解释器的线程，占着锁就死锁了
+    MInterpUnlock Unlock(interpLock, pItp->ECStack);
+    Ret = Entry.Thunk(Args.data(), ArgTypes);
+  } else {
+    Ret = Entry.Thunk(Args.data(), ArgTypes);
+  }
+  if (!CI.getType()->isVoidTy())
+    pItp->ECStack.back().Values[&CI] = MBytecodeEngine::toGeneric(Ret, CI.getType());
+  return true;
+}
+
+void MInterpreter::callArgs(CallInst &CI, SmallVectorImpl<MSlot> &Args) {
+  ExecutionContext &SF = pItp->ECStack.back();
+  for (Value *V : CI.args()) {
+    GenericValue GV = isa<Constant>(V) ? pItp->constantValue(cast<Constant>(V)) : SF.Values[V];
+    Args.push_back(MBytecodeEngine::fromGeneric(GV, V->getType()));
+  }
 }
 
 // 包装入口
@@ -44,34 +206,194 @@ int MInterpreter::runMain(std::vector<std::string> args,
         return -1;
     }
 
+    if (!prepareMain())
+        return -1;
+
     // 重置 errno 为 0
     errno = 0;
-    
+
+    // 返回 main
+    int retcode = runFunctionAsMain(mainF, args, envp);
+    runStaticConstructorsDestructors(*module, true);
+    return retcode;
+}
+
+bool MInterpreter::prepareMain() {
+    if (mainPrepared)
+        return true;
     std::string ErrorMsg;
     if (sys::DynamicLibrary::LoadLibraryPermanently(0, &ErrorMsg)) {
         errs() << "Could not load dynamic library: " << ErrorMsg << "\n";
+        return false;
+    }
+    // Modules 已经清空，按模块跑 llvm.global_ctors
+    runStaticConstructorsDestructors(*module, false);
+    mainPrepared = true;
+    return true;
+}
+
+int MInterpreter::runMainForked(const std::vector<std::vector<std::string>> &runs,
+                                char * const *envp) {
+    Function *mainF = module->getFunction("main");
+    if (!mainF) {
+        errs() << "No main function found in module.\n";
         return -1;
     }
+    if (!prepareMain())
+        return -1;
+    // main 先降级好，子进程直接继承
+    mMaterialize(mainF);
+    if (bytecode)
+        bytecode->getOrLower(mainF);
 
-    // 返回 main
-    return runFunctionAsMain(mainF, args, envp);
+    int result = 0;
+    for (unsigned i = 0; i < runs.size(); i++) {
+        // 缓冲区里还没写出去的内容会被子进程再写一遍
+        outs().flush();
+        fflush(0);
+        pid_t pid = fork();
+        if (pid < 0) {
+            errs() << "fork 失败: " << sys::StrError() << "\n";
+            return -1;
+        }
+        // 子进程跑完直接退出，跟踪、剖析、缓存在 atexit 里写出
+        if (pid == 0)
+            exit(runMain(runs[i], envp));
+
+        int status = 0;
+        pid_t waited;
+        do
+            waited = waitpid(pid, &status, 0);
+        while (waited < 0 && errno == EINTR);
+        int retcode = waited < 0 ? -1 : WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (retcode) {
+            errs() << "第 " << i + 1 << " 次运行退出码 " << retcode << "\n";
+            if (!result)
+                result = retcode;
+        }
+    }
+    return result;
 }
 
 // 包装 runFunction
 GenericValue MInterpreter::runFunction(Function *F,
-                                       const std::vector<GenericValue> &ArgValues) {
+                                       ArrayRef<GenericValue> ArgValues) {
+    mMaterialize(F);
+
+    // 能降级的函数走字节码，其他的还是 InstVisitor
+    if (bytecode) {
+        if (MBytecodeFunction *BF = bytecode->getOrLower(F))
+            return bytecode->runFunction(*BF, ArgValues);
+    }
+    if (tier) {
+        MInterpGuard Guard(interpLock);
+        if (MNativeFn Native = tier->enter(F)) {
+            std::vector<MSlot> Args(F->arg_size());
+            for (Argument &Arg : F->args())
+                Args[Arg.getArgNo()] = MBytecodeEngine::fromGeneric(ArgValues[Arg.getArgNo()], Arg.getType());
+            MSlot Ret;
+            Ret.I = 0;
+            Native(Args.data(), &Ret);
+            if (F->getReturnType()->isVoidTy())
+                return GenericValue();
+            return MBytecodeEngine::toGeneric(Ret, F->getReturnType());
+        }
+    }
+
+    MInterpGuard Guard(interpLock);
     std::vector<GenericValue> ActualArgs;
     const unsigned NumArgs = F->getFunctionType()->getNumParams();
     for (unsigned i = 0; i < NumArgs; i++)
     {
-        NumArgs.push_back(ArgValues[i]);
+        ActualArgs.push_back(ArgValues[i]);
     }
     interp->callFunction(F, ActualArgs);
     run();
     return pItp->ExitValue;
 }
-void *MInterpreter::getPointerToNamedFunction(const std::string &Name,
+
+// 字节码或者本地代码调用外部函数、不能降级的函数。本地代码回调时本线程可能还有解释到一半的帧，
+// 先收起来，执行栈从空开始，run() 跑完这一次调用就返回
+GenericValue MInterpreter::callExternal(Function *F, ArrayRef<GenericValue> Args) {
+    MInterpGuard Guard(interpLock);
+    mMaterialize(F);
+    std::vector<ExecutionContext> Saved;
+    Saved.swap(pItp->ECStack);
+    interp->callFunction(F, Args);
+    run();
+    pItp->ECStack.swap(Saved);
+    return pItp->ExitValue;
+}
+
+GenericValue MInterpreter::constantValue(const Constant *C) {
+    return pItp->constantValue(C);
+}
+
+void MInterpreter::setCache(MBitcodeCache *C) {
+    if (bytecode)
+        bytecode->setCache(C);
+}
+
+std::unique_ptr<Module> loadModule(const std::string &bcFile, LLVMContext &Context,
+                                   std::unique_ptr<MBitcodeCache> &Cache) {
+    auto Buffer = MemoryBuffer::getFileOrSTDIN(bcFile);
+    if (!Buffer) {
+        errs() << "bitcode parsing failed: " << Buffer.getError().message() << "\n";
+        return nullptr;
+    }
+    if (!bcCache.empty())
+        Cache.reset(new MBitcodeCache(bcCache, (*Buffer)->getBuffer()));
+
+    // 懒加载时函数体读不出来会在第一次调用时报错
+    SMDiagnostic Err;
+    if (lazyLoad && (!Cache || Cache->verified())) {
+        std::unique_ptr<Module> Mod = getLazyIRModule(std::move(*Buffer), Err, Context);
+        if (!Mod)
+            Err.print("mingInterpreter", errs());
+        return Mod;
+    }
+
+    std::unique_ptr<Module> Mod = parseIR((*Buffer)->getMemBufferRef(), Err, Context);
+    if (!Mod) {
+        Err.print("mingInterpreter", errs());
+        return nullptr;
+    }
+    // 第一次用缓存时完整验证一遍，之后就不用了
+    if (Cache) {
+        if (verifyModule(*Mod, &errs())) {
+            errs() << "bitcode verification failed\n";
+            return nullptr;
+        }
+        Cache->setVerified();
+    }
+    return Mod;
+}
+std::vector<GenericValue> MInterpreter::runFunctionBatch(
+        Function *F, const std::vector<std::vector<GenericValue>> &Inputs, unsigned Threads) {
+    std::vector<GenericValue> Results(Inputs.size());
+    MBytecodeFunction *BF = bytecode ? bytecode->getOrLower(F) : 0;
+    if (!BF) {
+        for (unsigned i = 0; i < Inputs.size(); i++)
+            Results[i] = runFunction(F, Inputs[i]);
+        return Results;
+    }
+
+    ThreadPool Pool(hardware_concurrency(Threads));
+    for (unsigned i = 0; i < Inputs.size(); i++)
+        Pool.async([this, BF, &Inputs, &Results, i] {
+            Results[i] = bytecode->runFunction(*BF, Inputs[i]);
+        });
+    Pool.wait();
+    return Results;
+}
+
+void *MInterpreter::getPointerToNamedFunction(StringRef Name,
                                               bool AbortOnFailure) {
+    // runMain 已经把整个进程加载进来了
+    if (void *Ptr = sys::DynamicLibrary::SearchForAddressOfSymbol(Name.str()))
+        return Ptr;
+    if (AbortOnFailure)
+        report_fatal_error("Program used external function '" + Twine(Name) + "' which could not be resolved!");
     return 0;
 }
 void *MInterpreter::recompileAndRelinkFunction(Function *F) {
@@ -83,5 +405,5 @@ void *MInterpreter::getPointerToFunction(Function *F) {
     return (void *)F;
 }
 void *MInterpreter::getPointerToBasicBlock(BasicBlock *BB) {
-    return （void *)BB;
+    return (void *)BB;
 }
\ No newline at end of file
@@ -1,84 +1,198 @@
 #ifndef M_Interpreter_H
 #define M_Interpreter_H
 
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Support/SourceMgr.h"
 #include "ExecutionEngine/Interpreter/Interpreter.h"
+#include "MBytecode.h"
+#include "MCache.h"
+#include "MExtern.h"
+#include "MTier.h"
+#include "MTrace.h"
 
 // 使用 public 访问内部
+// 成员必须和 lib/ExecutionEngine/Interpreter/Interpreter.h 里 llvm::Interpreter 的私有成员一一对应，
+// pItp 是把 llvm::Interpreter 直接强转过来的
 // template<typename SubClass, typename RetTy=void>
 class PInterpreter : public llvm::ExecutionEngine,
                      public llvm::InstVisitor<llvm::Interpreter> {
     public:
     llvm::GenericValue ExitValue;
-    llvm::DataLayout TD;
     llvm::IntrinsicLowering *IL;
     std::vector<llvm::ExecutionContext> ECStack;
     std::vector<llvm::Function*> AtExitHandlers;
+
+    // getConstantValue 是 protected 的，借 PInterpreter 开个口
+    llvm::GenericValue constantValue(const llvm::Constant *C) {
+        return getConstantValue(C);
+    }
 };
 
+// 布局对不上时 ECStack、AtExitHandlers 会读写到别的成员上。Interpreter 的成员是私有的，
+// 只能比大小和第一个成员的位置，多了少了成员都能查出来
+static_assert(sizeof(PInterpreter) == sizeof(llvm::Interpreter),
+              "PInterpreter 和 llvm::Interpreter 的布局不一致");
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+static_assert(offsetof(PInterpreter, ExitValue) == sizeof(llvm::ExecutionEngine),
+              "PInterpreter 的成员要紧跟在 ExecutionEngine 后面");
+#pragma GCC diagnostic pop
+
 // template<typename SubClass, typename RetTy=void>
-class MInterpreter : public llvm::ExecutionEngine {
+class MInterpreter : public llvm::ExecutionEngine, public MRuntime {
     public:
     llvm::Interpreter *interp;
     PInterpreter *pItp;
     llvm::Module *module;
+    // -bytecode 时不为空，能降级的函数走字节码
+    MBytecodeEngine *bytecode;
+    // -tier 时不为空，热函数编译成本地代码
+    MTierJIT *tier;
+    // llvm::Interpreter 只有一个执行栈，多个线程要进解释器时排队。本地代码回调解释器会重入，所以是递归锁。
+    // 没人拿着锁时执行栈总是空的：拿着锁的线程要放锁等别的线程，先把自己的帧收走
+    std::recursive_mutex interpLock;
+    // 每个调用点的外部函数 thunk，Thunk 为空表示没有
+    struct CallThunk {
+        MExternThunk Thunk;
+        // 会阻塞等别的线程，调用时放开 interpLock
+        bool Blocking;
+    };
+    llvm::DenseMap<const llvm::CallInst *, CallThunk> thunks;
+    // 已经跑过静态构造
+    bool mainPrepared;
 
-    explicit MInterpreter(llvm::Module *M);
+    // 模块归 interp 所有，module 只是借用
+    explicit MInterpreter(std::unique_ptr<llvm::Module> M);
     virtual ~MInterpreter();
 
     virtual void run();
     virtual void execute(llvm::Instruction &I);
+    // 被调函数已经编译成本地代码时直接调用，返回 false 表示还得解释
+    bool callNative(llvm::CallInst &CI);
+    // 被调函数是有 thunk 的外部函数时直接调用，返回 false 表示还得解释。会阻塞的 thunk 调用期间放开 interpLock
+    bool callThunk(llvm::CallInst &CI);
+    // 从当前帧取 CI 的实参
+    void callArgs(llvm::CallInst &CI, llvm::SmallVectorImpl<MSlot> &Args);
+    // 懒加载时先读出被调函数的函数体
+    void materializeCallee(llvm::CallInst &CI);
+    // 字节码降级的结果存进缓存，没开字节码时什么也不做
+    void setCache(MBitcodeCache *C);
 
     // 入口
     virtual int runMain(std::vector<std::string> args,
                         char * const *envp = 0);
+    // 快照运行：进入 main 之前的状态（全局变量、静态构造的结果、已加载的外部符号、降级好的 main）只准备一次，
+    // 之后每组参数 fork 一个子进程，从这个状态开始跑 main，子进程的修改不会影响下一次。返回第一个非 0 的退出码
+    int runMainForked(const std::vector<std::vector<std::string>> &runs,
+                      char * const *envp = 0);
+    // 进入 main 之前的准备，只做一次
+    bool prepareMain();
     
     // 遵循 ExecutionEngine 接口
     llvm::GenericValue runFunction(
         llvm::Function *F,
-        const std::vector<llvm::GenericValue> &ArgValues
+        llvm::ArrayRef<llvm::GenericValue> ArgValues
+    ) override;
+    // 对每组实参各调用一次 F，结果按输入的顺序返回。F 能降级成字节码时在线程池里并行跑，
+    // 所有线程共用同一份模块和字节码，每个线程有自己的帧；否则逐个解释。Threads 为 0 表示按 CPU 个数
+    std::vector<llvm::GenericValue> runFunctionBatch(
+        llvm::Function *F,
+        const std::vector<std::vector<llvm::GenericValue>> &Inputs,
+        unsigned Threads = 0
     );
-    void *getPointerToNamedFunction(const std::string &Name,
-                                    bool AbortOnFailure = true);
+    void *getPointerToNamedFunction(llvm::StringRef Name,
+                                    bool AbortOnFailure = true) override;
     void *recompileAndRelinkFunction(llvm::Function *F);
     void freeMachineCodeForFunction(llvm::Function *F);
-    void *getPointerToFunction(llvm::Function *F);
+    void *getPointerToFunction(llvm::Function *F) override;
     void *getPointerToBasicBlock(llvm::BasicBlock *BB);
+
+    // MRuntime，字节码回到解释器
+    llvm::GenericValue callExternal(llvm::Function *F,
+                                    llvm::ArrayRef<llvm::GenericValue> Args);
+    llvm::GenericValue constantValue(const llvm::Constant *C);
 };
 
-// 解释运行 bitcode 时所需的一些功能
-template <typename InterpreterType>
-int itpUtility(std::string bcFile, std::vector<std::string> args, char * const *envp) {
-    llvm::LLVMContext &Constext = llvm::getGlobalContext();
+// 带跟踪策略的解释器。主循环不经过虚函数 execute，策略的 onInst 在编译期内联进来
+// 字节码和本地代码执行的函数不逐条跟踪
+template <typename TracePolicy>
+class MTraceInterpreter : public MInterpreter {
+    public:
+    TracePolicy Trace;
 
-    // 读 bitcode 文件
-    llvm::SMDiagnostic Err;
-    llvm::Module *Mod = llvm::ParseIRFile(bcFile, Err, Constext);
-    if (!Mod) {
-        llvm::errs() << "bitcode parsing failed\n";
-        return -1;
-    }
-    
-    // 检查 bitcode 文件是否有效
-    std::string ErrStr;
-    if (Mod->MaterializeAllPermanently(&ErrStr)) {
-        llvm::errs() << "bitcode materialization failed: " << ErrStr << "\n";
-        return -1;
+    template <typename... PolicyArgs>
+    explicit MTraceInterpreter(std::unique_ptr<llvm::Module> M, PolicyArgs &&... Args)
+        : MInterpreter(std::move(M)), Trace(std::forward<PolicyArgs>(Args)...) {}
+
+    virtual void run() {
+        while (!pItp->ECStack.empty()) {
+            llvm::ExecutionContext &EC = pItp->ECStack.back();
+            llvm::Instruction &I = *EC.CurInst++;
+            Trace.onInst(I);
+            MInterpreter::execute(I);
+        }
     }
+};
+
+// 读 bitcode。默认懒加载，函数体第一次调用时才读出来；给了 -bc-cache 时第一次运行会完整读一遍并验证，
+// 之后同一份 bitcode 直接懒加载，降级好的字节码也从缓存里取。Cache 要比解释器活得久
+std::unique_ptr<llvm::Module> loadModule(const std::string &bcFile, llvm::LLVMContext &Context,
+                                         std::unique_ptr<MBitcodeCache> &Cache);
+
+// 读 bitcode 并创建解释器，bcFile 改成程序名。出错返回空
+// Extra 原样传给 InterpreterType 的构造函数
+template <typename InterpreterType, typename... CtorArgs>
+std::unique_ptr<MInterpreter> itpCreate(std::string &bcFile, std::unique_ptr<MBitcodeCache> &Cache,
+                                        CtorArgs &&... Extra) {
+    // 模块和解释器里的全局变量、atexit 处理函数要活到进程退出
+    static llvm::LLVMContext Context;
+
+    // 读 bitcode 文件
+    std::unique_ptr<llvm::Module> Mod = loadModule(bcFile, Context, Cache);
+    if (!Mod)
+        return nullptr;
 
     // 处理参数
     if (llvm::StringRef(bcFile).endswith(".bc"))
         bcFile.erase(bcFile.end() - 3, bcFile.end());
-    args.insert(args.begin(), bcFile); // 将文件名作为第一个参数
 
     // 创建解释器
-    MInterpreter *itp = new InterpreterType(Mod);
-    int retcode = itp->runMain(args, envp);
-    delete itp;
-    return retcode;
+    std::unique_ptr<MInterpreter> itp(new InterpreterType(std::move(Mod), std::forward<CtorArgs>(Extra)...));
+    itp->setCache(Cache.get());
+    return itp;
+}
+
+// 解释运行 bitcode 时所需的一些功能
+template <typename InterpreterType, typename... CtorArgs>
+int itpUtility(std::string bcFile, std::vector<std::string> args, char * const *envp,
+               CtorArgs &&... Extra) {
+    std::unique_ptr<MBitcodeCache> Cache;
+    std::unique_ptr<MInterpreter> itp =
+        itpCreate<InterpreterType>(bcFile, Cache, std::forward<CtorArgs>(Extra)...);
+    if (!itp)
+        return -1;
+    args.insert(args.begin(), bcFile); // 将文件名作为第一个参数
+    return itp->runMain(args, envp);
+}
+
+// 同一份 bitcode 按多组参数各跑一次，见 MInterpreter::runMainForked
+template <typename InterpreterType, typename... CtorArgs>
+int itpSnapshotUtility(std::string bcFile, std::vector<std::vector<std::string>> runs,
+                       char * const *envp, CtorArgs &&... Extra) {
+    std::unique_ptr<MBitcodeCache> Cache;
+    std::unique_ptr<MInterpreter> itp =
+        itpCreate<InterpreterType>(bcFile, Cache, std::forward<CtorArgs>(Extra)...);
+    if (!itp)
+        return -1;
+    for (std::vector<std::string> &args : runs)
+        args.insert(args.begin(), bcFile);
+    return itp->runMainForked(runs, envp);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include "MProfile.h"
+#include <algorithm>
+#include <cstdlib>
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "DynamicCallCounter.h"
+
+using namespace llvm;
+
+MProfiler *MProfiler::Active = nullptr;
+
+MProfiler::MProfiler(std::string Path) : Path(std::move(Path)), Current(&Outside) {
+    // 被解释的程序调用 exit 时析构函数不会执行
+    static bool Registered = (std::atexit(reportActive), true);
+    (void)Registered;
+    Active = this;
+}
+
+MProfiler::~MProfiler() {
+    report();
+    if (Active == this)
+        Active = nullptr;
+}
+
+void MProfiler::reportActive() {
+    if (Active)
+        Active->report();
+}
+
+void MProfiler::enterBlock(BasicBlock &BB, Instruction *LastPHI) {
+    ++Blocks[&BB];
+    uint64_t PHIs = 0;
+    if (LastPHI) {
+        for (PHINode &PN : BB.phis()) {
+            Opcodes.add(PN);
+            ++PHIs;
+        }
+    }
+
+    // 入口块没有前驱，执行到它就是进入了函数
+    const Function *F = BB.getParent();
+    if (&F->getEntryBlock() == &BB) {
+        FuncProfile &P = Functions[F];
+        ++P.Calls;
+        ++P.Active;
+        ++Edges[std::make_pair(Stack.empty() ? nullptr : Stack.back().F, F)].Calls;
+        Stack.push_back({F, &P, mCycles(), 0});
+        Current = &P;
+    }
+    Current->Insts += PHIs + 1;
+}
+
+void MProfiler::leave(uint64_t Now) {
+    if (Stack.empty())
+        return;
+    Frame Top = Stack.back();
+    Stack.pop_back();
+    uint64_t Inclusive = Now - Top.Start;
+    Top.Profile->Exclusive += Inclusive - Top.Children;
+    // 递归时只有最外层那次算包含周期，不然会重复计算
+    if (--Top.Profile->Active == 0)
+        Top.Profile->Inclusive += Inclusive;
+    Edges[std::make_pair(Stack.empty() ? nullptr : Stack.back().F, Top.F)].Inclusive += Inclusive;
+    if (Stack.empty()) {
+        Current = &Outside;
+    } else {
+        Stack.back().Children += Inclusive;
+        Current = Stack.back().Profile;
+    }
+}
+
+static std::string nameOf(const Function *F) {
+    return F ? F->getName().str() : "<外部>";
+}
+
+void MProfiler::report() {
+    if (Reported)
+        return;
+    Reported = true;
+
+    // 还没返回的函数（比如调用了 exit）按现在的时间结算
+    uint64_t Now = mCycles();
+    while (!Stack.empty())
+        leave(Now);
+
+    writeProfile();
+    printOpcodeCounterResult(errs(), Opcodes);
+    printCycles(errs());
+}
+
+// GUID 和块序号的算法和 DynamicCallCounter 一样，dynamic-profile 用同一份 bitcode 能查回名字
+void MProfiler::writeProfile() {
+    std::vector<DCCProfileRecord> Funcs;
+    for (auto &Item : Functions)
+        Funcs.push_back({Function::getGUID(Item.first->getGlobalIdentifier()), Item.second.Calls});
+    std::sort(Funcs.begin(), Funcs.end(), [](const DCCProfileRecord &A, const DCCProfileRecord &B) {
+        return A.Count != B.Count ? A.Count > B.Count : A.GUID < B.GUID;
+    });
+
+    // 执行过的块按所在函数里的顺序编号
+    std::vector<DCCProfileBlockRecord> BlockRecords;
+    DenseMap<const Function *, uint64_t> GUIDs;
+    for (auto &Item : Blocks)
+        GUIDs[Item.first->getParent()] = 0;
+    for (auto &Item : GUIDs) {
+        const Function *F = Item.first;
+        uint64_t GUID = Function::getGUID(F->getGlobalIdentifier());
+        uint64_t Idx = 0;
+        for (const BasicBlock &BB : *F) {
+            auto It = Blocks.find(&BB);
+            if (It != Blocks.end())
+                BlockRecords.push_back({GUID, Idx, It->second});
+            ++Idx;
+        }
+    }
+    std::sort(BlockRecords.begin(), BlockRecords.end(),
+              [](const DCCProfileBlockRecord &A, const DCCProfileBlockRecord &B) {
+                  return A.GUID != B.GUID ? A.GUID < B.GUID : A.Block < B.Block;
+              });
+
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+    if (EC) {
+        errs() << "mprofile: 打不开 " << Path << ": " << EC.message() << "\n";
+        return;
+    }
+    DCCProfileHeader Header = {DCCProfileMagic, DCCProfileVersion, Funcs.size(), 1, BlockRecords.size()};
+    OS.write((const char *)&Header, sizeof(Header));
+    OS.write((const char *)Funcs.data(), Funcs.size() * sizeof(DCCProfileRecord));
+    OS.write((const char *)BlockRecords.data(), BlockRecords.size() * sizeof(DCCProfileBlockRecord));
+}
+
+// 调用次数在剖析文件里，这里只打印两个工具都没有的周期和调用图
+void MProfiler::printCycles(raw_ostream &OutS) {
+    // 按独占周期排序
+    std::vector<std::pair<const Function *, const FuncProfile *>> Flat;
+    for (auto &Item : Functions)
+        Flat.push_back(std::make_pair(Item.first, &Item.second));
+    std::sort(Flat.begin(), Flat.end(), [](const std::pair<const Function *, const FuncProfile *> &A,
+                                           const std::pair<const Function *, const FuncProfile *> &B) {
+        return A.second->Exclusive > B.second->Exclusive;
+    });
+    OutS << "====================================================\n";
+    OutS << "函数周期：\n";
+    OutS << "====================================================\n";
+    const char *str1 = "函数名";
+    const char *str2 = "#指令";
+    const char *str3 = "独占周期";
+    const char *str4 = "包含周期";
+    OutS << format("%-20s %-12s %-16s %-16s\n", str1, str2, str3, str4);
+    OutS << "----------------------------------------------------\n";
+    for (auto &Item : Flat) {
+        const FuncProfile &P = *Item.second;
+        OutS << format("%-20s %-12lu %-16lu %-16lu\n", nameOf(Item.first).c_str(),
+                       P.Insts, P.Exclusive, P.Inclusive);
+    }
+    OutS << "====================================================\n\n";
+
+    // 调用图，按包含周期排序
+    std::vector<std::pair<std::pair<const Function *, const Function *>, EdgeProfile>> CG(Edges.begin(), Edges.end());
+    std::sort(CG.begin(), CG.end(), [](const std::pair<std::pair<const Function *, const Function *>, EdgeProfile> &A,
+                                       const std::pair<std::pair<const Function *, const Function *>, EdgeProfile> &B) {
+        return A.second.Inclusive > B.second.Inclusive;
+    });
+    OutS << "====================================================\n";
+    OutS << "调用图：\n";
+    OutS << "====================================================\n";
+    const char *str5 = "调用者";
+    const char *str6 = "被调者";
+    const char *str7 = "#N 调用次数";
+    OutS << format("%-20s %-20s %-10s %-16s\n", str5, str6, str7, str4);
+    OutS << "----------------------------------------------------\n";
+    for (auto &Item : CG) {
+        OutS << format("%-20s %-20s %-10lu %-16lu\n", nameOf(Item.first.first).c_str(),
+                       nameOf(Item.first.second).c_str(), Item.second.Calls, Item.second.Inclusive);
+    }
+    OutS << "====================================================\n";
+}
@@ -0,0 +1,97 @@
+#ifndef M_Profile_H
+#define M_Profile_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+#include "OpcodeCounter.h"
+#include "MTrace.h"
+
+/*
+性能剖析
+
+MProfiler 是 MTraceInterpreter 的跟踪策略，不用重新插桩编译 bitcode 就能看解释执行时的热点：
+1. 每种 opcode、每个基本块、每个函数执行了多少条指令。
+2. 每个函数的调用次数、独占周期和包含周期（mCycles，x86 上是 rdtsc）。递归调用只在最外层计包含周期。
+3. 调用图：每条调用者到被调者的边的次数和包含周期。
+
+只在基本块入口、函数入口和 ret 上读时钟，普通指令只加一次直方图。PHI 在解释器切换基本块时就求值了，不会经过主循环，在进入基本块时一起计数。
+和 MTrace 一样只看 InstVisitor 执行的指令。
+
+结束时不自己排版，交给已有的工具：
+1. 每个函数的调用次数和每个基本块的执行次数写成 DynamicCallCounter 的二进制剖析文件（DCCProfileHeader 版本 2），
+   用 dynamic-profile -module <bitcode> 打印，多次运行的文件也能合并。
+2. 每种 opcode 的执行次数放进 OpcodeHistogram，用 OpcodeCounter 的 printOpcodeCounterResult 打印到标准错误。
+3. 周期和调用图这两个工具都没有，单独打印到标准错误。
+*/
+
+class MProfiler {
+    public:
+    // Path 是写出的 DynamicCallCounter 剖析文件
+    explicit MProfiler(std::string Path);
+    ~MProfiler();
+    MProfiler(const MProfiler &) = delete;
+    MProfiler &operator=(const MProfiler &) = delete;
+
+    void onInst(llvm::Instruction &I) {
+        Opcodes.add(I);
+        // 前一条是空或者 PHI，说明刚进入这个基本块
+        llvm::Instruction *Prev = I.getPrevNode();
+        if (!Prev || llvm::isa<llvm::PHINode>(Prev))
+            enterBlock(*I.getParent(), Prev);
+        else
+            ++Current->Insts;
+        if (llvm::isa<llvm::ReturnInst>(I))
+            leave(mCycles());
+    }
+
+    // 打印结果，只打印一次
+    void report();
+
+    private:
+    struct FuncProfile {
+        uint64_t Calls = 0;
+        uint64_t Insts = 0;
+        uint64_t Exclusive = 0;
+        uint64_t Inclusive = 0;
+        unsigned Active = 0;    // 在调用栈上出现了几次
+    };
+    struct EdgeProfile {
+        uint64_t Calls = 0;
+        uint64_t Inclusive = 0;
+    };
+    struct Frame {
+        const llvm::Function *F;
+        FuncProfile *Profile;
+        uint64_t Start;
+        uint64_t Children;
+    };
+
+    void enterBlock(llvm::BasicBlock &BB, llvm::Instruction *LastPHI);
+    void leave(uint64_t Now);
+    // 写 DynamicCallCounter 的剖析文件
+    void writeProfile();
+    void printCycles(llvm::raw_ostream &OutS);
+    static void reportActive();
+    static MProfiler *Active;
+
+    std::string Path;
+    bool Reported = false;
+    OpcodeHistogram Opcodes;
+    llvm::DenseMap<const llvm::BasicBlock *, uint64_t> Blocks;
+    // 调用栈里存着指针，用 std::map 保证插入时不移动
+    std::map<const llvm::Function *, FuncProfile> Functions;
+    llvm::DenseMap<std::pair<const llvm::Function *, const llvm::Function *>, EdgeProfile> Edges;
+    std::vector<Frame> Stack;
+    // 栈顶函数的统计，栈空的时候指向 Outside
+    FuncProfile *Current;
+    FuncProfile Outside;
+};
+
+#endif
@@ -0,0 +1,199 @@
+#include "MTier.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+#define DEBUG_TYPE "mtier"
+
+MTierJIT::MTierJIT(Module &M, MRuntime &RT, uint64_t Threshold)
+    : M(M), RT(RT), Threshold(Threshold) {}
+
+MTierJIT::State &MTierJIT::stateFor(Function *F) {
+    auto It = States.find(F);
+    if (It != States.end())
+        return It->second;
+    State &S = States[F];
+    SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 8> Edges;
+    FindFunctionBackedges(*F, Edges);
+    S.Backedges.insert(Edges.begin(), Edges.end());
+    S.HasBackedges = !Edges.empty();
+    return S;
+}
+
+MNativeFn MTierJIT::enter(Function *F) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    State &S = stateFor(F);
+    if (!S.Done && ++S.Hotness >= Threshold)
+        compile(F);
+    return S.Native;
+}
+
+void MTierJIT::branch(BasicBlock *From, BasicBlock *To) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    State &S = stateFor(From->getParent());
+    if (S.HasBackedges && S.Backedges.count({From, To}))
+        ++S.Hotness;
+}
+
+// 收集 F 直接调用到的所有定义过的函数。遇到间接调用或者取函数地址就放弃
+bool MTierJIT::collectCallees(Function *F, SmallPtrSetImpl<const Function *> &Closure) {
+    SmallVector<Function *, 16> Worklist;
+    Worklist.push_back(F);
+    Closure.insert(F);
+    while (!Worklist.empty()) {
+        Function *Cur = Worklist.pop_back_val();
+        mMaterialize(Cur);
+        for (Instruction &I : instructions(Cur)) {
+            for (Use &U : I.operands()) {
+                auto *Callee = dyn_cast<Function>(U.get()->stripPointerCasts());
+                auto *CB = dyn_cast<CallBase>(&I);
+                if (!Callee) {
+                    if (CB && U.get() == CB->getCalledOperand() && !CB->isInlineAsm())
+                        return false;
+                    continue;
+                }
+                if (!CB || !CB->isCallee(&U))
+                    return false;
+                if (!Callee->isDeclaration() && Closure.insert(Callee).second)
+                    Worklist.push_back(Callee);
+            }
+        }
+    }
+    return true;
+}
+
+MNativeFn MTierJIT::compile(Function *F) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    State &S = stateFor(F);
+    if (S.Done)
+        return S.Native;
+    S.Done = true;
+
+    // 参数和返回值要能放进槽里，包装函数才能传
+    if (F->isVarArg())
+        return nullptr;
+    for (Argument &Arg : F->args())
+        if (!MBytecodeEngine::isSlotType(Arg.getType()))
+            return nullptr;
+    if (!F->getReturnType()->isVoidTy() && !MBytecodeEngine::isSlotType(F->getReturnType()))
+        return nullptr;
+
+    SmallPtrSet<const Function *, 16> Closure;
+    if (!collectCallees(F, Closure)) {
+        LLVM_DEBUG(dbgs() << "mtier: " << F->getName() << " 用到了函数指针，不编译\n");
+        return nullptr;
+    }
+
+    Expected<MNativeFn> Native = compileClosure(F, Closure);
+    if (!Native) {
+        logAllUnhandledErrors(Native.takeError(), errs(), "mtier: " + F->getName() + ": ");
+        return nullptr;
+    }
+    LLVM_DEBUG(dbgs() << "mtier: " << F->getName() << " 编译成本地代码，热度 " << S.Hotness << "\n");
+    S.Native = *Native;
+    return S.Native;
+}
+
+Expected<MNativeFn> MTierJIT::compileClosure(Function *F, SmallPtrSetImpl<const Function *> &Closure) {
+    if (!J) {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        auto JIT = LLJITBuilder().create();
+        if (!JIT)
+            return JIT.takeError();
+        J = std::move(*JIT);
+    }
+    // 内存布局要和本机一致，否则结构体偏移对不上解释器的内存。没写 datalayout 的模块也按不一致处理
+    const DataLayout &DL = J->getDataLayout();
+    if (M.getDataLayout() != DL)
+        return make_error<StringError>("模块的数据布局和本机不同", inconvertibleErrorCode());
+
+    // 只克隆闭包里的函数定义，全局变量都变成声明
+    ValueToValueMapTy VMap;
+    std::unique_ptr<Module> Clone = CloneModule(M, VMap, [&](const GlobalValue *GV) {
+        auto *Fn = dyn_cast<Function>(GV);
+        return Fn && Closure.count(Fn);
+    });
+    Clone->setDataLayout(DL);
+    Clone->setTargetTriple(J->getTargetTriple().str());
+
+    // 包装函数：从槽数组取参数，结果零扩展后写回槽
+    Function *Target = cast<Function>(VMap[F]);
+    LLVMContext &Ctx = Clone->getContext();
+    Type *SlotPtrTy = Type::getInt64PtrTy(Ctx);
+    FunctionType *WrapperTy = FunctionType::get(Type::getVoidTy(Ctx), {SlotPtrTy, SlotPtrTy}, false);
+    std::string WrapperName = ("__mtier_" + F->getName()).str();
+    Function *Wrapper = Function::Create(WrapperTy, GlobalValue::ExternalLinkage, WrapperName, Clone.get());
+    IRBuilder<> Builder(BasicBlock::Create(Ctx, "entry", Wrapper));
+    SmallVector<Value *, 8> Args;
+    for (Argument &Arg : Target->args()) {
+        Value *SlotPtr = Builder.CreateConstGEP1_32(Builder.getInt64Ty(), Wrapper->getArg(0), Arg.getArgNo());
+        Value *ArgPtr = Builder.CreateBitCast(SlotPtr, PointerType::getUnqual(Arg.getType()));
+        Args.push_back(Builder.CreateLoad(Arg.getType(), ArgPtr));
+    }
+    Value *Ret = Builder.CreateCall(Target, Args);
+    if (!Ret->getType()->isVoidTy()) {
+        if (Ret->getType()->isIntegerTy() && Ret->getType()->getIntegerBitWidth() < 64)
+            Ret = Builder.CreateZExt(Ret, Builder.getInt64Ty());
+        Builder.CreateStore(Ret, Builder.CreateBitCast(Wrapper->getArg(1), PointerType::getUnqual(Ret->getType())));
+    }
+    Builder.CreateRetVoid();
+
+    // 每次编译一个新的 JITDylib，同一个被调函数可以在不同的闭包里各有一份
+    auto JD = J->createJITDylib("mtier" + std::to_string(NumDylibs++));
+    if (!JD)
+        return JD.takeError();
+
+    // 全局变量的声明指向解释器的内存。按克隆时的映射找原来的全局变量，@0 这种没名字的也能找到，
+    // 给它起个名字才能定义符号
+    SymbolMap Globals;
+    unsigned NumUnnamed = 0;
+    for (GlobalVariable &Orig : M.globals()) {
+        auto *GV = dyn_cast_or_null<GlobalVariable>(VMap.lookup(&Orig));
+        if (!GV || !GV->isDeclaration())
+            continue;
+        if (!GV->hasName())
+            GV->setName("__mtier_unnamed" + Twine(NumUnnamed++));
+        GV->setLinkage(GlobalValue::ExternalLinkage);
+        GV->setVisibility(GlobalValue::DefaultVisibility);
+        void *Addr = RT.constantValue(&Orig).PointerVal;
+        Globals[J->mangleAndIntern(GV->getName())] =
+            JITEvaluatedSymbol(pointerToJITTargetAddress(Addr), JITSymbolFlags::Exported);
+    }
+    if (Error Err = JD->define(absoluteSymbols(std::move(Globals))))
+        return Err;
+    auto Process = DynamicLibrarySearchGenerator::GetForCurrentProcess(DL.getGlobalPrefix());
+    if (!Process)
+        return Process.takeError();
+    JD->addGenerator(std::move(*Process));
+
+    // ThreadSafeModule 要独占 LLVMContext，借 bitcode 搬到新的 context 里
+    SmallVector<char, 0> Buffer;
+    raw_svector_ostream OS(Buffer);
+    WriteBitcodeToFile(*Clone, OS);
+    auto TSCtx = std::make_unique<LLVMContext>();
+    auto Parsed = parseBitcodeFile(MemoryBufferRef(StringRef(Buffer.data(), Buffer.size()), "mtier"), *TSCtx);
+    if (!Parsed)
+        return Parsed.takeError();
+    if (Error Err = J->addIRModule(*JD, ThreadSafeModule(std::move(*Parsed), std::move(TSCtx))))
+        return Err;
+
+    auto Sym = J->lookup(*JD, WrapperName);
+    if (!Sym)
+        return Sym.takeError();
+    return jitTargetAddressToFunction<MNativeFn>(Sym->getAddress());
+}
@@ -0,0 +1,63 @@
+#ifndef M_Tier_H
+#define M_Tier_H
+
+#include <memory>
+#include <mutex>
+#include <utility>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "MBytecode.h"
+
+/*
+分层执行
+
+冷函数解释执行，函数进入次数加循环回边次数超过阈值后，用 ORC LLJIT 把它编译成本地代码，之后的调用都直接跑本地代码。
+
+编译时把热函数和它直接调用到的所有函数克隆进一个新模块，全局变量只留声明，地址指向解释器已经分配好的内存，这样本地代码和解释器看到的是同一份数据。外部函数从当前进程里找。
+
+每个热函数会生成一个包装函数 void __mtier_<name>(MSlot *Args, MSlot *Ret)，参数和返回值都按字节码的槽来传，字节码和 InstVisitor 两条路径都用它调用本地代码。
+
+解释器里的函数指针其实是 llvm::Function*，本地代码没法调用，所以间接调用或者取了函数地址的函数不编译。解释执行中的那一次调用不会中途切换（没有 OSR），回边计数在下一次调用时生效。
+*/
+
+class MTierJIT {
+    public:
+    MTierJIT(llvm::Module &M, MRuntime &RT, uint64_t Threshold);
+
+    uint64_t threshold() const { return Threshold; }
+
+    // InstVisitor 路径：记一次进入，达到阈值就编译。返回本地代码，还没编译返回 nullptr
+    MNativeFn enter(llvm::Function *F);
+    // InstVisitor 路径：记一次跳转，是回边的话算进热度
+    void branch(llvm::BasicBlock *From, llvm::BasicBlock *To);
+
+    // 编译 F，失败或者不适合编译时返回 nullptr，结果会缓存
+    MNativeFn compile(llvm::Function *F);
+
+    private:
+    struct State {
+        uint64_t Hotness = 0;
+        MNativeFn Native = nullptr;
+        bool Done = false;
+        bool HasBackedges = false;
+        llvm::DenseSet<std::pair<const llvm::BasicBlock *, const llvm::BasicBlock *>> Backedges;
+    };
+    State &stateFor(llvm::Function *F);
+    bool collectCallees(llvm::Function *F, llvm::SmallPtrSetImpl<const llvm::Function *> &Closure);
+    llvm::Expected<MNativeFn> compileClosure(llvm::Function *F,
+                                             llvm::SmallPtrSetImpl<const llvm::Function *> &Closure);
+
+    // 字节码多线程执行时会同时来编译
+    std::recursive_mutex Lock;
+    llvm::Module &M;
+    MRuntime &RT;
+    uint64_t Threshold;
+    std::unique_ptr<llvm::orc::LLJIT> J;
+    unsigned NumDylibs = 0;
+    llvm::DenseMap<const llvm::Function *, State> States;
+};
+
+#endif
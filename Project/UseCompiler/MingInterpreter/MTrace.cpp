@@ -0,0 +1,84 @@
+#include "MTrace.h"
+#include <cstdlib>
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+void MTraceIds::number(const Function &F) {
+    uint32_t FuncId = Names.size();
+    Names.push_back(F.getName().str());
+    uint32_t Idx = 0;
+    for (const Instruction &I : instructions(F))
+        Ids[&I] = std::make_pair(FuncId, Idx++);
+}
+
+MRingTrace *MRingTrace::Active = nullptr;
+
+MRingTrace::MRingTrace(std::string Path, uint64_t Capacity) : Path(std::move(Path)) {
+    uint64_t Size = 1;
+    while (Size < Capacity)
+        Size <<= 1;
+    Ring.resize(Size);
+    Mask = Size - 1;
+
+    // 被解释的程序调用 exit 时解释器直接退出进程，析构函数不会执行
+    static bool Registered = (std::atexit(flushActive), true);
+    (void)Registered;
+    Active = this;
+}
+
+MRingTrace::~MRingTrace() {
+    flush();
+    if (Active == this)
+        Active = nullptr;
+}
+
+void MRingTrace::flushActive() {
+    if (Active)
+        Active->flush();
+}
+
+void MRingTrace::flush() {
+    if (Flushed)
+        return;
+    Flushed = true;
+
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+    if (EC) {
+        errs() << "mtrace: 打不开 " << Path << ": " << EC.message() << "\n";
+        return;
+    }
+    // 只给留下来的指令编号，函数名表按第一次出现的顺序
+    uint64_t Kept = Total < Ring.size() ? Total : Ring.size();
+    MTraceIds Ids;
+    std::vector<MTraceRecord> Records;
+    Records.reserve(Kept);
+    for (uint64_t i = Total - Kept; i < Total; i++) {
+        const Entry &E = Ring[i & Mask];
+        std::pair<uint32_t, uint32_t> Id = Ids.lookup(*E.Inst);
+        MTraceRecord R;
+        R.FuncId = Id.first;
+        R.InstIdx = Id.second;
+        R.Time = E.Time;
+        Records.push_back(R);
+    }
+
+    const std::vector<std::string> &Names = Ids.names();
+    MTraceHeader H;
+    H.Magic = M_TRACE_MAGIC;
+    H.Version = M_TRACE_VERSION;
+    H.Total = Total;
+    H.NumFunctions = Names.size();
+    H.NumRecords = Kept;
+    OS.write((const char *)&H, sizeof(H));
+    for (const std::string &Name : Names) {
+        uint32_t Len = Name.size();
+        OS.write((const char *)&Len, sizeof(Len));
+        OS.write(Name.data(), Len);
+    }
+    // 从最旧的一条开始写
+    OS.write((const char *)Records.data(), Records.size() * sizeof(MTraceRecord));
+}
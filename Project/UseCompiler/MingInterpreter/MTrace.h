@@ -0,0 +1,119 @@
+#ifndef M_Trace_H
+#define M_Trace_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+跟踪
+
+跟踪做成 MTraceInterpreter 的模板参数（策略），编译期决定，不跟踪时 onInst 是空的内联函数，主循环里什么也不剩。
+
+MRingTrace 把每条执行过的指令记成 16 字节的 (指令, 时间戳)，写进内存里的环形缓冲区，只保留最近的 N 条，热路径上不查表。
+进程结束时（包括被解释的程序调用 exit）才给留下来的指令编上 (函数编号, 指令下标)，和函数名表一起写成二进制文件，用 mingTraceDump 离线解码。
+
+文件格式，整数都是小端：
+  MTraceHeader
+  NumFunctions 个函数名，每个是 uint32_t 长度加上名字的字节
+  NumRecords 个 MTraceRecord，按时间从旧到新
+*/
+
+// 时间戳，x86 上是 TSC 周期数，其他平台是纳秒
+static inline uint64_t mCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t V;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(V));
+    return V;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+const uint32_t M_TRACE_MAGIC = 0x4352544d; // "MTRC"
+const uint32_t M_TRACE_VERSION = 1;
+
+struct MTraceHeader {
+    uint32_t Magic;
+    uint32_t Version;
+    uint64_t Total;        // 一共记录过多少条，超过容量的部分已经被覆盖
+    uint32_t NumFunctions;
+    uint32_t NumRecords;
+};
+
+struct MTraceRecord {
+    uint32_t FuncId;
+    uint32_t InstIdx;      // 指令在函数里的下标，按基本块顺序从 0 数
+    uint64_t Time;
+};
+
+// 给函数和指令编号，写文件时函数第一次出现就整体编一次
+class MTraceIds {
+    public:
+    std::pair<uint32_t, uint32_t> lookup(const llvm::Instruction &I) {
+        auto It = Ids.find(&I);
+        if (It != Ids.end())
+            return It->second;
+        number(*I.getFunction());
+        return Ids[&I];
+    }
+    const std::vector<std::string> &names() const { return Names; }
+
+    private:
+    void number(const llvm::Function &F);
+
+    llvm::DenseMap<const llvm::Instruction *, std::pair<uint32_t, uint32_t>> Ids;
+    std::vector<std::string> Names;
+};
+
+// 不跟踪
+struct MNoTrace {
+    void onInst(llvm::Instruction &) {}
+};
+
+// 环形缓冲区跟踪，Capacity 向上取到 2 的幂
+class MRingTrace {
+    public:
+    MRingTrace(std::string Path, uint64_t Capacity);
+    ~MRingTrace();
+    MRingTrace(const MRingTrace &) = delete;
+    MRingTrace &operator=(const MRingTrace &) = delete;
+
+    void onInst(llvm::Instruction &I) {
+        Entry &E = Ring[Total++ & Mask];
+        E.Inst = &I;
+        E.Time = mCycles();
+    }
+
+    // 写文件，只写一次
+    void flush();
+
+    private:
+    // 内存里的记录，写文件时换成 MTraceRecord
+    struct Entry {
+        const llvm::Instruction *Inst;
+        uint64_t Time;
+    };
+
+    static void flushActive();
+    static MRingTrace *Active;
+
+    std::string Path;
+    std::vector<Entry> Ring;
+    uint64_t Mask;
+    uint64_t Total = 0;
+    bool Flushed = false;
+};
+
+#endif
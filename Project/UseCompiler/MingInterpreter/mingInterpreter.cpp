@@ -1,7 +1,10 @@
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
 #include "MInterpreter.h"
+#include "MProfile.h"
 
 using namespace llvm;
 
@@ -10,26 +13,65 @@ namespace {
     bcFile(cl::desc("<input bitcode>"), cl::Positional, cl::init("-"));
     cl::list<std::string>
     commandArgs(cl::ConsumeAfter, cl::desc("<program arguments>..."));
+    cl::opt<std::string>
+    traceFile("trace", cl::desc("把执行过的指令记到这个文件，用 mingTraceDump 解码"),
+              cl::value_desc("filename"));
+    cl::opt<uint64_t>
+    traceSize("trace-size", cl::desc("跟踪缓冲区保留最近多少条指令"), cl::init(1 << 20));
+    cl::opt<std::string>
+    runsFile("runs", cl::desc("每行一组程序参数，初始化只做一次，每组参数 fork 一个子进程从初始化后的状态跑 main"),
+             cl::value_desc("filename"));
+    cl::opt<std::string>
+    profileFile("profile", cl::desc("统计每种指令、基本块、函数的执行次数和周期。调用次数和块次数写成 DynamicCallCounter 的剖析文件，用 dynamic-profile 打印；指令和周期打印到标准错误"),
+                cl::value_desc("filename"));
 }
 
-class MingInterpreter : public MInterpreter {
-    public:
-    MingInterpreter(Module *M) : MInterpreter(M) {};
-    virtual void execute(Instruction &I) {
-        I.print(errs());
-        MInterpreter::execute(I);
+// 按行读参数，空行跳过
+static bool readRuns(std::vector<std::vector<std::string>> &runs) {
+    auto Buf = MemoryBuffer::getFileOrSTDIN(runsFile);
+    if (!Buf) {
+        errs() << "打不开 " << runsFile << ": " << Buf.getError().message() << "\n";
+        return false;
     }
-};
+    SmallVector<StringRef, 16> Lines;
+    (*Buf)->getBuffer().split(Lines, '\n', -1, false);
+    for (StringRef Line : Lines) {
+        SmallVector<StringRef, 8> Words;
+        SplitString(Line, Words);
+        if (Words.empty())
+            continue;
+        std::vector<std::string> args(commandArgs.begin(), commandArgs.end());
+        for (StringRef W : Words)
+            args.push_back(W.str());
+        runs.push_back(args);
+    }
+    return true;
+}
 
 int main(int argc, char **argv, char * const *envp) {
-    sys::PrintStackTraceOnErrorSignal();
+    sys::PrintStackTraceOnErrorSignal(argv[0]);
     PrettyStackTraceProgram X(argc, argv);
 
     cl::ParseCommandLineOptions(argc, argv, " LLVM Interpreter\n");
-    return itpUtility<MingInterpreter>(bcFile, commandArgs, envp);
-    
+    if (!traceFile.empty() && !profileFile.empty()) {
+        errs() << "-trace 和 -profile 不能同时用\n";
+        return -1;
+    }
+    // 子进程各自写跟踪和剖析结果，会互相覆盖
+    if (!runsFile.empty() && (!traceFile.empty() || !profileFile.empty())) {
+        errs() << "-runs 不能和 -trace、-profile 一起用\n";
+        return -1;
+    }
+    if (!runsFile.empty()) {
+        std::vector<std::vector<std::string>> runs;
+        if (!readRuns(runs))
+            return -1;
+        return itpSnapshotUtility<MTraceInterpreter<MNoTrace>>(bcFile, runs, envp);
+    }
+    if (!profileFile.empty())
+        return itpUtility<MTraceInterpreter<MProfiler>>(bcFile, commandArgs, envp, profileFile.getValue());
+    if (traceFile.empty())
+        return itpUtility<MTraceInterpreter<MNoTrace>>(bcFile, commandArgs, envp);
+    return itpUtility<MTraceInterpreter<MRingTrace>>(bcFile, commandArgs, envp,
+                                                     traceFile.getValue(), traceSize.getValue());
 }
-
-
-
-
@@ -0,0 +1,107 @@
+#include <cstring>
+#include <vector>
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "MTrace.h"
+
+using namespace llvm;
+
+// 解码 mingInterpreter -trace 写出的文件，每条记录一行：
+// 序号 距上一条的时间 函数名:指令下标 [指令]
+
+namespace {
+    cl::opt<std::string>
+    traceFile(cl::desc("<trace file>"), cl::Positional, cl::Required);
+    cl::opt<std::string>
+    bcFile("bc", cl::desc("跟踪时用的 bitcode，给了就把指令也打印出来"),
+           cl::value_desc("filename"));
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, " MingInterpreter trace decoder\n");
+
+    auto Buffer = MemoryBuffer::getFile(traceFile);
+    if (!Buffer) {
+        errs() << "打不开 " << traceFile << ": " << Buffer.getError().message() << "\n";
+        return 1;
+    }
+    const char *P = (*Buffer)->getBufferStart();
+    const char *End = (*Buffer)->getBufferEnd();
+
+    MTraceHeader H;
+    if (End - P < (long)sizeof(H)) {
+        errs() << "文件太短\n";
+        return 1;
+    }
+    memcpy(&H, P, sizeof(H));
+    P += sizeof(H);
+    if (H.Magic != M_TRACE_MAGIC || H.Version != M_TRACE_VERSION) {
+        errs() << "不是跟踪文件，或者版本不对\n";
+        return 1;
+    }
+
+    std::vector<std::string> Names;
+    for (uint32_t i = 0; i < H.NumFunctions; i++) {
+        uint32_t Len;
+        if (End - P < (long)sizeof(Len)) {
+            errs() << "函数名表不完整\n";
+            return 1;
+        }
+        memcpy(&Len, P, sizeof(Len));
+        P += sizeof(Len);
+        if (End - P < (long)Len) {
+            errs() << "函数名表不完整\n";
+            return 1;
+        }
+        Names.push_back(std::string(P, Len));
+        P += Len;
+    }
+    if ((uint64_t)(End - P) < (uint64_t)H.NumRecords * sizeof(MTraceRecord)) {
+        errs() << "记录不完整\n";
+        return 1;
+    }
+
+    // 有 bitcode 的话按同样的顺序给指令编号
+    LLVMContext Context;
+    std::unique_ptr<Module> M;
+    std::vector<std::vector<const Instruction *>> Insts(Names.size());
+    if (!bcFile.empty()) {
+        SMDiagnostic Err;
+        M = parseIRFile(bcFile, Err, Context);
+        if (!M) {
+            Err.print(argv[0], errs());
+            return 1;
+        }
+        for (uint32_t i = 0; i < Names.size(); i++)
+            if (const Function *F = M->getFunction(Names[i]))
+                for (const Instruction &I : instructions(F))
+                    Insts[i].push_back(&I);
+    }
+
+    outs() << "# 共执行 " << H.Total << " 条，保留最后 " << H.NumRecords << " 条\n";
+    uint64_t First = H.Total - H.NumRecords;
+    uint64_t Last = 0;
+    for (uint32_t i = 0; i < H.NumRecords; i++) {
+        MTraceRecord R;
+        memcpy(&R, P, sizeof(R));
+        P += sizeof(R);
+        uint64_t Delta = i ? R.Time - Last : 0;
+        Last = R.Time;
+        outs() << First + i << "\t" << Delta << "\t";
+        if (R.FuncId < Names.size())
+            outs() << Names[R.FuncId];
+        else
+            outs() << "<" << R.FuncId << ">";
+        outs() << ":" << R.InstIdx;
+        if (R.FuncId < Insts.size() && R.InstIdx < Insts[R.FuncId].size())
+            outs() << "\t" << *Insts[R.FuncId][R.InstIdx];
+        outs() << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+; 只用字节码跑：InstVisitor 不能创建线程
+; 线程 a 在不能降级的函数（有原子 load）里等 m，线程 b 拿着 m 调另一个不能降级的函数。
+; a 在解释器里等锁时要放开 interpLock，否则 b 进不了解释器，两边互相等
+%union.m = type { [40 x i8] }
+@m = global %union.m zeroinitializer, align 8
+@total = global i64 0
+@flag = global i64 1
+declare i32 @pthread_create(i64*, i8*, i8* (i8*)*, i8*)
+declare i32 @pthread_join(i64, i8**)
+declare i32 @pthread_mutex_lock(%union.m*)
+declare i32 @pthread_mutex_unlock(%union.m*)
+; 原子 load 不能降级，走解释器，在里面等锁
+define void @locked_inc() {
+  %f = load atomic i64, i64* @flag seq_cst, align 8
+  %r = call i32 @pthread_mutex_lock(%union.m* @m)
+  %t = load i64, i64* @total
+  %t2 = add i64 %t, %f
+  store i64 %t2, i64* @total
+  %r2 = call i32 @pthread_mutex_unlock(%union.m* @m)
+  ret void
+}
+define i64 @peek() {
+  %f = load atomic i64, i64* @flag seq_cst, align 8
+  ret i64 %f
+}
+define i8* @a(i8* %x) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [0, %entry], [%n, %loop]
+  call void @locked_inc()
+  %n = add i32 %i, 1
+  %c = icmp slt i32 %n, 20000
+  br i1 %c, label %loop, label %done
+done:
+  ret i8* null
+}
+define i8* @b(i8* %x) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [0, %entry], [%n, %loop]
+  %r = call i32 @pthread_mutex_lock(%union.m* @m)
+  %f = call i64 @peek()
+  %t = load i64, i64* @total
+  %t2 = add i64 %t, %f
+  store i64 %t2, i64* @total
+  %r2 = call i32 @pthread_mutex_unlock(%union.m* @m)
+  %n = add i32 %i, 1
+  %c = icmp slt i32 %n, 20000
+  br i1 %c, label %loop, label %done
+done:
+  ret i8* null
+}
+define i32 @main() {
+  %ta = alloca i64
+  %tb = alloca i64
+  %r1 = call i32 @pthread_create(i64* %ta, i8* null, i8* (i8*)* @a, i8* null)
+  %r2 = call i32 @pthread_create(i64* %tb, i8* null, i8* (i8*)* @b, i8* null)
+  %ha = load i64, i64* %ta
+  %hb = load i64, i64* %tb
+  %j1 = call i32 @pthread_join(i64 %ha, i8** null)
+  %j2 = call i32 @pthread_join(i64 %hb, i8** null)
+  %tot = load i64, i64* @total
+  %ok = icmp eq i64 %tot, 40000
+  %ret = select i1 %ok, i32 0, i32 1
+  ret i32 %ret
+}
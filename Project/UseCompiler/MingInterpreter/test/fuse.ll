@@ -0,0 +1,66 @@
+; 字节码超级指令合成的几种形状，-bytecode 和 InstVisitor 跑出来都要返回 0
+
+; 计数循环：load 在循环头，循环体里 add 是第一条指令，后面跟 store 到同一个地址，不能合成
+define i64 @spin(i64 %n) {
+entry:
+  %c = alloca i64
+  store i64 0, i64* %c
+  br label %head
+head:
+  %v = load i64, i64* %c
+  %cmp = icmp slt i64 %v, %n
+  br i1 %cmp, label %body, label %exit
+body:
+  %v2 = add i64 %v, 1
+  store i64 %v2, i64* %c
+  br label %head
+exit:
+  ret i64 %v
+}
+
+; load p; add; store p 相邻，加数在左边，合成 ADD_MEM32
+define void @bump(i32* %p, i32 %k) {
+entry:
+  %v = load i32, i32* %p
+  %s = add i32 %k, %v
+  store i32 %s, i32* %p
+  ret void
+}
+
+; GEP + load 合成 LOAD*_IDX，icmp + br 合成 BR_<pred>
+define i32 @sum(i32* %a, i64 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [0, %entry], [%i2, %loop]
+  %acc = phi i32 [0, %entry], [%acc2, %loop]
+  %p = getelementptr i32, i32* %a, i64 %i
+  %x = load i32, i32* %p
+  %acc2 = add i32 %acc, %x
+  %i2 = add i64 %i, 1
+  %more = icmp ult i64 %i2, %n
+  br i1 %more, label %loop, label %done
+done:
+  ret i32 %acc2
+}
+
+define i32 @main() {
+entry:
+  %arr = alloca [4 x i32]
+  %a0 = getelementptr [4 x i32], [4 x i32]* %arr, i64 0, i64 0
+  %a1 = getelementptr [4 x i32], [4 x i32]* %arr, i64 0, i64 1
+  %a2 = getelementptr [4 x i32], [4 x i32]* %arr, i64 0, i64 2
+  %a3 = getelementptr [4 x i32], [4 x i32]* %arr, i64 0, i64 3
+  store i32 1, i32* %a0
+  store i32 2, i32* %a1
+  store i32 3, i32* %a2
+  store i32 4, i32* %a3
+  call void @bump(i32* %a3, i32 10)
+  %s = call i32 @sum(i32* %a0, i64 4)
+  %r = call i64 @spin(i64 1000)
+  %ok1 = icmp eq i32 %s, 20
+  %ok2 = icmp eq i64 %r, 1000
+  %ok = and i1 %ok1, %ok2
+  %ret = select i1 %ok, i32 0, i32 1
+  ret i32 %ret
+}
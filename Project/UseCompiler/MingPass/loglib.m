@@ -1,5 +1,96 @@
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-void runtimeLog(int i) {
-  printf("计算结果: %i\n", i);
-}
\ No newline at end of file
+/*
+MingPass 插桩的运行时。每个被插桩的整数运算有一个 MingSite，运行时只往里面累计，不打印：
+次数、最小值、最大值、和，以及按绝对值的位数分桶的直方图（负数 0~63，0 是 64，正数 65~127）。
+每个位置第一次被执行时挂到全局链表上，程序退出时一次打印所有位置。
+多线程下用原子操作更新，和可能溢出。
+*/
+
+#define MING_BUCKETS 128
+
+// 和 MingPass.cpp 里的 getSiteType 一致
+struct MingSite {
+  const char *name;
+  int64_t count;
+  int64_t min;
+  int64_t max;
+  int64_t sum;
+  int64_t hist[MING_BUCKETS];
+  struct MingSite *next;
+  int32_t registered;
+};
+
+static struct MingSite *sites = NULL;
+static int32_t reportRegistered = 0;
+
+static int bitLength(uint64_t v) {
+  return v == 0 ? 0 : 64 - __builtin_clzll(v);
+}
+
+static int bucketOf(int64_t v) {
+  if (v < 0) {
+    return 64 - bitLength(-(uint64_t)v);
+  }
+  return 64 + bitLength((uint64_t)v);
+}
+
+static void report(void) {
+  printf("==================================================\n");
+  printf("整数运算的值分布：\n");
+  printf("==================================================\n");
+  for (struct MingSite *s = sites; s; s = s->next) {
+    printf("%s\n  次数 %lld 最小值 %lld 最大值 %lld 平均值 %.2f\n", s->name, (long long)s->count,
+           (long long)s->min, (long long)s->max, s->count ? (double)s->sum / s->count : 0.0);
+    for (int b = 0; b < MING_BUCKETS; b++) {
+      if (s->hist[b] == 0) {
+        continue;
+      }
+      char range[64] = "0";
+      if (b != 64) {
+        // 第 b 个桶里绝对值的范围是 [2^(n-1), 2^n - 1]
+        int n = b < 64 ? 64 - b : b - 64;
+        uint64_t lo = 1ull << (n - 1);
+        uint64_t hi = n == 64 ? lo : (lo << 1) - 1;
+        snprintf(range, sizeof(range), "%s[%llu, %llu]", b < 64 ? "-" : "", (unsigned long long)lo,
+                 (unsigned long long)hi);
+      }
+      printf("    %-40s %lld\n", range, (long long)s->hist[b]);
+    }
+  }
+}
+
+// 第一次执行时挂到链表上
+static void registerSite(struct MingSite *s) {
+  int32_t expected = 0;
+  if (!__atomic_compare_exchange_n(&s->registered, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    return;
+  }
+  struct MingSite *head = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+  do {
+    s->next = head;
+  } while (!__atomic_compare_exchange_n(&sites, &head, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  expected = 0;
+  if (__atomic_compare_exchange_n(&reportRegistered, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    atexit(report);
+  }
+}
+
+void runtimeLogValue(struct MingSite *s, int64_t v) {
+  if (!__atomic_load_n(&s->registered, __ATOMIC_RELAXED)) {
+    registerSite(s);
+  }
+  __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->sum, v, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->hist[bucketOf(v)], 1, __ATOMIC_RELAXED);
+
+  int64_t old = __atomic_load_n(&s->min, __ATOMIC_RELAXED);
+  while (v < old && !__atomic_compare_exchange_n(&s->min, &old, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  old = __atomic_load_n(&s->max, __ATOMIC_RELAXED);
+  while (v > old && !__atomic_compare_exchange_n(&s->max, &old, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
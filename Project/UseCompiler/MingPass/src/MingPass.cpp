@@ -7,81 +7,192 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
 // #include "llvm/IR/DebugInfo.h"
+// 和 LeanLLVMPass 共用的函数过滤：-ming-allow、-ming-deny、-ming-filter-file、-ming-skip-hot
+#include "FunctionFilter.h"
 using namespace llvm;
 
+static FunctionFilterOptions FilterOpts("ming");
+
+// 只插桩这些运算，名字和 Instruction::getOpcodeName 一样，比如 add,mul,sdiv。默认全部整数运算
+static cl::list<std::string> Opcodes("ming-opcodes",
+                                     cl::desc("只插桩这些二元运算"),
+                                     cl::value_desc("opcode"),
+                                     cl::CommaSeparated);
+
+static bool wantOpcode(unsigned opcode) {
+    if (Opcodes.empty()) {
+        return true;
+    }
+    for (auto &name : Opcodes) {
+        if (name == Instruction::getOpcodeName(opcode)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 和 loglib.m 里的 struct MingSite 一致
+static const unsigned NumBuckets = 128;
+
+static StructType *getSiteType(LLVMContext &Context) {
+    Type *i64 = Type::getInt64Ty(Context);
+    Type *i8Ptr = Type::getInt8PtrTy(Context);
+    return StructType::get(Context, {i8Ptr, i64, i64, i64, i64, ArrayType::get(i64, NumBuckets), i8Ptr,
+                                     Type::getInt32Ty(Context)});
+}
+
+static GlobalVariable *createSite(Module &M, StructType *siteType, StringRef name) {
+    LLVMContext &Context = M.getContext();
+    Type *i64 = Type::getInt64Ty(Context);
+    Constant *nameStr = IRBuilder<>(Context).CreateGlobalStringPtr(name, "ming.site.name", 0, &M);
+    Constant *init = ConstantStruct::get(siteType, {
+        nameStr,
+        ConstantInt::get(i64, 0),
+        ConstantInt::get(i64, INT64_MAX),
+        ConstantInt::get(i64, INT64_MIN),
+        ConstantInt::get(i64, 0),
+        ConstantAggregateZero::get(siteType->getElementType(5)),
+        ConstantPointerNull::get(Type::getInt8PtrTy(Context)),
+        ConstantInt::get(Type::getInt32Ty(Context), 0)});
+    auto *site = new GlobalVariable(M, siteType, false, GlobalValue::PrivateLinkage, init, "ming.site");
+    site->setAlignment(Align(64));
+    return site;
+}
+
+// 把函数、基础块、指令打印出来，调试用。大模块上打印比插桩本身慢得多，默认关掉
+static cl::opt<bool> Dump("ming-dump",
+                          cl::desc("打印每个函数、基础块和指令"),
+                          cl::init(false));
+
+// 先把函数的诊断信息写进字符串，最后一次输出，函数之间不会交错
+static void dumpFunction(Function &F, raw_ostream &os) {
+    os << "函数名：" << F.getName() << "\n";
+    os << "函数参数个数：" << F.arg_size() << "\n";
+    for (auto &arg : F.args()) {
+        os << "参数名：" << arg.getName() << "\n";
+    }
+    os << "函数返回值个数：" << F.getReturnType()->getTypeID() << "\n";
+    os << "函数内容：\n";
+    F.print(os);
+    os << "\n";
+    for (auto &BB : F) {
+        os << "基础块：" << BB.getName() << "\n";
+        BB.print(os);
+        os << "\n";
+        for (auto &I : BB) {
+            os << "指令：" << "\n";
+            I.print(os);
+            os << "\n";
+        }
+    }
+}
+
+// 插桩一个函数，新旧 pass manager 共用。只改这个函数和新建的全局变量，不依赖别的函数
+static bool instrumentFunction(Function &F, const FunctionFilter &filter) {
+    // 运行时库自己不插桩
+    if (F.isDeclaration() || F.getName().startswith("runtimeLog") || !filter.shouldInstrument(F)) {
+        return false;
+    }
+
+    // // 获取对应源码信息
+    // Instruction *inst = F.getEntryBlock().getFirstNonPHI();
+    // DILocation *loc = inst->getDebugLoc();
+    // unsigned line = loc->getLine();
+    // StringRef file = loc->getFilename();
+    // StringRef dir = loc->getDirectory();
+    // errs() << *inst << "; file: " << file << "; dir: " << dir << "; line: " << line << "\n";
+
+    std::string dump;
+    raw_string_ostream dumpOS(dump);
+    if (Dump) {
+        dumpFunction(F, dumpOS);
+    }
+
+    // 运行时库里的 runtimeLogValue(struct MingSite *, int64_t)
+    LLVMContext &Context = F.getContext();
+    Module &M = *F.getParent();
+    StructType *siteType = getSiteType(Context);
+    FunctionType *funcType = FunctionType::get(Type::getVoidTy(Context),
+                                               {PointerType::getUnqual(siteType), Type::getInt64Ty(Context)}, false);
+    FunctionCallee logFunc = M.getOrInsertFunction("runtimeLogValue", funcType);
+
+    // 先把要插桩的整数运算挑出来，边遍历边插会打乱迭代
+    std::vector<BinaryOperator *> ops;
+    for (auto &BB : F) {
+        for (auto &I : BB) {
+            auto *op = dyn_cast<BinaryOperator>(&I);
+            if (op && op->getType()->isIntegerTy() && op->getType()->getIntegerBitWidth() <= 64 &&
+                wantOpcode(op->getOpcode())) {
+                ops.push_back(op);
+            }
+        } // end for (auto &I : BB)
+    } // end for (auto &BB : F)
+
+    // 每个运算一个 MingSite 全局变量，运行时在里面累计次数、最小值、最大值、和、直方图
+    for (unsigned idx = 0; idx < ops.size(); idx++) {
+        BinaryOperator *op = ops[idx];
+        std::string name;
+        raw_string_ostream os(name);
+        os << F.getName() << ":" << op->getOpcodeName() << "#" << idx;
+        if (op->hasName()) {
+            os << " %" << op->getName();
+        }
+        GlobalVariable *site = createSite(M, siteType, os.str());
+
+        // 在 op 后面插入调用，值统一扩展成 i64
+        IRBuilder<> builder(op->getNextNode());
+        Value *value = builder.CreateSExtOrTrunc(op, builder.getInt64Ty());
+        builder.CreateCall(logFunc, {site, value});
+    }
+
+    if (Dump) {
+        dumpOS << "插桩的整数运算：" << ops.size() << "\n\n";
+        errs() << dumpOS.str();
+    }
+    return !ops.empty();
+}
+
 namespace {
+    // 旧 pass manager
     struct MingPass : public FunctionPass {
         static char ID;
         MingPass() : FunctionPass(ID) {}
 
-        virtual bool runOnFunction(Function &F) {
-            // // 获取对应源码信息
-            // Instruction *inst = F.getEntryBlock().getFirstNonPHI();
-            // DILocation *loc = inst->getDebugLoc();
-            // unsigned line = loc->getLine();
-            // StringRef file = loc->getFilename();
-            // StringRef dir = loc->getDirectory();
-            // errs() << *inst << "; file: " << file << "; dir: " << dir << "; line: " << line << "\n";
-
-
-            // 从运行时库中获取函数
-            LLVMContext &Context = F.getContext();
-            std::vector<Type*> paramTypes = {Type::getInt32Ty(Context)};
-            Type *retType = Type::getVoidTy(Context);
-            FunctionType *funcType = FunctionType::get(retType, paramTypes, false);
-            FunctionCallee logFunc = F.getParent()->getOrInsertFunction("runtimeLog", funcType);
-
-            // 打印
-            errs() << "函数名：" << F.getName() << "\n";
-            errs() << "函数参数个数：" << F.arg_size() << "\n";
-            for (auto &arg : F.args()) {
-                errs() << "参数名：" << arg.getName() << "\n";
-            }
-            errs() << "函数返回值个数：" << F.getReturnType()->getTypeID() << "\n";
-            errs() << "函数内容：\n";
-            F.print(errs());
-            errs() << "\n";
-            for (auto &BB : F) {
-                errs() << "基础块：" << BB.getName() << "\n";
-                BB.print(errs());
-                errs() << "\n";
-                for (auto &I : BB) {
-                    errs() << "指令：" << "\n";
-                    I.print(errs());
-                    errs() << "\n";
-                    
-                    // 把两个数操作换成相乘
-                    if (auto *op = dyn_cast<BinaryOperator>(&I)) {
-                        IRBuilder<> builder(op);
-                        // // 取出 op 左右两个操作数
-                        // Value *lhs = op->getOperand(0);
-                        // Value *rhs = op->getOperand(1);
-                        // // 构造新的指令
-                        // Value *mul = builder.CreateMul(lhs, rhs);
-                        // // 替换指令
-                        // for(auto &U : op->uses()) {
-                        //     User *user = U.getUser();
-                        //     user->setOperand(U.getOperandNo(), mul);
-                        // }
-                        // // 删除旧指令
-                        // op->eraseFromParent();
-                        
-                        // 在 op 后面加入新指令
-                        builder.SetInsertPoint(&BB, ++builder.GetInsertPoint());
-                        // 在函数中插入新指令
-                        Value* args[] = {op};
-                        builder.CreateCall(logFunc, args);
-
-                        return true;
-                    } // end if
-                    
-                } // end for (auto &I : BB)
-            } // end for (auto &BB : F)
-            errs() << "\n";
+        // 过滤条件按模块读一次
+        std::unique_ptr<FunctionFilter> Filter;
+
+        virtual bool doInitialization(Module &) {
+            Filter.reset(new FunctionFilter(FilterOpts));
             return false;
+        }
+
+        virtual bool runOnFunction(Function &F) {
+            return instrumentFunction(F, *Filter);
         } // end runOnFunction
     }; // end struct MingPass
+
+    // 新 pass manager。是个函数 pass，不持有别的函数的状态，可以放进任意函数流水线
+    struct MingPassNew : public PassInfoMixin<MingPassNew> {
+        PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
+            // 过滤条件按模块读一次
+            if (!Filter || FilterModule != F.getParent()) {
+                Filter = std::make_shared<FunctionFilter>(FilterOpts);
+                FilterModule = F.getParent();
+            }
+            return instrumentFunction(F, *Filter) ? PreservedAnalyses::none() : PreservedAnalyses::all();
+        }
+
+        // 插桩只在函数内部加调用，不能跳过
+        static bool isRequired() { return true; }
+
+    private:
+        std::shared_ptr<FunctionFilter> Filter;
+        const Module *FilterModule = nullptr;
+    };
 } // end namespace
 
 char MingPass::ID = 0;
@@ -93,4 +204,30 @@ static void registerMingPass(const PassManagerBuilder &,
 }
 static RegisterStandardPasses
         RegisterMyPass(PassManagerBuilder::EP_EarlyAsPossible,
-                       registerMingPass);
\ No newline at end of file
+                       registerMingPass);
+
+/*
+新 pass manager 的注册：
+- opt -load-pass-plugin libMingPass.so -passes=ming <bitcode-file>，加上 -ming-dump 等选项时还要 -load libMingPass.so
+- clang -fpass-plugin=libMingPass.so 时在流水线最前面运行，对应旧的 EP_EarlyAsPossible
+第二个参数是优化级别，LLVM 13 和 14 的类型不一样，用 auto
+*/
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "MingPass", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) {
+                PB.registerPipelineParsingCallback(
+                    [](StringRef Name, FunctionPassManager &FPM,
+                       ArrayRef<PassBuilder::PipelineElement>) {
+                        if (Name == "ming") {
+                            FPM.addPass(MingPassNew());
+                            return true;
+                        }
+                        return false;
+                    });
+                PB.registerPipelineStartEPCallback(
+                    [](ModulePassManager &MPM, auto) {
+                        MPM.addPass(createModuleToFunctionPassAdaptor(MingPassNew()));
+                    });
+            }};
+}